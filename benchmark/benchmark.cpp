@@ -0,0 +1,342 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../preprocessor.h"
+#include "corpus.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double MinTime = 0.5;
+static const char* Filter = NULL;
+static unsigned int Threads = 0;
+
+struct Result
+{
+    unsigned int Iterations;
+    double       Best;         // Seconds per iteration
+    double       Mean;
+};
+
+template<typename F>
+static Result Measure( F func )
+{
+    Result r;
+    r.Iterations = 0;
+    r.Best = 1e30;
+
+    double total = 0.0;
+    while( total < MinTime || r.Iterations < 3 )
+    {
+        Clock::time_point start = Clock::now();
+        func();
+        double elapsed = std::chrono::duration<double>( Clock::now() - start ).count();
+        r.Best = ( elapsed < r.Best ? elapsed : r.Best );
+        total += elapsed;
+        r.Iterations++;
+    }
+    r.Mean = total / r.Iterations;
+    return r;
+}
+
+static bool Enabled( const char* name )
+{
+    return !Filter || strstr( name, Filter );
+}
+
+static void Report( const char* name, const Result& r, double bytes, double lines, double items, const char* item_name )
+{
+    fprintf( stdout, "%-28s %6u iter  best %10.3f ms  mean %10.3f ms", name, r.Iterations, r.Best * 1000.0, r.Mean * 1000.0 );
+    if( bytes > 0.0 )
+        fprintf( stdout, "  %8.2f MB/s", bytes / r.Best / ( 1024.0 * 1024.0 ) );
+    if( lines > 0.0 )
+        fprintf( stdout, "  %10.0f lines/s", lines / r.Best );
+    if( items > 0.0 )
+        fprintf( stdout, "  %8.1f ns/%s", r.Best * 1e9 / items, item_name );
+    fprintf( stdout, "\n" );
+}
+
+static std::string Concatenate( const Corpus& corpus )
+{
+    std::string all;
+    for( std::map<std::string, std::string>::const_iterator it = corpus.Files.begin(); it != corpus.Files.end(); ++it )
+        all += it->second;
+    return all;
+}
+
+static void BenchLex( const Corpus& corpus )
+{
+    std::string       text = Concatenate( corpus );
+    std::vector<char> buffer;
+    size_t            lexems = 0;
+
+    Result            r = Measure( [&]()
+        {
+            buffer.assign( text.begin(), text.end() );
+            Preprocessor::LexemList list;
+            Preprocessor::Lex( &buffer[0], &buffer[0] + buffer.size(), list );
+            lexems = list.size();
+        } );
+    Report( "Lex", r, (double) text.size(), (double) corpus.TotalLines(), (double) lexems, "lexem" );
+}
+
+static void BenchLexParallel( const Corpus& corpus )
+{
+    std::string       text = Concatenate( corpus );
+    std::vector<char> buffer;
+    size_t            lexems = 0;
+
+    Result            r = Measure( [&]()
+        {
+            buffer.assign( text.begin(), text.end() );
+            Preprocessor::LexemList list;
+            Preprocessor::LexParallel( &buffer[0], &buffer[0] + buffer.size(), list, Preprocessor::Lexem::NoPosition, Threads );
+            lexems = list.size();
+        } );
+    Report( "LexParallel", r, (double) text.size(), (double) corpus.TotalLines(), (double) lexems, "lexem" );
+}
+
+static void BenchExpandDefine()
+{
+    Preprocessor              preprocessor;
+    Preprocessor::StringOutStream errors;
+    preprocessor.Errors = &errors;
+
+    Preprocessor::DefineTable table;
+    preprocessor.Define( "OBJECT 1 + 2" );
+    preprocessor.Define( "FUNCTION #(a,b) ((a) * (b) + OBJECT)" );
+    preprocessor.Define( "NESTED #(a) FUNCTION(a, OBJECT)" );
+    table = preprocessor.CustomDefines;
+
+    std::string source;
+    for( int i = 0; i < 1000; i++ )
+        source += "x = OBJECT; y = FUNCTION(x, 3); z = NESTED(y); plain_identifier;\n";
+    std::vector<char>         buffer( source.begin(), source.end() );
+    Preprocessor::LexemList   input;
+    Preprocessor::Lex( &buffer[0], &buffer[0] + buffer.size(), input );
+
+    size_t                    expansions = 0;
+    Result                    r = Measure( [&]()
+        {
+            Preprocessor::LexemList lexems( input );
+            expansions = 0;
+            for( Preprocessor::LLITR itr = lexems.begin(); itr != lexems.end();)
+            {
+                if( itr->Type == Preprocessor::Lexem::IDENTIFIER )
+                {
+                    expansions++;
+                    itr = preprocessor.ExpandDefine( itr, lexems.end(), lexems, table );
+                }
+                else
+                    ++itr;
+            }
+        } );
+    Report( "ExpandDefine", r, 0.0, 0.0, (double) expansions, "identifier" );
+}
+
+static void BenchEvaluateExpression()
+{
+    Preprocessor              preprocessor;
+    Preprocessor::StringOutStream errors;
+    preprocessor.Errors = &errors;
+    preprocessor.Define( "A 5" );
+    preprocessor.Define( "B 3" );
+    preprocessor.Define( "C 0" );
+    Preprocessor::DefineTable table = preprocessor.CustomDefines;
+
+    std::string               source = "#if ( A + 2 * ( B - 1 ) > 3 && !C ) || A % 2 == 1 && B <= 10\n";
+    std::vector<char>         buffer( source.begin(), source.end() );
+    Preprocessor::LexemList   input;
+    Preprocessor::Lex( &buffer[0], &buffer[0] + buffer.size(), input );
+    input.pop_back();   // Newline and trailing lexem
+    input.pop_back();
+
+    const int                 count = 1000;
+    Result                    r = Measure( [&]()
+        {
+            for( int i = 0; i < count; i++ )
+            {
+                Preprocessor::LexemList directive( input );
+                preprocessor.EvaluateExpression( table, directive );
+            }
+        } );
+    Report( "EvaluateExpression", r, 0.0, 0.0, (double) count, "expression" );
+}
+
+static void BenchPrintLexemList( const Corpus& corpus )
+{
+    std::string             text = Concatenate( corpus );
+    std::vector<char>       buffer( text.begin(), text.end() );
+    Preprocessor::LexemList lexems;
+    Preprocessor::Lex( &buffer[0], &buffer[0] + buffer.size(), lexems );
+
+    size_t                  bytes = 0;
+    Result                  r = Measure( [&]()
+        {
+            Preprocessor::StringOutStream out;
+            Preprocessor::PrintLexemList( lexems, out );
+            bytes = out.String.size();
+        } );
+    Report( "PrintLexemList", r, (double) bytes, 0.0, (double) lexems.size(), "lexem" );
+}
+
+static void BenchLineNumberTranslator( const Corpus& corpus )
+{
+    Corpus                        loader = corpus;
+    Preprocessor                  preprocessor;
+    Preprocessor::StringOutStream out;
+    preprocessor.Preprocess( corpus.Root, out, NULL, &loader );
+
+    Preprocessor::LineNumberTranslator* lnt = preprocessor.GetLineNumberTranslator();
+    unsigned int                        lines = lnt->lines.empty() ? 1 : lnt->lines.back().StartLine + 1;
+    const int                           count = 10000;
+    unsigned int                        sum = 0;
+    Result                              r = Measure( [&]()
+        {
+            unsigned int line = 12345;
+            for( int i = 0; i < count; i++ )
+            {
+                line = line * 1103515245U + 12345U;
+                sum += lnt->Search( line % lines ).Offset;
+            }
+        } );
+    Report( "LineNumberTranslator::Search", r, 0.0, 0.0, (double) count, "search" );
+    if( sum == 1 )
+        fprintf( stdout, "\n" );
+}
+
+// Every node from global heap, baseline for default run arena
+struct HeapHook: public Preprocessor::AllocationHook
+{
+    void* Allocate( size_t size )              { return ::operator new( size, std::nothrow ); }
+    void  Deallocate( void* ptr, size_t size ) { (void) size; ::operator delete( ptr ); }
+};
+
+static void BenchPreprocess( const Corpus& corpus, Preprocessor::AllocationHook* hook, bool reuse, const char* name )
+{
+    Corpus       loader = corpus;
+    Preprocessor preprocessor;
+    size_t       bytes = 0;
+    int          errors = 0;
+    preprocessor.SetAllocationHook( hook );
+    preprocessor.SetReuse( reuse );
+
+    Result       r = Measure( [&]()
+        {
+            Preprocessor::StringOutStream out, err;
+            loader.BytesLoaded = 0;
+            errors = preprocessor.Preprocess( corpus.Root, out, &err, &loader );
+            bytes = loader.BytesLoaded;
+        } );
+    Report( name, r, (double) bytes, (double) corpus.TotalLines(), 0.0, NULL );
+    if( errors )
+        fprintf( stderr, "Preprocess reported %d errors\n", errors );
+}
+
+static void Usage()
+{
+    fprintf( stderr,
+             "Usage: benchmark [options]\n\n"
+             "  --seed N        generator seed\n"
+             "  --files N       number of files\n"
+             "  --depth N       include depth\n"
+             "  --fanout N      includes per file\n"
+             "  --macros N      macro uses per 100 lines\n"
+             "  --arity N       function-like macro arguments\n"
+             "  --nesting N     #if nesting\n"
+             "  --comments N    percent of comment lines\n"
+             "  --size N        bytes per file\n"
+             "  --write DIR     write corpus to existing directory and exit\n"
+             "  --threads N     LexParallel threads, 0 for all cores\n"
+             "  --filter NAME   run benchmarks containing NAME only\n"
+             "  --min-time SEC  minimum measuring time per benchmark\n\n" );
+    exit( EXIT_FAILURE );
+}
+
+int main( int argc, char** argv )
+{
+    CorpusConfig config;
+    const char*  write_dir = NULL;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( i + 1 >= argc )
+            Usage();
+
+        std::string  opt = argv[i];
+        const char*  val = argv[++i];
+        unsigned int num = (unsigned int) strtoul( val, NULL, 10 );
+        if( opt == "--seed" )
+            config.Seed = num;
+        else if( opt == "--files" )
+            config.Files = ( num ? num : 1 );
+        else if( opt == "--depth" )
+            config.IncludeDepth = num;
+        else if( opt == "--fanout" )
+            config.IncludeFanout = num;
+        else if( opt == "--macros" )
+            config.MacroDensity = num;
+        else if( opt == "--arity" )
+            config.MacroArity = num;
+        else if( opt == "--nesting" )
+            config.IfNesting = num;
+        else if( opt == "--comments" )
+            config.CommentRatio = num;
+        else if( opt == "--size" )
+            config.FileSize = num;
+        else if( opt == "--write" )
+            write_dir = val;
+        else if( opt == "--threads" )
+            Threads = num;
+        else if( opt == "--filter" )
+            Filter = val;
+        else if( opt == "--min-time" )
+            MinTime = atof( val );
+        else
+            Usage();
+    }
+
+    Corpus          corpus;
+    CorpusGenerator generator( config );
+    generator.Generate( corpus );
+
+    if( write_dir )
+    {
+        if( !corpus.Write( write_dir ) )
+        {
+            fprintf( stderr, "Unable to write corpus to <%s>\n", write_dir );
+            return( EXIT_FAILURE );
+        }
+        return( EXIT_SUCCESS );
+    }
+
+    fprintf( stdout, "Corpus: %u files, %.2f MB, %u lines\n\n", (unsigned int) corpus.Files.size(),
+             corpus.TotalSize() / ( 1024.0 * 1024.0 ), (unsigned int) corpus.TotalLines() );
+
+    if( Enabled( "Lex" ) )
+        BenchLex( corpus );
+    if( Enabled( "LexParallel" ) )
+        BenchLexParallel( corpus );
+    if( Enabled( "ExpandDefine" ) )
+        BenchExpandDefine();
+    if( Enabled( "EvaluateExpression" ) )
+        BenchEvaluateExpression();
+    if( Enabled( "PrintLexemList" ) )
+        BenchPrintLexemList( corpus );
+    if( Enabled( "LineNumberTranslator::Search" ) )
+        BenchLineNumberTranslator( corpus );
+    if( Enabled( "Preprocess" ) )
+        BenchPreprocess( corpus, NULL, false, "Preprocess" );
+    if( Enabled( "Preprocess (heap)" ) )
+    {
+        HeapHook heap;
+        BenchPreprocess( corpus, &heap, false, "Preprocess (heap)" );
+    }
+    if( Enabled( "Preprocess (reuse)" ) )
+        BenchPreprocess( corpus, NULL, true, "Preprocess (reuse)" );
+
+    return( EXIT_SUCCESS );
+}
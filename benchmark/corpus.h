@@ -0,0 +1,230 @@
+// Deterministic synthetic AngelScript corpus generator
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../preprocessor.h"
+
+struct CorpusConfig
+{
+    unsigned int Seed;
+    unsigned int Files;         // Total number of files, root included
+    unsigned int IncludeDepth;  // Maximum depth of include tree
+    unsigned int IncludeFanout; // Includes per file
+    unsigned int MacroDensity;  // Macro uses per 100 lines
+    unsigned int MacroArity;    // Arguments of function-like macros, 0 for object-like only
+    unsigned int IfNesting;     // Maximum nesting of conditional blocks
+    unsigned int CommentRatio;  // Percent of lines being comments
+    unsigned int FileSize;      // Approximate size of each file in bytes
+
+    CorpusConfig() :
+        Seed(1),
+        Files(64),
+        IncludeDepth(4),
+        IncludeFanout(4),
+        MacroDensity(20),
+        MacroArity(2),
+        IfNesting(3),
+        CommentRatio(15),
+        FileSize(16 * 1024)
+    {
+    }
+};
+
+struct Corpus: public Preprocessor::FileLoader
+{
+    std::string                        Root;       // Path to pass to Preprocess()
+    std::map<std::string, std::string> Files;      // Path with root dir -> content
+    size_t                             BytesLoaded;
+
+    Corpus() : BytesLoaded(0) {}
+
+    virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+    {
+        std::map<std::string, std::string>::iterator it = Files.find( dir + file_name );
+        if( it == Files.end() )
+            return false;
+        data.assign( it->second.begin(), it->second.end() );
+        BytesLoaded += data.size();
+        return true;
+    }
+
+    size_t TotalSize() const
+    {
+        size_t size = 0;
+        for( std::map<std::string, std::string>::const_iterator it = Files.begin(); it != Files.end(); ++it )
+            size += it->second.size();
+        return size;
+    }
+
+    size_t TotalLines() const
+    {
+        size_t lines = 0;
+        for( std::map<std::string, std::string>::const_iterator it = Files.begin(); it != Files.end(); ++it )
+            for( size_t i = 0; i < it->second.size(); i++ )
+                lines += ( it->second[i] == '\n' );
+        return lines;
+    }
+
+    // Writes corpus to disk, directory must exist
+    bool Write( const std::string& dir ) const
+    {
+        for( std::map<std::string, std::string>::const_iterator it = Files.begin(); it != Files.end(); ++it )
+        {
+            std::string path = dir + "/" + it->first.substr( it->first.find_last_of( '/' ) + 1 );
+            FILE*       fs = fopen( path.c_str(), "wb" );
+            if( !fs )
+                return false;
+            fwrite( it->second.c_str(), 1, it->second.size(), fs );
+            fclose( fs );
+        }
+        return true;
+    }
+};
+
+class CorpusGenerator
+{
+public:
+    CorpusGenerator( const CorpusConfig& config ) : Config( config ), State( config.Seed * 2654435761U + 1 ) {}
+
+    void Generate( Corpus& corpus )
+    {
+        corpus.Files.clear();
+        corpus.Root = "corpus/root.as";
+
+        // Breadth-first include tree, limited by file count and depth
+        std::vector<unsigned int> depth( 1, 0 );
+        std::vector<std::vector<unsigned int> > children( 1 );
+        for( size_t parent = 0; parent < depth.size() && depth.size() < Config.Files; parent++ )
+        {
+            if( depth[parent] >= Config.IncludeDepth )
+                continue;
+            for( unsigned int i = 0; i < Config.IncludeFanout && depth.size() < Config.Files; i++ )
+            {
+                children[parent].push_back( (unsigned int) depth.size() );
+                depth.push_back( depth[parent] + 1 );
+                children.push_back( std::vector<unsigned int>() );
+            }
+        }
+
+        for( unsigned int file = 0; file < depth.size(); file++ )
+            corpus.Files["corpus/" + FileName( file )] = GenerateFile( file, children[file] );
+    }
+
+    static std::string FileName( unsigned int file )
+    {
+        return file ? "file" + Preprocessor::IntToString( file ) + ".as" : "root.as";
+    }
+
+private:
+    CorpusConfig Config;
+    unsigned int State;
+
+    unsigned int Random( unsigned int range )
+    {
+        State ^= State << 13;
+        State ^= State >> 17;
+        State ^= State << 5;
+        return range ? State % range : 0;
+    }
+
+    std::string Name( const char* prefix, unsigned int file, unsigned int index )
+    {
+        return prefix + Preprocessor::IntToString( file ) + "_" + Preprocessor::IntToString( index );
+    }
+
+    std::string MacroUse( unsigned int file, unsigned int macros )
+    {
+        unsigned int m = Random( macros );
+        if( m % 2 == 0 || !Config.MacroArity )
+            return Name( "OBJ", file, m );
+
+        std::string use = Name( "FUN", file, m ) + "(";
+        for( unsigned int a = 0; a < Config.MacroArity; a++ )
+            use += ( a ? ", " : "" ) + std::string( "v" ) + Preprocessor::IntToString( Random( 4 ) );
+        return use + ")";
+    }
+
+    std::string GenerateFile( unsigned int file, const std::vector<unsigned int>& includes )
+    {
+        std::string text;
+        std::string guard = "FILE" + Preprocessor::IntToString( file ) + "_AS";
+        text += "#ifndef " + guard + "\n#define " + guard + "\n\n";
+
+        for( size_t i = 0; i < includes.size(); i++ )
+            text += "#include \"" + FileName( includes[i] ) + "\"\n";
+        text += "\n";
+
+        unsigned int macros = 8;
+        for( unsigned int m = 0; m < macros; m++ )
+        {
+            if( m % 2 == 0 || !Config.MacroArity )
+            {
+                text += "#define " + Name( "OBJ", file, m ) + " " + Preprocessor::IntToString( Random( 1000 ) ) + "\n";
+            }
+            else
+            {
+                std::string args, body;
+                for( unsigned int a = 0; a < Config.MacroArity; a++ )
+                {
+                    args += ( a ? "," : "" ) + std::string( "a" ) + Preprocessor::IntToString( a );
+                    body += ( a ? " + " : "" ) + std::string( "a" ) + Preprocessor::IntToString( a ) + " * " + Preprocessor::IntToString( Random( 10 ) );
+                }
+                text += "#define " + Name( "FUN", file, m ) + " #(" + args + ") (" + body + ")\n";
+            }
+        }
+        text += "\n";
+
+        unsigned int function = 0;
+        while( text.size() < Config.FileSize )
+        {
+            text += "int " + Name( "func", file, function++ ) + "( int v0, int v1, int v2, int v3 )\n{\n    int result = 0;\n";
+            GenerateBlock( text, file, macros, 1 );
+            text += "    return result;\n}\n\n";
+        }
+
+        text += "#endif // " + guard + "\n";
+        return text;
+    }
+
+    void GenerateBlock( std::string& text, unsigned int file, unsigned int macros, unsigned int nesting )
+    {
+        std::string  indent( nesting * 4, ' ' );
+        unsigned int lines = 4 + Random( 8 );
+        for( unsigned int l = 0; l < lines; l++ )
+        {
+            unsigned int kind = Random( 100 );
+            if( kind < Config.CommentRatio )
+            {
+                if( Random( 2 ) )
+                    text += indent + "// Comment line " + Preprocessor::IntToString( Random( 100000 ) ) + " describing result\n";
+                else
+                    text += indent + "/* Block comment\n" + indent + "   spanning two lines */\n";
+            }
+            else if( kind < Config.CommentRatio + 5 && nesting <= Config.IfNesting )
+            {
+                if( Random( 2 ) )
+                    text += "#ifdef " + Name( "OBJ", file, Random( macros ) & ~1U ) + "\n";
+                else
+                    text += "#if " + Name( "OBJ", file, Random( macros ) & ~1U ) + " > 500\n";
+                GenerateBlock( text, file, macros, nesting + 1 );
+                text += "#endif\n";
+            }
+            else if( Random( 100 ) < Config.MacroDensity )
+            {
+                text += indent + "result += " + MacroUse( file, macros ) + ";\n";
+            }
+            else
+            {
+                text += indent + "result = result * " + Preprocessor::IntToString( Random( 100 ) ) + " + v" + Preprocessor::IntToString( Random( 4 ) ) + "; string s = \"text\";\n";
+            }
+        }
+    }
+};
+
+#endif // CORPUS_H
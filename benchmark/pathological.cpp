@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../preprocessor.h"
+#include "corpus.h"
+
+// Adversarial inputs, each one is preprocessed at size N and 4 * N.
+// Run fails if time grows faster than allowed ratio or exceeds budget at 4 * N.
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string Num( unsigned int i )
+{
+    return Preprocessor::IntToString( (int) i );
+}
+
+// #define M1 M0, #define M2 M1, ... and many uses of the last one
+static void DeepMacroChain( unsigned int n, Corpus& corpus )
+{
+    std::string& text = corpus.Files["case/root.as"];
+    text = "#define M0 value\n";
+    for( unsigned int i = 1; i < n; i++ )
+        text += "#define M" + Num( i ) + " M" + Num( i - 1 ) + "\n";
+    for( unsigned int i = 0; i < n; i++ )
+        text += "int v" + Num( i ) + " = M" + Num( n - 1 ) + ";\n";
+}
+
+// Root includes N distinct files
+static void WideIncludes( unsigned int n, Corpus& corpus )
+{
+    std::string& root = corpus.Files["case/root.as"];
+    for( unsigned int i = 0; i < n; i++ )
+    {
+        root += "#include \"inc" + Num( i ) + ".as\"\n";
+        corpus.Files["case/inc" + Num( i ) + ".as"] = "int f" + Num( i ) + "() { return " + Num( i ) + "; }\n";
+    }
+}
+
+// Single line of N statements
+static void HugeSingleLine( unsigned int n, Corpus& corpus )
+{
+    std::string& text = corpus.Files["case/root.as"];
+    text = "#define K 3\n";
+    for( unsigned int i = 0; i < n; i++ )
+        text += "a = b * K + \"str\"; ";
+    text += "\n";
+}
+
+// N nested #if blocks, each level with inactive sibling block
+static void NestedIfs( unsigned int n, Corpus& corpus )
+{
+    std::string& text = corpus.Files["case/root.as"];
+    text = "#define ON 1\n";
+    for( unsigned int i = 0; i < n; i++ )
+        text += "#if ON\nint a" + Num( i ) + ";\n#ifdef OFF\nint b" + Num( i ) + ";\n#endif\n";
+    for( unsigned int i = 0; i < n; i++ )
+        text += "#endif\n";
+}
+
+// Function-like macro with N arguments, used N times
+static void LongArgumentList( unsigned int n, Corpus& corpus )
+{
+    std::string& text = corpus.Files["case/root.as"];
+    std::string  args, body, call;
+    for( unsigned int i = 0; i < n; i++ )
+    {
+        args += ( i ? "," : "" ) + std::string( "a" ) + Num( i );
+        body += ( i ? "+" : "" ) + std::string( "a" ) + Num( i );
+        call += ( i ? ", " : "" ) + Num( i );
+    }
+    text = "#define SUM #(" + args + ") (" + body + ")\n";
+    for( unsigned int i = 0; i < 64; i++ )
+        text += "int s" + Num( i ) + " = SUM(" + call + ");\n";
+}
+
+// Many include ranges in line number translator, every output line resolved
+static void ResolveAllLines( Preprocessor& preprocessor, const Preprocessor::StringOutStream& out )
+{
+    unsigned int lines = (unsigned int) std::count( out.String.begin(), out.String.end(), '\n' );
+    unsigned int sum = 0;
+    for( unsigned int line = 0; line < lines; line++ )
+        sum += preprocessor.ResolveOriginalLine( line );
+    if( sum == 0xFFFFFFFF )
+        fprintf( stdout, "\n" );
+}
+
+struct Case
+{
+    const char* Name;
+    void        (* Generate)( unsigned int n, Corpus& corpus );
+    unsigned int Size;
+    bool         ResolveLines;
+    double       MaxRatio;  // Of time at 4 * Size to time at Size, 4 is linear
+    double       Budget;    // Seconds at 4 * Size
+};
+
+static const Case Cases[] =
+{
+    { "deep macro chain",    DeepMacroChain,   5000,  false, 8.0, 2.0 },
+    { "wide includes",       WideIncludes,     2000,  false, 8.0, 2.0 },
+    { "huge single line",    HugeSingleLine,   50000, false, 8.0, 2.0 },
+    { "nested ifs",          NestedIfs,        2000,  false, 8.0, 2.0 },
+    { "long argument list",  LongArgumentList, 500,   false, 8.0, 2.0 },
+    { "line translator",     WideIncludes,     2000,  true,  8.0, 2.0 },
+};
+
+static double Run( const Case& c, unsigned int n, int& errors )
+{
+    Corpus corpus;
+    corpus.Root = "case/root.as";
+    c.Generate( n, corpus );
+
+    double best = 1e30;
+    for( int i = 0; i < 3; i++ )
+    {
+        Preprocessor                  preprocessor;
+        Preprocessor::StringOutStream out, err;
+        Clock::time_point             start = Clock::now();
+        errors = preprocessor.Preprocess( corpus.Root, out, &err, &corpus );
+        if( c.ResolveLines )
+            ResolveAllLines( preprocessor, out );
+        double                        elapsed = std::chrono::duration<double>( Clock::now() - start ).count();
+        best = ( elapsed < best ? elapsed : best );
+    }
+    return best;
+}
+
+int main( int argc, char** argv )
+{
+    const char* filter = ( argc > 1 ? argv[1] : NULL );
+    int         failed = 0;
+
+    for( size_t i = 0; i < sizeof( Cases ) / sizeof( Cases[0] ); i++ )
+    {
+        const Case& c = Cases[i];
+        if( filter && !strstr( c.Name, filter ) )
+            continue;
+
+        int    errors = 0;
+        double small = Run( c, c.Size, errors );
+        double large = Run( c, c.Size * 4, errors );
+        double ratio = large / ( small > 1e-6 ? small : 1e-6 );
+        bool   ok = ( ratio <= c.MaxRatio && large <= c.Budget && !errors );
+
+        fprintf( stdout, "%-4s %-20s n=%-7u %9.3f ms  4n=%-7u %9.3f ms  ratio %5.2f (max %.1f)  budget %.1f s%s\n",
+                 ok ? "OK" : "FAIL", c.Name, c.Size, small * 1000.0, c.Size * 4, large * 1000.0, ratio, c.MaxRatio, c.Budget,
+                 errors ? "  preprocessor errors" : "" );
+        if( !ok )
+            failed++;
+    }
+
+    if( failed )
+    {
+        fprintf( stderr, "%d case(s) failed\n", failed );
+        return( EXIT_FAILURE );
+    }
+    return( EXIT_SUCCESS );
+}
@@ -0,0 +1,43 @@
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "../preprocessor.h"
+
+int main( int argc, char** argv )
+{
+    if( argc < 3 )
+    {
+        fprintf( stderr, "Usage: archive [archive_file] [script_file]...\n\n"
+                         "Script files are stored under given paths, relative to path later passed to Preprocess()\n\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    std::map<std::string, std::string> files;
+    for( int i = 2; i < argc; i++ )
+    {
+        FILE* fs = fopen( argv[i], "rb" );
+        if( !fs )
+        {
+            fprintf( stderr, "Unable to read file <%s>\n", argv[i] );
+            return( EXIT_FAILURE );
+        }
+
+        std::string& content = files[argv[i]];
+        char         buffer[4096];
+        size_t       n;
+        while( ( n = fread( buffer, 1, sizeof( buffer ), fs ) ) > 0 )
+            content.append( buffer, n );
+        fclose( fs );
+    }
+
+    if( !Preprocessor::ArchiveLoader::Build( argv[1], files ) )
+    {
+        fprintf( stderr, "Unable to build archive <%s>, paths must be unique\n", argv[1] );
+        return( EXIT_FAILURE );
+    }
+
+    fprintf( stdout, "%u files written to <%s>\n", (unsigned int) files.size(), argv[1] );
+
+    return( EXIT_SUCCESS );
+}
@@ -1,5 +1,4 @@
 #include <cstdlib>
-#include <set>
 #include <string>
 #include <vector>
 
@@ -7,38 +6,12 @@
 #include "../preprocessor.h"
 
 // #pragma dummy "some text"
-class DummyPragma
+class DummyPragma : public Preprocessor::Pragma::Handler
 {
 public:
-    void Call( const std::string& text )
+    void Call( const Preprocessor::Pragma::Instance& instance )
     {
-        fprintf( stdout, "DummyPragma: text<%s>\n", text.c_str() );
-    }
-};
-
-class MyPragmaCallback : public Preprocessor::Pragma::Callback
-{
-private:
-    std::set<std::string> alreadyProcessed;
-    DummyPragma* dummy;
-
-public:
-    MyPragmaCallback()
-    {
-        dummy = new DummyPragma();
-    }
-
-    void CallPragma( const std::string& name, const Preprocessor::Pragma::Instance& instance )
-    {
-        if( alreadyProcessed.count( name + instance.Text ))
-            return;
-
-        alreadyProcessed.insert( name + instance.Text );
-
-        if( name == "dummy" )
-            dummy->Call( instance.Text );
-        else
-            fprintf( stderr, "Warning: Unknown pragma name <%s> text <%s>\n", name.c_str(), instance.Text.c_str() );
+        fprintf( stdout, "DummyPragma: text<%s>\n", instance.Text.c_str() );
     }
 };
 
@@ -52,7 +25,10 @@ int main( int argc, char** argv )
 
     Preprocessor preprocessor;
     Preprocessor::StringOutStream result, errors;
-    preprocessor.SetPragmaCallback( new MyPragmaCallback() );
+    Preprocessor::Pragma::Registry registry( Preprocessor::Pragma::DEDUP_ALL, Preprocessor::Pragma::UNKNOWN_WARN );
+    DummyPragma dummy;
+    registry.Register( "dummy", &dummy );
+    preprocessor.SetPragmaRegistry( &registry );
     int errors_count = preprocessor.Preprocess( argv[1], result, &errors );
 
     if( errors.String != "" )
@@ -37,15 +37,47 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
+#include <new>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#if !defined(_WIN32)
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #include <sys/types.h>
+    #include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <stdint.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+        #define HAVE_IO_URING 1
+    #endif
+#endif
+
+#if defined(__linux__)
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #define HAVE_INOTIFY 1
+#endif
+
 #include "preprocessor.h"
 
 const std::string Preprocessor::Numbers         = "0123456789";
@@ -71,16 +103,54 @@ const Preprocessor::Lexem::LexemType Preprocessor::TrivialTypes[12]  =
     Preprocessor::Lexem::CLOSE
 };
 
+const unsigned int Preprocessor::Lexem::NoPosition;
+const unsigned int Preprocessor::SourceMap::CheckpointInterval;
+const unsigned int Preprocessor::TokenStream::Version;
+const unsigned int Preprocessor::ArchiveLoader::Version;
+const size_t       Preprocessor::EmitSlice;
+
 Preprocessor::Preprocessor() :
     IncludeTranslator(NULL),
     CurPragmaCallback(NULL),
+    CurPragmaDispatch(Pragma::DISPATCH_SYNC),
+    PragmaWorker(NULL),
+    CurPragmaRegistry(NULL),
+    CurSourceMap(NULL),
+    CurOutputFormat(OUTPUT_TEXT),
+    CurStatistics(NULL),
+    CurProfile(NULL),
+    CurTrace(NULL),
+    LexThreads(1),
+    LexThreadsMinSize(4 * 1024 * 1024),
+    CurLexemCache(NULL),
+    CurAllocationHook(NULL),
+    Reuse(false),
+    MemoryBudget(0),
     Errors(NULL),
     ErrorsCount(0),
     LNT(NULL),
     CurrentLine(0),
     LinesThisFile(0),
-    SkipPragmas(false)
+    SkipPragmas(false),
+    CurJob(NULL),
+    Cancelled(false),
+    StreamDestination(NULL),
+    StreamSpace(false),
+    StreamColumn(0),
+    BudgetExceeded(false),
+    SkipExpansions(false)
+{
+}
+
+Preprocessor::~Preprocessor()
 {
+    if( AsyncThread.joinable() )
+    {
+        AsyncJob->Cancel();
+        AsyncThread.join();
+    }
+    delete PragmaWorker;
+    delete LNT;
 }
 
 /************************************************************************/
@@ -89,1007 +159,5319 @@ Preprocessor::Preprocessor() :
 
 Preprocessor::LineNumberTranslator::Entry& Preprocessor::LineNumberTranslator::Search( unsigned int line_number )
 {
-    for( size_t i = 1; i < lines.size(); ++i )
+    // Ranges are added in order of start line, find the first block after our line
+    size_t first = 1;
+    size_t count = ( lines.size() > 1 ? lines.size() - 1 : 0 );
+    while( count > 0 )
     {
-        if( line_number < lines[i].StartLine )
+        size_t step = count / 2;
+        if( lines[first + step].StartLine <= line_number )
         {
-            // Found the first block after our line
-            return lines[i-1];
+            first += step + 1;
+            count -= step + 1;
         }
+        else
+            count = step;
     }
-    return lines[lines.size()-1];     // Line must be in last block
+    return lines[first - 1];
 }
 
+// Growth of entries is tracked by context of running Preprocess()
 void Preprocessor::LineNumberTranslator::AddLineRange( const std::string& file, unsigned int start_line, unsigned int offset )
 {
-    Entry e;
+    size_t capacity = lines.capacity();
+    lines.push_back( Entry() );
+    Entry& e = lines.back();
     e.File = file;
     e.StartLine = start_line;
     e.Offset = offset;
-    lines.push_back( e );
+
+    MemoryContext* memory = MemoryContext::Current();
+    if( !memory )
+        return;
+    if( lines.capacity() != capacity )
+    {
+        memory->CountHeapAllocations( 1 );
+        memory->Track( MemoryContext::MEMORY_LINES, ( lines.capacity() - capacity ) * sizeof( Entry ), true );
+    }
+    memory->CountString( e.File );
 }
 
 /************************************************************************/
-/* Preprocess                                                           */
+/* Source map                                                           */
 /************************************************************************/
 
-void Preprocessor::PrintMessage( const std::string& msg )
+static const char Base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void EncodeVLQ( std::string& out, int value )
 {
-    ( *Errors ) << CurrentFile << " (" << LinesThisFile << ") " << msg << "\n";
+    unsigned int vlq = ( value < 0 ? ( ( (unsigned int) -value ) << 1 ) | 1 : ( (unsigned int) value ) << 1 );
+    do
+    {
+        unsigned int digit = vlq & 31;
+        vlq >>= 5;
+        if( vlq )
+            digit |= 32;
+        out += Base64Chars[digit];
+    }
+    while( vlq );
 }
 
-void Preprocessor::PrintErrorMessage( const std::string& errmsg )
+static bool DecodeVLQ( const char*& str, const char* end, int& value )
 {
-    std::string err = "Error";
-    if( !( errmsg.empty() || errmsg.length() == 0 ))
+    unsigned int result = 0;
+    unsigned int shift = 0;
+    while( str != end )
     {
-        err += ": ";
-        err += errmsg;
+        const char* c = (const char*) memchr( Base64Chars, *str++, 64 );
+        if( !c )
+            return false;
+        unsigned int digit = (unsigned int) ( c - Base64Chars );
+        result |= ( digit & 31 ) << shift;
+        if( !( digit & 32 ) )
+        {
+            value = ( result & 1 ? -(int) ( result >> 1 ) : (int) ( result >> 1 ) );
+            return true;
+        }
+        shift += 5;
     }
-
-    PrintMessage( err );
-    ErrorsCount++;
+    return false;
 }
 
-void Preprocessor::PrintWarningMessage( const std::string& warnmsg )
+static std::string EscapeJSON( const std::string& str )
 {
-    std::string warn = "Warning";
-    if( !(warnmsg.empty() || warnmsg.length() == 0 ))
+    std::string result;
+    result.reserve( str.length() );
+    for( size_t i = 0; i < str.length(); i++ )
     {
-        warn += ": ";
-        warn += warnmsg;
+        char c = str[i];
+        if( c == '\"' || c == '\\' )
+        {
+            result += '\\';
+            result += c;
+        }
+        else if( c == '\n' )
+            result += "\\n";
+        else if( c == '\t' )
+            result += "\\t";
+        else if( (unsigned char) c < 0x20 )
+            result += ' ';
+        else
+            result += c;
     }
+    return result;
+}
 
-    PrintMessage( warn );
+Preprocessor::SourceMap::SourceMap() :
+    TrackExpansions(true)
+{
+    Clear();
 }
 
-std::string Preprocessor::RemoveQuotes( const std::string& in )
+void Preprocessor::SourceMap::Clear()
 {
-    return in.substr( 1, in.size() - 2 );
+    Files.clear();
+    Expansions.clear();
+    Mappings.clear();
+    Checkpoints.clear();
+
+    GeneratedLine = 0;
+    PrevGeneratedColumn = 0;
+    Prev.File = 0;
+    Prev.Line = 0;
+    Prev.Column = 0;
+    Prev.Expansion = 0;
+
+    Checkpoint cp;
+    cp.Offset = 0;
+    cp.State = Prev;
+    Checkpoints.push_back( cp );
 }
 
-void Preprocessor::SetPragmaCallback( Pragma::Callback* callback )
+unsigned int Preprocessor::SourceMap::AddExpansion( const std::string& macro, const Lexem& call_site )
 {
-    CurPragmaCallback = callback;
+    Expansion e;
+    e.Macro = macro;
+    e.File = call_site.File;
+    e.Line = call_site.Line;
+    e.Column = call_site.Column;
+    e.Parent = call_site.Expansion;
+    Expansions.push_back( e );
+    return (unsigned int) ( Expansions.size() - 1 );
 }
 
-void Preprocessor::CallPragma( const std::string& name, std::string pragma )
+void Preprocessor::SourceMap::AddMapping( unsigned int column, const Lexem& lexem )
 {
-    if( CurPragmaCallback )
+    if( !Mappings.empty() && Mappings[Mappings.size() - 1] != ';' )
+        Mappings += ',';
+
+    EncodeVLQ( Mappings, (int) ( column - PrevGeneratedColumn ) );
+    PrevGeneratedColumn = column;
+
+    // Generated lexems have only output column
+    if( lexem.File == Lexem::NoPosition )
+        return;
+
+    EncodeVLQ( Mappings, (int) ( lexem.File - Prev.File ) );
+    EncodeVLQ( Mappings, (int) ( lexem.Line - Prev.Line ) );
+    EncodeVLQ( Mappings, (int) ( lexem.Column - Prev.Column ) );
+    Prev.File = lexem.File;
+    Prev.Line = lexem.Line;
+    Prev.Column = lexem.Column;
+
+    if( lexem.Expansion != Lexem::NoPosition )
     {
-        Pragma::Instance pi;
-        pi.Text = pragma;
-        pi.CurrentFile = "";
-        pi.CurrentFileLine = 0;
-        pi.RootFile = "";
-        pi.GlobalLine = 0;
-        CurPragmaCallback->CallPragma( name, pi );
+        EncodeVLQ( Mappings, (int) ( lexem.Expansion - Prev.Expansion ) );
+        Prev.Expansion = lexem.Expansion;
     }
 }
 
-std::string Preprocessor::PrependRootPath( const std::string& filename )
+void Preprocessor::SourceMap::AddLine()
 {
-    if( filename == RootFile )
-        return RootFile;
-    return RootPath + filename;
+    Mappings += ';';
+    GeneratedLine++;
+    PrevGeneratedColumn = 0;
+
+    if( GeneratedLine % CheckpointInterval == 0 )
+    {
+        Checkpoint cp;
+        cp.Offset = Mappings.size();
+        cp.State = Prev;
+        Checkpoints.push_back( cp );
+    }
 }
 
-Preprocessor::LLITR Preprocessor::ParsePreprocessor( LexemList& lexems, LLITR itr, LLITR end )
+bool Preprocessor::SourceMap::Find( unsigned int line, unsigned int column, Position& pos ) const
 {
-    unsigned int spaces = 0;
-    LLITR        prev = itr;
-    while( itr != end )
+    size_t checkpoint = line / CheckpointInterval;
+    if( checkpoint >= Checkpoints.size() )
+        return false;
+
+    Position     state = Checkpoints[checkpoint].State;
+    unsigned int cur_line = (unsigned int) checkpoint * CheckpointInterval;
+    unsigned int cur_column = 0;
+    bool         found = false;
+    const char*  str = Mappings.c_str() + Checkpoints[checkpoint].Offset;
+    const char*  end = Mappings.c_str() + Mappings.size();
+    while( str != end && cur_line <= line )
     {
-        if( itr->Type == Lexem::NEWLINE )
+        if( *str == ';' )
         {
-            if( prev == itr || prev->Type != Lexem::BACKSLASH )
-                break;
-            itr->Type = Lexem::WHITESPACE;
-            itr->Value = " ";
-            spaces++;
+            cur_line++;
+            cur_column = 0;
+            ++str;
+            continue;
+        }
+        if( *str == ',' )
+        {
+            ++str;
+            continue;
+        }
+
+        int fields[5] = { 0, 0, 0, 0, 0 };
+        int count = 0;
+        while( str != end && *str != ',' && *str != ';' && count < 5 )
+        {
+            if( !DecodeVLQ( str, end, fields[count] ) )
+                return false;
+            count++;
+        }
+
+        cur_column += fields[0];
+        if( count >= 4 )
+        {
+            state.File += fields[1];
+            state.Line += fields[2];
+            state.Column += fields[3];
+        }
+        if( count >= 5 )
+            state.Expansion += fields[4];
+
+        if( cur_line == line && cur_column <= column )
+        {
+            found = ( count >= 4 );
+            pos = state;
+            if( count < 5 )
+                pos.Expansion = Lexem::NoPosition;
         }
-        prev = itr;
-        ++itr;
     }
-    if( spaces )
+    return found;
+}
+
+void Preprocessor::SourceMap::GetExpansionChain( unsigned int expansion, std::vector<Expansion>& chain ) const
+{
+    while( expansion < Expansions.size() )
     {
-        Lexem newline;
-        newline.Type = Lexem::NEWLINE;
-        newline.Value = "\n";
-        prev = itr;
-        itr++;
-        while( spaces-- )
-            lexems.insert( itr, newline );
-        return prev;
+        chain.push_back( Expansions[expansion] );
+        expansion = Expansions[expansion].Parent;
     }
-    return itr;
 }
 
-Preprocessor::LLITR Preprocessor::ParseStatement( LLITR itr, LLITR end, LexemList& dest )
+void Preprocessor::SourceMap::PrintJSON( OutStream& out, const std::string& output_file ) const
 {
-    int depth = 0;
-    while( itr != end )
+    out << "{\"version\":3,\"file\":\"" << EscapeJSON( output_file ) << "\",\"sources\":[";
+    for( size_t i = 0; i < Files.size(); i++ )
+        out << ( i ? ",\"" : "\"" ) << EscapeJSON( Files[i] ) << "\"";
+    out << "],\"names\":[";
+    for( size_t i = 0; i < Expansions.size(); i++ )
+        out << ( i ? ",\"" : "\"" ) << EscapeJSON( Expansions[i].Macro ) << "\"";
+    out << "],\"mappings\":\"" << Mappings << "\",\"x_expansions\":[";
+    for( size_t i = 0; i < Expansions.size(); i++ )
     {
-        if( itr->Value == "," && depth == 0 )
-            return itr;
-        if( itr->Type == Lexem::CLOSE && depth == 0 )
-            return itr;
-        if( itr->Type == Lexem::SEMICOLON && depth == 0 )
-            return itr;
-        dest.push_back( *itr );
-        if( itr->Type == Lexem::OPEN )
-            depth++;
-        if( itr->Type == Lexem::CLOSE )
-        {
-            if( depth == 0 )
-                PrintErrorMessage( "Mismatched braces while parsing statement." );
-            depth--;
-        }
-        ++itr;
+        const Expansion& e = Expansions[i];
+        out << ( i ? ",[" : "[" ) << (int) e.File << "," << e.Line << "," << e.Column << "," << (int) e.Parent << "]";
     }
-    return itr;
+    out << "]}";
 }
 
-Preprocessor::LLITR Preprocessor::ParseDefineArguments( LLITR itr, LLITR end, LexemList& lexems, std::vector<LexemList>& args )
+/************************************************************************/
+/* Statistics                                                           */
+/************************************************************************/
+
+const char* Preprocessor::Statistics::PhaseNames[PHASE_COUNT] =
 {
-    if( itr == end || itr->Value != "(" )
+    "load",
+    "lex",
+    "directives",
+    "expansion",
+    "emit",
+};
+
+static double GetTime()
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Makes phase current until end of scope, time spent is accounted exclusively
+struct PhaseScope
+{
+    Preprocessor& PP;
+    int           Previous;
+    int           PreviousMemory;
+
+    PhaseScope( Preprocessor& pp, int phase ) : PP( pp ), Previous( -1 ), PreviousMemory( pp.Memory.Phase )
     {
-        PrintErrorMessage( "Expected argument list." );
-        return itr;
+        PP.Memory.Phase = phase;
+        if( PP.CurStatistics )
+            Previous = PP.CurStatistics->EnterPhase( phase );
     }
-    LLITR begin_erase = itr;
-    ++itr;
 
-    while( itr != end )
+    ~PhaseScope()
     {
-        LexemList argument;
-        LLITR     prev = itr;
-        itr = ParseStatement( itr, end, argument );
-        if( itr == prev )
-            return itr;
+        PP.Memory.Phase = PreviousMemory;
+        if( PP.CurStatistics )
+            PP.CurStatistics->LeavePhase( Previous );
+    }
+};
 
-        args.push_back( argument );
+// Counts bytes written to output
+struct CountingOutStream: public Preprocessor::OutStream
+{
+    Preprocessor::OutStream& Destination;
+    size_t                   Bytes;
 
-        if( itr == end )
-        {
-            PrintErrorMessage( "0x0FA1 Unexpected end of file." );
-            return itr;
-        }
-        if( itr->Value == "," )
-        {
-            ++itr;
-            if( itr == end )
-            {
-                PrintErrorMessage( "0x0FA2 Unexpected end of file." );
-                return itr;
-            }
-            continue;
-        }
-        if( itr->Value == ")" )
-        {
-            ++itr;
-            break;
-        }
-    }
+    CountingOutStream( Preprocessor::OutStream& destination ) : Destination( destination ), Bytes( 0 ) {}
 
-    return lexems.erase( begin_erase, itr );
-}
+    virtual void Write( const char* str, size_t len )
+    {
+        Bytes += len;
+        Destination.Write( str, len );
+    }
+};
 
-Preprocessor::LLITR Preprocessor::ExpandDefine( LLITR itr, LLITR end, LexemList& lexems, DefineTable& define_table )
+// Output streamed under memory budget, given to destination only if run succeeds
+struct SpoolOutStream: public Preprocessor::OutStream
 {
-    DefineTable::iterator define_entry = define_table.find( itr->Value );
-    if( define_entry == define_table.end() )
-        return ++itr;
-    itr = lexems.erase( itr );
+    FILE* Stream;
+    bool  Failed;
 
-    LLITR itr_begin = itr;
-    itr_begin--;
+    SpoolOutStream() : Stream( NULL ), Failed( false ) {}
+    virtual ~SpoolOutStream()
+    {
+        if( Stream )
+            fclose( Stream );
+    }
 
-    if( define_entry->second.Arguments.size() == 0 )
+    virtual void Write( const char* str, size_t len )
     {
-        lexems.insert( itr,
-                       define_entry->second.Lexems.begin(),
-                       define_entry->second.Lexems.end() );
+        if( !Stream && !Failed )
+            Failed = ( ( Stream = tmpfile() ) == NULL );
+        if( Stream && fwrite( str, 1, len, Stream ) != len )
+            Failed = true;
+    }
 
-        return itr_begin;
+    bool CopyTo( Preprocessor::OutStream& destination )
+    {
+        if( !Stream || Failed )
+            return !Failed;
+
+        char   buffer[16 * 1024];
+        size_t n;
+        rewind( Stream );
+        while( ( n = fread( buffer, 1, sizeof( buffer ), Stream ) ) > 0 )
+            destination.Write( buffer, n );
+        return !ferror( Stream );
     }
+};
 
-    // define has arguments.
-    std::vector<LexemList> arguments;
-    itr = ParseDefineArguments( itr, end, lexems, arguments );
+Preprocessor::Statistics::Statistics()
+{
+    Clear();
+}
 
-    if( define_entry->second.Arguments.size() != arguments.size() )
+void Preprocessor::Statistics::Clear()
+{
+    BytesRead = 0;
+    LexemsLexed = 0;
+    PeakLexems = 0;
+    MacroLookups = 0;
+    MacroExpansions = 0;
+    IncludesProcessed = 0;
+    IncludesSkipped = 0;
+    IfEvaluations = 0;
+    LexemsDropped = 0;
+    LinesSkipped = 0;
+    OutputBytes = 0;
+    BytesSpilled = 0;
+    for( int i = 0; i < PHASE_COUNT; i++ )
+        PhaseTime[i] = 0.0;
+    TotalTime = 0.0;
+    CurrentPhase = -1;
+    PhaseStart = 0.0;
+}
+
+void Preprocessor::Statistics::Add( const Statistics& other )
+{
+    BytesRead += other.BytesRead;
+    LexemsLexed += other.LexemsLexed;
+    PeakLexems = std::max( PeakLexems, other.PeakLexems );
+    MacroLookups += other.MacroLookups;
+    MacroExpansions += other.MacroExpansions;
+    IncludesProcessed += other.IncludesProcessed;
+    IncludesSkipped += other.IncludesSkipped;
+    IfEvaluations += other.IfEvaluations;
+    LexemsDropped += other.LexemsDropped;
+    LinesSkipped += other.LinesSkipped;
+    OutputBytes += other.OutputBytes;
+    BytesSpilled += other.BytesSpilled;
+    for( int i = 0; i < PHASE_COUNT; i++ )
+        PhaseTime[i] += other.PhaseTime[i];
+    TotalTime += other.TotalTime;
+}
+
+double Preprocessor::Statistics::MacroHitRatio() const
+{
+    return MacroLookups ? (double) MacroExpansions / (double) MacroLookups : 0.0;
+}
+
+int Preprocessor::Statistics::EnterPhase( int phase )
+{
+    double now = GetTime();
+    if( CurrentPhase >= 0 )
+        PhaseTime[CurrentPhase] += now - PhaseStart;
+    int previous = CurrentPhase;
+    CurrentPhase = phase;
+    PhaseStart = now;
+    return previous;
+}
+
+void Preprocessor::Statistics::LeavePhase( int previous )
+{
+    double now = GetTime();
+    if( CurrentPhase >= 0 )
+        PhaseTime[CurrentPhase] += now - PhaseStart;
+    CurrentPhase = previous;
+    PhaseStart = now;
+}
+
+void Preprocessor::Statistics::Print( OutStream& out ) const
+{
+    out << "bytes_read " << BytesRead << "\n";
+    out << "lexems_lexed " << LexemsLexed << "\n";
+    out << "peak_lexems " << PeakLexems << "\n";
+    out << "macro_lookups " << MacroLookups << "\n";
+    out << "macro_expansions " << MacroExpansions << "\n";
+    out << "macro_hit_ratio " << MacroHitRatio() << "\n";
+    out << "includes_processed " << IncludesProcessed << "\n";
+    out << "includes_skipped " << IncludesSkipped << "\n";
+    out << "if_evaluations " << IfEvaluations << "\n";
+    out << "lexems_dropped " << LexemsDropped << "\n";
+    out << "lines_skipped " << LinesSkipped << "\n";
+    out << "output_bytes " << OutputBytes << "\n";
+    out << "bytes_spilled " << BytesSpilled << "\n";
+    for( int i = 0; i < PHASE_COUNT; i++ )
+        out << "time_" << PhaseNames[i] << " " << PhaseTime[i] << "\n";
+    out << "time_total " << TotalTime << "\n";
+}
+
+/************************************************************************/
+/* Memory                                                               */
+/************************************************************************/
+
+const char* Preprocessor::MemoryStatistics::CategoryNames[MemoryContext::MEMORY_COUNT] =
+{
+    "lexems",
+    "defines",
+    "files",
+    "lines",
+};
+
+Preprocessor::MemoryContext::MemoryContext() :
+    Hook(NULL),
+    Stats(NULL),
+    Phase(Statistics::PHASE_DIRECTIVES),
+    Shared(false),
+    Used(0)
+{
+}
+
+Preprocessor::MemoryContext*& Preprocessor::MemoryContext::Current()
+{
+    static thread_local MemoryContext* current = NULL;
+    return current;
+}
+
+void* Preprocessor::MemoryContext::Allocate( size_t size, int category )
+{
+    // Worker thread carves its own block, Locker is taken once per block
+    WorkerBlock* block = ( Shared ? WorkerBlock::Current() : NULL );
+    if( block && block->Context == this && size <= WorkerBlock::MaxPart )
     {
-        PrintErrorMessage( "Didn't supply right number of arguments to define '" + define_entry->first + "'." );
-        return end;
+        size_t part = ( size + Arena::Alignment - 1 ) & ~( Arena::Alignment - 1 );
+        if( (size_t) ( block->End - block->Next ) < part )
+            block->Refill();
+        void* ptr = block->Next;
+        block->Next += part;
+        block->Bytes[category] += size;
+        block->Requests++;
+        return ptr;
     }
 
-    LexemList temp_list( define_entry->second.Lexems.begin(), define_entry->second.Lexems.end() );
+    std::unique_lock<std::mutex> lock( Locker, std::defer_lock );
+    if( Shared )
+        lock.lock();
 
-    LLITR     tli = temp_list.begin();
-    while( tli != temp_list.end() )
-    {
-        ArgSet::iterator arg = define_entry->second.Arguments.find( tli->Value );
-        if( arg == define_entry->second.Arguments.end() )
-        {
-            ++tli;
-            continue;
-        }
+    void* ptr = ( Hook ? Hook->Allocate( size ) : ::operator new( size ) );
+    if( !ptr )
+        throw std::bad_alloc();
 
-        tli = temp_list.erase( tli );
-        temp_list.insert( tli, arguments[arg->second].begin(), arguments[arg->second].end() );
-    }
+    Count( 1, !Hook || Hook->TookFromHeap() ? 1 : 0 );
+    Track( category, size, true );
+    return ptr;
+}
+
+void Preprocessor::MemoryContext::Deallocate( void* ptr, size_t size, int category )
+{
+    std::unique_lock<std::mutex> lock( Locker, std::defer_lock );
+    if( Shared )
+        lock.lock();
 
-    lexems.insert( itr, temp_list.begin(), temp_list.end() );
+    if( Hook )
+        Hook->Deallocate( ptr, size );
+    else
+        ::operator delete( ptr );
 
-    return itr_begin;
-    // expand arguments in templist.
+    Track( category, size, false );
 }
 
-void Preprocessor::ParseDefine( DefineTable& define_table, LexemList& def_lexems )
+void Preprocessor::MemoryContext::Track( int category, size_t bytes, bool add )
 {
-    def_lexems.pop_front();     // remove #define directive
-    if( def_lexems.empty() )
+    Used = ( add ? Used + bytes : Used - std::min( bytes, Used ) );
+    if( !Stats )
+        return;
+
+    if( !add )
     {
-        PrintErrorMessage( "Define directive without arguments." );
+        Stats->Current[category] -= std::min( bytes, Stats->Current[category] );
         return;
     }
-    Lexem name = *def_lexems.begin();
-    if( name.Type != Lexem::IDENTIFIER )
+
+    Stats->Current[category] += bytes;
+    Stats->Peak[category] = std::max( Stats->Peak[category], Stats->Current[category] );
+
+    size_t total = 0;
+    for( int i = 0; i < MEMORY_COUNT; i++ )
+        total += Stats->Current[i];
+    Stats->PeakTotal = std::max( Stats->PeakTotal, total );
+}
+
+void Preprocessor::MemoryContext::CountHeapAllocations( size_t count )
+{
+    WorkerBlock* block = ( Shared ? WorkerBlock::Current() : NULL );
+    if( block && block->Context == this )
     {
-        PrintErrorMessage( "Define's name was not an identifier." );
+        block->Requests += count;
+        block->HeapRequests += count;
         return;
     }
-    def_lexems.pop_front();
 
-    while( !def_lexems.empty() )
+    std::unique_lock<std::mutex> lock( Locker, std::defer_lock );
+    if( Shared )
+        lock.lock();
+    Count( count, count );
+}
+
+void Preprocessor::MemoryContext::CountString( const std::string& value )
+{
+    static const size_t inline_capacity = std::string().capacity();
+    if( value.capacity() > inline_capacity )
+        CountHeapAllocations( 1 );
+}
+
+void Preprocessor::MemoryContext::Constructed( const Lexem& lexem )
+{
+    CountString( lexem.Value );
+}
+
+void Preprocessor::MemoryContext::Count( size_t requests, size_t heap )
+{
+    if( !Stats )
+        return;
+    Stats->Allocations[Phase] += requests;
+    Stats->HeapAllocations += heap;
+    if( Stats->ForbidAllocations )
+        Stats->ForbiddenAllocations += heap;
+}
+
+const size_t Preprocessor::MemoryContext::WorkerBlock::Size;
+const size_t Preprocessor::MemoryContext::WorkerBlock::MaxPart;
+
+Preprocessor::MemoryContext::WorkerBlock::WorkerBlock( MemoryContext* context ) :
+    Context( context && context->Hook && context->Hook->IsCarvable() ? context : NULL ),
+    Next( NULL ),
+    End( NULL ),
+    Requests( 0 ),
+    HeapRequests( 0 )
+{
+    for( int i = 0; i < MEMORY_COUNT; i++ )
+        Bytes[i] = 0;
+    Current() = this;
+}
+
+Preprocessor::MemoryContext::WorkerBlock::~WorkerBlock()
+{
+    Current() = NULL;
+    if( !Context )
+        return;
+    std::lock_guard<std::mutex> lock( Context->Locker );
+    Flush();
+}
+
+Preprocessor::MemoryContext::WorkerBlock*& Preprocessor::MemoryContext::WorkerBlock::Current()
+{
+    static thread_local WorkerBlock* current = NULL;
+    return current;
+}
+
+// Rest of previous block stays unused until hook is reset
+void Preprocessor::MemoryContext::WorkerBlock::Refill()
+{
+    std::lock_guard<std::mutex> lock( Context->Locker );
+    Flush();
+    Next = (char*) Context->Hook->Allocate( Size );
+    if( !Next )
+        throw std::bad_alloc();
+    End = Next + Size;
+    if( Context->Hook->TookFromHeap() )
+        HeapRequests++;
+}
+
+// Called under Locker
+void Preprocessor::MemoryContext::WorkerBlock::Flush()
+{
+    for( int i = 0; i < MEMORY_COUNT; i++ )
+    {
+        if( Bytes[i] )
+            Context->Track( i, Bytes[i], true );
+        Bytes[i] = 0;
+    }
+    Context->Count( Requests, HeapRequests );
+    Requests = 0;
+    HeapRequests = 0;
+}
+
+const size_t Preprocessor::Arena::Alignment;
+const size_t Preprocessor::Arena::SizeClasses;
+
+Preprocessor::Arena::Arena( size_t chunk_size ) :
+    ChunkSize( chunk_size ),
+    ChunkIndex( 0 ),
+    Next( NULL ),
+    End( NULL ),
+    Capacity( 0 ),
+    Retain( false ),
+    TookHeap( false )
+{
+    for( size_t i = 0; i < SizeClasses; i++ )
+        FreeLists[i] = NULL;
+}
+
+Preprocessor::Arena::~Arena()
+{
+    Retain = false;
+    Reset();
+}
+
+void* Preprocessor::Arena::Allocate( size_t size )
+{
+    size = ( size + Alignment - 1 ) & ~( Alignment - 1 );
+    size_t size_class = size / Alignment - 1;
+    TookHeap = false;
+    if( size_class < SizeClasses && FreeLists[size_class] )
+    {
+        void* ptr = FreeLists[size_class];
+        FreeLists[size_class] = *(void**) ptr;
+        return ptr;
+    }
+
+    if( size > ChunkSize )
+    {
+        char* chunk = (char*) ::operator new( size );
+        BigChunks.push_back( std::make_pair( chunk, size ) );
+        Capacity += size;
+        TookHeap = true;
+        return chunk;
+    }
+
+    if( (size_t) ( End - Next ) < size )
+    {
+        // Next retained chunk or new one
+        if( Next )
+            ChunkIndex++;
+        if( ChunkIndex == Chunks.size() )
+        {
+            Chunks.push_back( (char*) ::operator new( ChunkSize ) );
+            Capacity += ChunkSize;
+            TookHeap = true;
+        }
+        Next = Chunks[ChunkIndex];
+        End = Next + ChunkSize;
+    }
+
+    void* ptr = Next;
+    Next += size;
+    return ptr;
+}
+
+void Preprocessor::Arena::Deallocate( void* ptr, size_t size )
+{
+    size = ( size + Alignment - 1 ) & ~( Alignment - 1 );
+    size_t size_class = size / Alignment - 1;
+    if( size_class < SizeClasses )
+    {
+        *(void**) ptr = FreeLists[size_class];
+        FreeLists[size_class] = ptr;
+    }
+}
+
+void Preprocessor::Arena::Reset()
+{
+    for( size_t i = 0; i < BigChunks.size(); i++ )
+    {
+        Capacity -= BigChunks[i].second;
+        ::operator delete( BigChunks[i].first );
+    }
+    BigChunks.clear();
+    if( !Retain )
+    {
+        for( size_t i = 0; i < Chunks.size(); i++ )
+            ::operator delete( Chunks[i] );
+        Chunks.clear();
+        Capacity = 0;
+    }
+    ChunkIndex = 0;
+    Next = End = NULL;
+    for( size_t i = 0; i < SizeClasses; i++ )
+        FreeLists[i] = NULL;
+}
+
+Preprocessor::MemoryStatistics::MemoryStatistics() :
+    ForbidAllocations(false)
+{
+    Clear();
+}
+
+void Preprocessor::MemoryStatistics::Clear()
+{
+    for( int i = 0; i < MemoryContext::MEMORY_COUNT; i++ )
+    {
+        Current[i] = 0;
+        Peak[i] = 0;
+    }
+    PeakTotal = 0;
+    for( int i = 0; i < Statistics::PHASE_COUNT; i++ )
+        Allocations[i] = 0;
+    HeapAllocations = 0;
+    ForbiddenAllocations = 0;
+}
+
+void Preprocessor::MemoryStatistics::Print( OutStream& out ) const
+{
+    for( int i = 0; i < MemoryContext::MEMORY_COUNT; i++ )
+        out << "peak_bytes_" << CategoryNames[i] << " " << Peak[i] << "\n";
+    out << "peak_bytes_total " << PeakTotal << "\n";
+    for( int i = 0; i < Statistics::PHASE_COUNT; i++ )
+        out << "allocations_" << Statistics::PhaseNames[i] << " " << Allocations[i] << "\n";
+    out << "heap_allocations " << HeapAllocations << "\n";
+    out << "forbidden_allocations " << ForbiddenAllocations << "\n";
+}
+
+/************************************************************************/
+/* Profile                                                              */
+/************************************************************************/
+
+// Keeps file on top of profile stack until end of scope
+struct ProfileFileScope
+{
+    Preprocessor::Profile* Prof;
+
+    ProfileFileScope( Preprocessor::Profile* prof, const std::string& file ) : Prof( prof )
+    {
+        if( Prof )
+            Prof->EnterFile( file );
+    }
+
+    ~ProfileFileScope()
+    {
+        if( Prof )
+            Prof->LeaveFile();
+    }
+};
+
+struct FileTimeGreater
+{
+    bool operator()( const Preprocessor::Profile::FileEntry* a, const Preprocessor::Profile::FileEntry* b ) const
+    {
+        return a->ExclusiveTime > b->ExclusiveTime;
+    }
+};
+
+struct MacroTimeGreater
+{
+    bool operator()( const Preprocessor::Profile::MacroEntry* a, const Preprocessor::Profile::MacroEntry* b ) const
+    {
+        return a->Time > b->Time;
+    }
+};
+
+void Preprocessor::Profile::Clear()
+{
+    Files.clear();
+    Macros.clear();
+    FileIndex.clear();
+    MacroIndex.clear();
+    Stack.clear();
+}
+
+Preprocessor::Profile::FileEntry& Preprocessor::Profile::GetFile( const std::string& file )
+{
+    std::map<std::string, size_t>::iterator it = FileIndex.find( file );
+    if( it != FileIndex.end() )
+        return Files[it->second];
+
+    FileEntry entry;
+    entry.File = file;
+    entry.Includes = 0;
+    entry.InclusiveTime = 0.0;
+    entry.ExclusiveTime = 0.0;
+    entry.LexemsLexed = 0;
+    entry.LexemsEmitted = 0;
+    FileIndex[file] = Files.size();
+    Files.push_back( entry );
+    return Files.back();
+}
+
+Preprocessor::Profile::MacroEntry& Preprocessor::Profile::GetMacro( const std::string& macro )
+{
+    std::map<std::string, size_t>::iterator it = MacroIndex.find( macro );
+    if( it != MacroIndex.end() )
+        return Macros[it->second];
+
+    MacroEntry entry;
+    entry.Macro = macro;
+    entry.Invocations = 0;
+    entry.LexemsProduced = 0;
+    entry.Time = 0.0;
+    MacroIndex[macro] = Macros.size();
+    Macros.push_back( entry );
+    return Macros.back();
+}
+
+void Preprocessor::Profile::EnterFile( const std::string& file )
+{
+    GetFile( file ).Includes++;
+
+    Frame frame;
+    frame.Entry = FileIndex[file];
+    frame.Start = GetTime();
+    frame.Children = 0.0;
+    Stack.push_back( frame );
+}
+
+void Preprocessor::Profile::LeaveFile()
+{
+    Frame  frame = Stack.back();
+    Stack.pop_back();
+
+    double elapsed = GetTime() - frame.Start;
+    Files[frame.Entry].InclusiveTime += elapsed;
+    Files[frame.Entry].ExclusiveTime += elapsed - frame.Children;
+    if( !Stack.empty() )
+        Stack.back().Children += elapsed;
+}
+
+void Preprocessor::Profile::PrintTable( OutStream& out, size_t limit ) const
+{
+    std::vector<const FileEntry*> files;
+    for( size_t i = 0; i < Files.size(); i++ )
+        files.push_back( &Files[i] );
+    std::sort( files.begin(), files.end(), FileTimeGreater() );
+
+    std::vector<const MacroEntry*> macros;
+    for( size_t i = 0; i < Macros.size(); i++ )
+        macros.push_back( &Macros[i] );
+    std::sort( macros.begin(), macros.end(), MacroTimeGreater() );
+
+    char line[1024];
+    snprintf( line, sizeof( line ), "%12s %12s %8s %10s %10s  %s\n", "excl ms", "incl ms", "count", "lexed", "emitted", "file" );
+    out.Write( line, strlen( line ) );
+    for( size_t i = 0; i < files.size() && ( !limit || i < limit ); i++ )
+    {
+        const FileEntry* f = files[i];
+        snprintf( line, sizeof( line ), "%12.3f %12.3f %8u %10u %10u  %s\n", f->ExclusiveTime * 1000.0, f->InclusiveTime * 1000.0,
+                  (unsigned int) f->Includes, (unsigned int) f->LexemsLexed, (unsigned int) f->LexemsEmitted, f->File.c_str() );
+        out.Write( line, strlen( line ) );
+    }
+
+    snprintf( line, sizeof( line ), "\n%12s %8s %10s  %s\n", "time ms", "count", "produced", "macro" );
+    out.Write( line, strlen( line ) );
+    for( size_t i = 0; i < macros.size() && ( !limit || i < limit ); i++ )
+    {
+        const MacroEntry* m = macros[i];
+        snprintf( line, sizeof( line ), "%12.3f %8u %10u  %s\n", m->Time * 1000.0, (unsigned int) m->Invocations,
+                  (unsigned int) m->LexemsProduced, m->Macro.c_str() );
+        out.Write( line, strlen( line ) );
+    }
+}
+
+void Preprocessor::Profile::PrintJSON( OutStream& out ) const
+{
+    out << "{\"files\":[";
+    for( size_t i = 0; i < Files.size(); i++ )
+    {
+        const FileEntry& f = Files[i];
+        out << ( i ? "," : "" ) << "{\"file\":\"" << EscapeJSON( f.File ) << "\",\"includes\":" << f.Includes
+            << ",\"inclusive_time\":" << f.InclusiveTime << ",\"exclusive_time\":" << f.ExclusiveTime
+            << ",\"lexems_lexed\":" << f.LexemsLexed << ",\"lexems_emitted\":" << f.LexemsEmitted << "}";
+    }
+    out << "],\"macros\":[";
+    for( size_t i = 0; i < Macros.size(); i++ )
+    {
+        const MacroEntry& m = Macros[i];
+        out << ( i ? "," : "" ) << "{\"macro\":\"" << EscapeJSON( m.Macro ) << "\",\"invocations\":" << m.Invocations
+            << ",\"lexems_produced\":" << m.LexemsProduced << ",\"time\":" << m.Time << "}";
+    }
+    out << "]}";
+}
+
+/************************************************************************/
+/* Trace                                                                */
+/************************************************************************/
+
+// Records span from construction until end of scope
+struct TraceScope
+{
+    Preprocessor::Trace* Tr;
+    unsigned int         Name;
+    double               Start;
+
+    TraceScope( Preprocessor::Trace* tr, unsigned int name ) : Tr( tr ), Name( name ), Start( Tr ? GetTime() : 0.0 )
+    {
+    }
+
+    ~TraceScope()
+    {
+        if( Tr )
+            Tr->AddEvent( Name, Start, GetTime() - Start );
+    }
+};
+
+static unsigned int GetThreadIndex()
+{
+    static std::atomic<unsigned int> threads( 0 );
+    static thread_local unsigned int index = ++threads;
+    return index;
+}
+
+static const char* const TraceFixedNames[Preprocessor::Trace::NAME_COUNT] =
+{
+    "load", "lex", "emit", "scan chunk", "lex chunk",
+    "#define", "#undef", "#include", "#if", "#ifdef", "#ifndef", "#elif", "#else", "#endif",
+    "#pragma", "#message", "#warning", "#error", "directive"
+};
+
+Preprocessor::Trace::Trace( size_t capacity ) :
+    Events( capacity ? capacity : 1 ),
+    Recorded( 0 )
+{
+    Clear();
+}
+
+void Preprocessor::Trace::Clear()
+{
+    std::lock_guard<std::mutex> locker( NamesLocker );
+    Recorded = 0;
+    Names.assign( TraceFixedNames, TraceFixedNames + NAME_COUNT );
+    NameIndex.clear();
+    for( size_t i = 0; i < Names.size(); i++ )
+        NameIndex[Names[i]] = i;
+}
+
+unsigned int Preprocessor::Trace::GetDirectiveName( const std::string& directive )
+{
+    for( unsigned int i = NAME_DEFINE; i < NAME_DIRECTIVE; i++ )
+    {
+        if( directive == TraceFixedNames[i] )
+            return i;
+    }
+    return NAME_DIRECTIVE;
+}
+
+unsigned int Preprocessor::Trace::GetName( const std::string& name )
+{
+    std::lock_guard<std::mutex>             locker( NamesLocker );
+    std::map<std::string, size_t>::iterator it = NameIndex.find( name );
+    if( it != NameIndex.end() )
+        return (unsigned int) it->second;
+    NameIndex[name] = Names.size();
+    Names.push_back( name );
+    return (unsigned int) ( Names.size() - 1 );
+}
+
+void Preprocessor::Trace::AddEvent( unsigned int name, double start, double duration )
+{
+    Event& e = Events[Recorded++ % Events.size()];
+    e.Name = name;
+    e.Thread = GetThreadIndex();
+    e.Start = start;
+    e.Duration = duration;
+}
+
+void Preprocessor::Trace::PrintJSON( OutStream& out )
+{
+    std::lock_guard<std::mutex> locker( NamesLocker );
+    size_t                      recorded = Recorded;
+    size_t                      count = std::min( recorded, Events.size() );
+    std::set<unsigned int>      threads;
+    char                        buf[128];
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for( size_t i = recorded - count; i < recorded; i++ )
+    {
+        const Event& e = Events[i % Events.size()];
+        threads.insert( e.Thread );
+        snprintf( buf, sizeof( buf ), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}", e.Start * 1e6, e.Duration * 1e6, e.Thread );
+        out << ( i != recorded - count ? "," : "" ) << "{\"name\":\"" << EscapeJSON( Names[e.Name] ) << "\",\"cat\":\"preprocessor\"";
+        out.Write( buf, strlen( buf ) );
+    }
+    for( std::set<unsigned int>::iterator it = threads.begin(); it != threads.end(); ++it )
+    {
+        snprintf( buf, sizeof( buf ), ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"preprocessor %u\"}}", *it, *it );
+        out.Write( buf, strlen( buf ) );
+    }
+    out << "]}";
+}
+
+/************************************************************************/
+/* Preprocess                                                           */
+/************************************************************************/
+
+void Preprocessor::PrintMessage( const std::string& msg )
+{
+    ( *Errors ) << CurrentFile << " (" << LinesThisFile << ") " << msg << "\n";
+}
+
+void Preprocessor::PrintErrorMessage( const std::string& errmsg )
+{
+    std::string err = "Error";
+    if( !( errmsg.empty() || errmsg.length() == 0 ))
+    {
+        err += ": ";
+        err += errmsg;
+    }
+
+    PrintMessage( err );
+    ErrorsCount++;
+}
+
+void Preprocessor::PrintWarningMessage( const std::string& warnmsg )
+{
+    std::string warn = "Warning";
+    if( !(warnmsg.empty() || warnmsg.length() == 0 ))
+    {
+        warn += ": ";
+        warn += warnmsg;
+    }
+
+    PrintMessage( warn );
+}
+
+std::string Preprocessor::RemoveQuotes( const std::string& in )
+{
+    return in.substr( 1, in.size() - 2 );
+}
+
+void Preprocessor::SetPragmaCallback( Pragma::Callback* callback )
+{
+    CurPragmaCallback = callback;
+}
+
+void Preprocessor::SetSourceMap( SourceMap* source_map )
+{
+    CurSourceMap = source_map;
+}
+
+void Preprocessor::SetOutputFormat( OutputFormat format )
+{
+    CurOutputFormat = format;
+}
+
+void Preprocessor::SetStatistics( Statistics* stats )
+{
+    CurStatistics = stats;
+}
+
+void Preprocessor::SetProfile( Profile* profile )
+{
+    CurProfile = profile;
+}
+
+void Preprocessor::SetTrace( Trace* trace )
+{
+    CurTrace = trace;
+}
+
+void Preprocessor::SetLexThreads( unsigned int threads, size_t min_size )
+{
+    LexThreads = threads;
+    LexThreadsMinSize = min_size;
+}
+
+void Preprocessor::SetLexemCache( LexemCache* cache )
+{
+    CurLexemCache = cache;
+}
+
+void Preprocessor::SetAllocationHook( AllocationHook* hook )
+{
+    CurAllocationHook = hook;
+}
+
+void Preprocessor::SetMemoryStatistics( MemoryStatistics* stats )
+{
+    Memory.Stats = stats;
+}
+
+void Preprocessor::SetReuse( bool reuse )
+{
+    Reuse = reuse;
+    RunArena.Retain = reuse;
+    if( !reuse )
+    {
+        RunArena.Reset();
+        FileBuffers.clear();
+        FileBuffers.shrink_to_fit();
+    }
+}
+
+void Preprocessor::SetMemoryBudget( size_t bytes )
+{
+    MemoryBudget = bytes;
+}
+
+void Preprocessor::ProfileMacro( const std::string& macro, size_t produced, double start_time )
+{
+    Profile::MacroEntry& entry = CurProfile->GetMacro( macro );
+    entry.Invocations++;
+    entry.LexemsProduced += produced;
+    entry.Time += GetTime() - start_time;
+}
+
+void Preprocessor::UpdatePeakLexems()
+{
+    size_t live = 0;
+    for( size_t i = 0; i < FileLexems.size(); i++ )
+        live += FileLexems[i]->size();
+    CurStatistics->PeakLexems = std::max( CurStatistics->PeakLexems, live );
+}
+
+void Preprocessor::ProfileEmitted( LLITR begin, LLITR end )
+{
+    std::vector<size_t> entries( FilesPreprocessed.size() );
+    for( size_t i = 0; i < FilesPreprocessed.size(); i++ )
+        entries[i] = CurProfile->FileIndex[FilesPreprocessed[i]];
+    for( LLITR itr = begin; itr != end; ++itr )
+        if( itr->File < entries.size() && itr->Type != Lexem::NEWLINE )
+            CurProfile->Files[entries[itr->File]].LexemsEmitted++;
+}
+
+// Lexems before cursor of each included file precede everything what follows in output
+void Preprocessor::StreamFinished()
+{
+    for( size_t i = 0; i < FileLexems.size(); i++ )
+    {
+        LexemList& list = *FileLexems[i];
+        LLITR      cursor = *FileCursors[i];
+        if( CurProfile )
+            ProfileEmitted( list.begin(), cursor );
+        PrintLexems( list.begin(), cursor, *StreamDestination, CurSourceMap, StreamSpace, StreamColumn );
+        list.erase( list.begin(), cursor );
+    }
+}
+
+bool Preprocessor::EnforceBudget()
+{
+    if( Memory.Used <= MemoryBudget / 2 )
+        return true;
+
+    if( StreamDestination )
+    {
+        PhaseScope phase( *this, Statistics::PHASE_EMIT );
+        StreamFinished();
+    }
+    FileBuffers.clear();
+    FileBuffers.shrink_to_fit();
+    if( Memory.Used <= MemoryBudget )
+        return true;
+
+    if( !BudgetExceeded )
+        PrintErrorMessage( "Memory budget of " + IntToString( (int) ( MemoryBudget / 1024 ) ) + " KB exceeded." );
+    BudgetExceeded = true;
+    return false;
+}
+
+void Preprocessor::CallPragma( const std::string& name, std::string pragma )
+{
+    Pragma::Record record;
+    record.Name = name;
+    record.Text = pragma;
+    record.CurrentFile = "";
+    record.CurrentFileLine = 0;
+    record.RootFile = "";
+    record.GlobalLine = 0;
+    DispatchPragma( record );
+}
+
+void Preprocessor::SetPragmaDispatch( Pragma::DispatchMode mode )
+{
+    CurPragmaDispatch = mode;
+    if( mode == Pragma::DISPATCH_THREAD && !PragmaWorker )
+        PragmaWorker = new Pragma::Worker();
+}
+
+void Preprocessor::SetPragmaRegistry( Pragma::Registry* registry )
+{
+    CurPragmaRegistry = registry;
+    CurPragmaCallback = registry;
+}
+
+void Preprocessor::DispatchPragma( const Pragma::Record& record )
+{
+    if( !CurPragmaCallback )
+        return;
+    bool unknown = false;
+    if( CurPragmaRegistry && CurPragmaCallback == CurPragmaRegistry && !CurPragmaRegistry->Accept( record, unknown ) )
+    {
+        if( unknown && CurPragmaRegistry->Unknown == Pragma::UNKNOWN_WARN )
+            PrintWarningMessage( "Unknown pragma '" + record.Name + "'." );
+        return;
+    }
+    if( CurPragmaDispatch == Pragma::DISPATCH_SYNC )
+        CurPragmaCallback->CallPragma( record.Name, record );
+    else if( CurPragmaDispatch == Pragma::DISPATCH_THREAD )
+        PragmaWorker->Push( CurPragmaCallback, record );
+    else
+        PragmaBatch.push_back( record );
+}
+
+void Preprocessor::WaitPragmas()
+{
+    if( PragmaWorker )
+        PragmaWorker->Wait();
+}
+
+void Preprocessor::Pragma::Callback::CallPragmas( const std::vector<Record>& records )
+{
+    for( size_t i = 0; i < records.size(); i++ )
+        CallPragma( records[i].Name, records[i] );
+}
+
+Preprocessor::Pragma::Registry::Registry( DedupMode dedup, UnknownMode unknown ) :
+    Dedup( dedup ),
+    Unknown( unknown ),
+    Dispatched( 0 ),
+    Duplicates( 0 ),
+    Unknowns( 0 )
+{
+}
+
+void Preprocessor::Pragma::Registry::Register( const std::string& name, Handler* handler )
+{
+    std::pair<std::unordered_map<std::string, unsigned int>::iterator, bool> ins =
+        Names.insert( std::make_pair( name, (unsigned int) Handlers.size() ) );
+    if( ins.second )
+        Handlers.push_back( handler );
+    else
+        Handlers[ins.first->second] = handler;
+}
+
+void Preprocessor::Pragma::Registry::BeginRun()
+{
+    if( Dedup != DEDUP_ALL )
+        Seen.clear();
+}
+
+void Preprocessor::Pragma::Registry::ClearSeen()
+{
+    Seen.clear();
+}
+
+bool Preprocessor::Pragma::Registry::Accept( const Record& record, bool& unknown )
+{
+    std::unordered_map<std::string, unsigned int>::iterator it = Names.find( record.Name );
+    unknown = ( it == Names.end() || !Handlers[it->second] );
+    if( unknown )
+    {
+        Unknowns++;
+        return false;
+    }
+    if( Dedup != DEDUP_NONE && !Seen.insert( std::make_pair( it->second, record.Text ) ).second )
+    {
+        Duplicates++;
+        return false;
+    }
+    Dispatched++;
+    return true;
+}
+
+void Preprocessor::Pragma::Registry::CallPragma( const std::string& name, const Pragma::Instance& pi )
+{
+    std::unordered_map<std::string, unsigned int>::iterator it = Names.find( name );
+    if( it != Names.end() && Handlers[it->second] )
+        Handlers[it->second]->Call( pi );
+}
+
+Preprocessor::Pragma::Worker::Worker() :
+    Busy( false ),
+    Quit( false )
+{
+    Thread = std::thread( &Worker::Run, this );
+}
+
+Preprocessor::Pragma::Worker::~Worker()
+{
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        Quit = true;
+    }
+    Wake.notify_one();
+    Thread.join();
+}
+
+void Preprocessor::Pragma::Worker::Push( Callback* callback, const Record& record )
+{
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        Queue.push_back( std::make_pair( callback, record ) );
+    }
+    Wake.notify_one();
+}
+
+void Preprocessor::Pragma::Worker::Wait()
+{
+    std::unique_lock<std::mutex> lock( Locker );
+    while( Busy || !Queue.empty() )
+        Idle.wait( lock );
+}
+
+void Preprocessor::Pragma::Worker::Run()
+{
+    std::unique_lock<std::mutex> lock( Locker );
+    while( true )
+    {
+        while( !Quit && Queue.empty() )
+            Wake.wait( lock );
+        // Queue is drained before quitting
+        if( Queue.empty() )
+            break;
+
+        std::pair<Callback*, Record> call = Queue.front();
+        Queue.pop_front();
+        Busy = true;
+        lock.unlock();
+        call.first->CallPragma( call.second.Name, call.second );
+        lock.lock();
+        Busy = false;
+        if( Queue.empty() )
+            Idle.notify_all();
+    }
+}
+
+std::string Preprocessor::PrependRootPath( const std::string& filename )
+{
+    if( filename == RootFile )
+        return RootFile;
+    return RootPath + filename;
+}
+
+Preprocessor::LLITR Preprocessor::ParsePreprocessor( LexemList& lexems, LLITR itr, LLITR end )
+{
+    unsigned int spaces = 0;
+    LLITR        prev = itr;
+    while( itr != end )
+    {
+        if( itr->Type == Lexem::NEWLINE )
+        {
+            if( prev == itr || prev->Type != Lexem::BACKSLASH )
+                break;
+            itr->Type = Lexem::WHITESPACE;
+            itr->Value = " ";
+            spaces++;
+        }
+        prev = itr;
+        ++itr;
+    }
+    if( spaces )
+    {
+        Lexem newline;
+        newline.Type = Lexem::NEWLINE;
+        newline.Value = "\n";
+        prev = itr;
+        itr++;
+        while( spaces-- )
+            lexems.insert( itr, newline );
+        return prev;
+    }
+    return itr;
+}
+
+Preprocessor::LLITR Preprocessor::ParseStatement( LLITR itr, LLITR end, LexemList& dest )
+{
+    int depth = 0;
+    while( itr != end )
+    {
+        if( itr->Value == "," && depth == 0 )
+            return itr;
+        if( itr->Type == Lexem::CLOSE && depth == 0 )
+            return itr;
+        if( itr->Type == Lexem::SEMICOLON && depth == 0 )
+            return itr;
+        dest.push_back( *itr );
+        if( itr->Type == Lexem::OPEN )
+            depth++;
+        if( itr->Type == Lexem::CLOSE )
+        {
+            if( depth == 0 )
+                PrintErrorMessage( "Mismatched braces while parsing statement." );
+            depth--;
+        }
+        ++itr;
+    }
+    return itr;
+}
+
+Preprocessor::LLITR Preprocessor::ParseDefineArguments( LLITR itr, LLITR end, LexemList& lexems, std::vector<LexemList>& args )
+{
+    if( itr == end || itr->Value != "(" )
+    {
+        PrintErrorMessage( "Expected argument list." );
+        return itr;
+    }
+    LLITR begin_erase = itr;
+    ++itr;
+
+    while( itr != end )
+    {
+        LexemList argument;
+        LLITR     prev = itr;
+        itr = ParseStatement( itr, end, argument );
+        if( itr == prev )
+            return itr;
+
+        args.push_back( argument );
+
+        if( itr == end )
+        {
+            PrintErrorMessage( "0x0FA1 Unexpected end of file." );
+            return itr;
+        }
+        if( itr->Value == "," )
+        {
+            ++itr;
+            if( itr == end )
+            {
+                PrintErrorMessage( "0x0FA2 Unexpected end of file." );
+                return itr;
+            }
+            continue;
+        }
+        if( itr->Value == ")" )
+        {
+            ++itr;
+            break;
+        }
+    }
+
+    return lexems.erase( begin_erase, itr );
+}
+
+Preprocessor::LLITR Preprocessor::ExpandDefine( LLITR itr, LLITR end, LexemList& lexems, DefineTable& define_table )
+{
+    DefineTable::iterator define_entry = define_table.find( itr->Value );
+    if( CurStatistics )
+    {
+        CurStatistics->MacroLookups++;
+        if( define_entry != define_table.end() )
+            CurStatistics->MacroExpansions++;
+    }
+    if( define_entry == define_table.end() )
+        return ++itr;
+
+    double start_time = ( CurProfile ? GetTime() : 0.0 );
+
+    unsigned int expansion = Lexem::NoPosition;
+    // Expansions of #define body and #if expression are never referenced by output lexems
+    if( CurSourceMap && CurSourceMap->TrackExpansions && !SkipExpansions )
+        expansion = CurSourceMap->AddExpansion( define_entry->first, *itr );
+
+    itr = lexems.erase( itr );
+
+    if( define_entry->second.Arguments.size() == 0 )
+    {
+        LLITR inserted = lexems.insert( itr,
+                                        define_entry->second.Lexems.begin(),
+                                        define_entry->second.Lexems.end() );
+        if( expansion != Lexem::NoPosition )
+        {
+            for( LLITR it = inserted; it != itr; ++it )
+                it->Expansion = expansion;
+        }
+
+        if( CurProfile )
+            ProfileMacro( define_entry->first, define_entry->second.Lexems.size(), start_time );
+        return inserted;
+    }
+
+    // define has arguments.
+    std::vector<LexemList> arguments;
+    itr = ParseDefineArguments( itr, end, lexems, arguments );
+
+    if( define_entry->second.Arguments.size() != arguments.size() )
+    {
+        PrintErrorMessage( "Didn't supply right number of arguments to define '" + define_entry->first + "'." );
+        if( CurProfile )
+            ProfileMacro( define_entry->first, 0, start_time );
+        // Processing continues after the call instead of skipping to end, newlines
+        // of lazily lexed rest of list are still counted and may report errors of their own
+        return itr;
+    }
+
+    LexemList temp_list( define_entry->second.Lexems.begin(), define_entry->second.Lexems.end() );
+
+    LLITR     tli = temp_list.begin();
+    while( tli != temp_list.end() )
+    {
+        ArgSet::iterator arg = define_entry->second.Arguments.find( tli->Value );
+        if( arg == define_entry->second.Arguments.end() )
+        {
+            if( expansion != Lexem::NoPosition )
+                tli->Expansion = expansion;
+            ++tli;
+            continue;
+        }
+
+        tli = temp_list.erase( tli );
+        temp_list.insert( tli, arguments[arg->second].begin(), arguments[arg->second].end() );
+    }
+
+    if( CurProfile )
+        ProfileMacro( define_entry->first, temp_list.size(), start_time );
+    // Expansion is rescanned from its first lexem
+    return lexems.insert( itr, temp_list.begin(), temp_list.end() );
+}
+
+void Preprocessor::ParseDefine( DefineTable& define_table, LexemList& def_lexems )
+{
+    def_lexems.pop_front();     // remove #define directive
+    if( def_lexems.empty() )
+    {
+        PrintErrorMessage( "Define directive without arguments." );
+        return;
+    }
+    Lexem name = *def_lexems.begin();
+    if( name.Type != Lexem::IDENTIFIER )
+    {
+        PrintErrorMessage( "Define's name was not an identifier." );
+        return;
+    }
+    def_lexems.pop_front();
+
+    while( !def_lexems.empty() )
+    {
+        Lexem::LexemType lexem_type = def_lexems.begin()->Type;
+        if( lexem_type == Lexem::BACKSLASH || lexem_type == Lexem::NEWLINE || lexem_type == Lexem::WHITESPACE )
+            def_lexems.pop_front();
+        else
+            break;
+    }
+
+    DefineEntry def;
+    if( !def_lexems.empty() )
+    {
+        if( def_lexems.begin()->Type == Lexem::PREPROCESSOR && def_lexems.begin()->Value == "#" )
+        {
+            // Macro has arguments
+            def_lexems.pop_front();
+            if( def_lexems.empty() )
+            {
+                PrintErrorMessage( "Expected arguments." );
+                return;
+            }
+            if( def_lexems.begin()->Value != "(" )
+            {
+                PrintErrorMessage( "Expected arguments." );
+                return;
+            }
+            def_lexems.pop_front();
+
+            int num_args = 0;
+            while( !def_lexems.empty() && def_lexems.begin()->Value != ")" )
+            {
+                if( def_lexems.begin()->Type != Lexem::IDENTIFIER )
+                {
+                    PrintErrorMessage( "Expected identifier." );
+                    return;
+                }
+                def.Arguments[def_lexems.begin()->Value] = num_args;
+                def_lexems.pop_front();
+                if( !def_lexems.empty() && def_lexems.begin()->Value == "," )
+                {
+                    def_lexems.pop_front();
+                }
+                num_args++;
+            }
+
+            if( !def_lexems.empty() )
+            {
+                if( def_lexems.begin()->Value != ")" )
+                {
+                    PrintErrorMessage( "Expected closing parantheses." );
+                    return;
+                }
+                def_lexems.pop_front();
+            }
+            else
+            {
+                PrintErrorMessage( "0x0FA3 Unexpected end of line." );
+                return;
+            }
+        }
+
+        // Body lexems are marked again by expansion of this define
+        LLITR dlb = def_lexems.begin();
+        SkipExpansions = true;
+        while( dlb != def_lexems.end() )
+        {
+            if( dlb->Value == "##" && dlb->Type == Lexem::IGNORED )
+                dlb->Value = "";
+            dlb = ExpandDefine( dlb, def_lexems.end(), def_lexems, define_table );
+        }
+        SkipExpansions = false;
+    }
+
+    def.Lexems = def_lexems;
+    define_table[name.Value] = def;
+}
+
+// Updates conditional stack for #if/#ifdef/#ifndef/#elif/#else/#endif, returns false for other directives
+bool Preprocessor::ParseConditional( const std::string& value, LexemList& directive, ConditionalStack& conditionals, DefineTable& define_table )
+{
+    bool parent_active = conditionals.empty() || conditionals.back().Active;
+    if( value == "#ifdef" || value == "#ifndef" || value == "#if" )
+    {
+        Conditional cond;
+        cond.ParentActive = parent_active;
+        cond.Active = false;
+        cond.Taken = true;
+        cond.Else = false;
+        if( parent_active )
+        {
+            if( CurStatistics )
+                CurStatistics->IfEvaluations++;
+            if( value == "#if" )
+                cond.Active = EvaluateExpression( define_table, directive );
+            else
+            {
+                std::string def_name;
+                ParseIf( directive, def_name );
+                bool        defined = define_table.find( def_name ) != define_table.end();
+                cond.Active = ( value == "#ifdef" ? defined : !defined );
+            }
+            cond.Taken = cond.Active;
+        }
+        conditionals.push_back( cond );
+        return true;
+    }
+
+    if( value == "#elif" || value == "#else" )
+    {
+        if( conditionals.empty() )
+        {
+            PrintErrorMessage( value + " without #if." );
+            return true;
+        }
+        Conditional& cond = conditionals.back();
+        if( cond.Else )
+        {
+            PrintErrorMessage( value + " after #else." );
+            cond.Active = false;
+            return true;
+        }
+        if( value == "#else" )
+        {
+            cond.Active = !cond.Taken;
+            cond.Else = true;
+        }
+        else if( cond.Taken )
+            cond.Active = false;
+        else
+        {
+            if( CurStatistics )
+                CurStatistics->IfEvaluations++;
+            cond.Active = EvaluateExpression( define_table, directive );
+        }
+        cond.Taken = cond.Taken || cond.Active;
+        return true;
+    }
+
+    if( value == "#endif" )
+    {
+        // Unmatched #endif is ignored
+        if( !conditionals.empty() )
+            conditionals.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void Preprocessor::ParseIf( LexemList& directive, std::string& name_out )
+{
+    directive.pop_front();
+    if( directive.empty() )
+    {
+        PrintErrorMessage( "Expected argument." );
+        return;
+    }
+    name_out = directive.begin()->Value;
+    directive.pop_front();
+    if( !directive.empty() )
+        PrintErrorMessage( "Too many arguments." );
+}
+
+void Preprocessor::ParseUndef( LexemList& directive, DefineTable& define_table )
+{
+    directive.pop_front();
+
+    if( directive.empty() )
+        PrintErrorMessage( "Undef directive without arguments." );
+    else if( directive.size() > 1 )
+        PrintErrorMessage( "Undef directive with multiple arguments." );
+
+    auto it = define_table.find( directive.begin()->Value );
+    if( it != define_table.end() )
+        define_table.erase( it );
+}
+
+bool Preprocessor::ConvertExpression( LexemList& expression, LexemList& output )
+{
+    if( expression.empty() )
+    {
+        PrintMessage( "Empty expression." );
+        return true;
+    }
+
+    // Convert to RPN
+    std::vector<Lexem> stack;
+    for( LLITR it = expression.begin(); it != expression.end(); ++it )
+    {
+        PreprocessLexem( it, expression );
+        Lexem& lexem = *it;
+        if( IsIdentifier( lexem ) )
+        {
+            output.push_back( lexem );
+        }
+        else if( IsOperator( lexem ) )
+        {
+            while( stack.size() )
+            {
+                Lexem& lex = stack.back();
+                if( IsOperator( lex ) &&
+                    ( (OperLeftAssoc( lexem ) && ( OperPrecedence( lexem ) <= OperPrecedence( lex ))) ||
+                      (OperPrecedence( lexem ) < OperPrecedence( lex )) ) )
+                {
+                    output.push_back( lex );
+                    stack.pop_back();
+                }
+                else
+                    break;
+            }
+            stack.push_back( lexem );
+        }
+        else if( IsLeft( lexem ) )
+        {
+            stack.push_back( lexem );
+        }
+        else if( IsRight( lexem ) )
+        {
+            bool foundLeft = false;
+            while( stack.size() )
+            {
+                Lexem& lex = stack.back();
+                if( IsLeft( lex ) )
+                {
+                    foundLeft = true;
+                    break;
+                }
+                else
+                {
+                    output.push_back( lex );
+                    stack.pop_back();
+                }
+            }
+
+            if( !foundLeft )
+            {
+                PrintErrorMessage( "Mismatched parentheses." );
+                return false;
+            }
+
+            stack.pop_back();
+        }
+        else
+        {
+            PrintErrorMessage( "Unknown token: " + lexem.Value );
+            return false;
+        }
+    }
+
+    // input end, flush the stack
+    while( stack.size() )
+    {
+        Lexem& lex = stack.back();
+        if( IsLeft( lex ) || IsRight( lex ) )
+        {
+            PrintErrorMessage( "Mismatched parentheses." );
+            return false;
+        }
+        output.push_back( lex );
+        stack.pop_back();
+    }
+    return true;
+}
+
+int Preprocessor::EvaluateConvertedExpression( DefineTable& define_table, LexemList& expr )
+{
+    std::vector<int> stack;
+
+    while( expr.size() )
+    {
+        Lexem lexem = expr.front();
+        expr.pop_front();
+
+        if( IsIdentifier( lexem ) )
+        {
+            if( lexem.Type == Lexem::NUMBER )
+                stack.push_back( atoi( lexem.Value.c_str() ) );
+            else
+            {
+                LexemList ll;
+                ll.push_back( lexem );
+                ExpandDefine( ll.begin(), ll.end(), ll, define_table );
+                LexemList out;
+                bool      success = ConvertExpression( ll, out );
+                if( !success )
+                {
+                    PrintErrorMessage( "Error while expanding macros." );
+                    return 0;
+                }
+                stack.push_back( EvaluateConvertedExpression( define_table, out ) );
+            }
+        }
+        else if( IsOperator( lexem ) )
+        {
+            if( lexem.Value == "!" )
+            {
+                if( !stack.size() )
+                {
+                    PrintErrorMessage( "Syntax error in #if: no argument for ! operator." );
+                    return 0;
+                }
+                stack.back() = stack.back() != 0 ? 0 : 1;
+            }
+            else
+            {
+                if( stack.size() < 2 )
+                {
+                    PrintErrorMessage( "Syntax error in #if: not enough arguments for " + lexem.Value + " operator." );
+                    return 0;
+                }
+                int rhs = stack.back();
+                stack.pop_back();
+                int lhs = stack.back();
+                stack.pop_back();
+
+                std::string op = lexem.Value;
+                if( op == "*" )
+                    stack.push_back( lhs *  rhs );
+                if( op == "/" )
+                    stack.push_back( lhs /  rhs );
+                if( op == "%" )
+                    stack.push_back( lhs %  rhs );
+                if( op == "+" )
+                    stack.push_back( lhs +  rhs );
+                if( op == "-" )
+                    stack.push_back( lhs -  rhs );
+                if( op == "<" )
+                    stack.push_back( lhs <  rhs );
+                if( op == "<=" )
+                    stack.push_back( lhs <= rhs );
+                if( op == ">" )
+                    stack.push_back( lhs >  rhs );
+                if( op == ">=" )
+                    stack.push_back( lhs >= rhs );
+                if( op == "==" )
+                    stack.push_back( lhs == rhs );
+                if( op == "!=" )
+                    stack.push_back( lhs != rhs );
+                if( op == "&&" )
+                    stack.push_back( ( lhs != 0 && rhs != 0 ) ? 1 : 0 );
+                if( op == "||" )
+                    stack.push_back( ( lhs != 0 || rhs != 0 ) ? 1 : 0 );
+            }
+        }
+        else
+        {
+            PrintErrorMessage( "Internal error on lexem " + lexem.Value + "." );
+            return 0;
+        }
+    }
+    if( stack.size() == 1 )
+        return stack.back();
+    PrintErrorMessage( "Invalid #if expression." );
+    return 0;
+}
+
+bool Preprocessor::EvaluateExpression( DefineTable& define_table, LexemList& directive )
+{
+    LexemList output;
+    directive.pop_front();
+    bool      success = ConvertExpression( directive, output );
+    if( !success )
+        return false;
+    SkipExpansions = true;
+    int       value = EvaluateConvertedExpression( define_table, output );
+    SkipExpansions = false;
+    return value != 0;
+}
+
+std::string Preprocessor::AddPaths( const std::string& first, const std::string& second )
+{
+    std::string result;
+    size_t      slash_pos = first.find_last_of( '/' );
+    if( slash_pos == 0 || slash_pos >= first.size() )
+        return second;
+    result = first.substr( 0, slash_pos + 1 );
+    result += second;
+    return result;
+}
+
+void Preprocessor::ParsePragma( LexemList& args )
+{
+    args.pop_front();
+    if( args.empty() )
+    {
+        PrintErrorMessage( "Pragmas need arguments." );
+        return;
+    }
+    std::string p_name = args.begin()->Value;
+    args.pop_front();
+    std::string p_args;
+    if( !args.empty() )
+    {
+        if( args.begin()->Type != Lexem::STRING )
+            PrintErrorMessage( "Pragma parameter should be a string literal." );
+        p_args = RemoveQuotes( args.begin()->Value );
+        args.pop_front();
+    }
+    if( !args.empty() )
+        PrintErrorMessage( "Too many parameters to pragma." );
+
+    Pragmas.push_back( p_name );
+    Pragmas.push_back( p_args );
+
+    Pragma::Record record;
+    record.Name = p_name;
+    record.Text = p_args;
+    record.CurrentFile = CurrentFile;
+    record.CurrentFileLine = LinesThisFile;
+    record.RootFile = RootFile;
+    record.GlobalLine = CurrentLine;
+    PragmaRecords.push_back( record );
+    DispatchPragma( record );
+}
+
+void Preprocessor::ParseTextLine( LexemList& directive, std::string& message )
+{
+    message = "";
+    directive.pop_front();
+    if( directive.empty() )
+        return;
+
+    bool first = true;
+    while( !directive.empty() )
+    {
+        if( !first )
+            message += " ";
+        else
+            first = false;
+        message += directive.begin()->Value;
+        directive.pop_front();
+    }
+}
+
+void Preprocessor::SetLineMacro( DefineTable& define_table, unsigned int line )
+{
+    DefineEntry       def;
+    Lexem             l;
+    l.Type = Lexem::NUMBER;
+    std::stringstream sstr;
+    sstr << line;
+    sstr >> l.Value;
+    def.Lexems.push_back( l );
+    define_table["__LINE__"] = def;
+}
+
+void Preprocessor::SetFileMacro( DefineTable& define_table, const std::string& file )
+{
+    DefineEntry def;
+    Lexem       l;
+    l.Type = Lexem::STRING;
+    l.Value = std::string( "\"" ) + file + "\"";
+    def.Lexems.push_back( l );
+    define_table["__FILE__"] = def;
+}
+
+// Takes file buffer from pool of reused instance, returns it at end of scope
+struct FileBufferScope
+{
+    std::vector<std::vector<char> >* Pool;
+    std::vector<char>                Data;
+
+    FileBufferScope( std::vector<std::vector<char> >* pool ) : Pool( pool )
+    {
+        if( Pool && !Pool->empty() )
+        {
+            Data.swap( Pool->back() );
+            Pool->pop_back();
+        }
+    }
+
+    ~FileBufferScope()
+    {
+        if( Pool )
+        {
+            Data.clear();
+            Pool->push_back( std::vector<char>() );
+            Pool->back().swap( Data );
+        }
+    }
+};
+
+// Unlexed rest of including file, kept in temporary file while included file is preprocessed
+struct SpilledBuffer
+{
+    FILE*  Stream;
+    size_t Size;
+    size_t Begin;               // Offsets of lexer pointers in spilled part
+    size_t LineStart;
+    size_t CommentLineStart;
+    size_t Limit;
+
+    SpilledBuffer() : Stream( NULL ), Size( 0 ), Begin( 0 ), LineStart( 0 ), CommentLineStart( 0 ), Limit( 0 ) {}
+};
+
+static bool SpillBuffer( Preprocessor::Lexer& lexer, std::vector<char>& data, SpilledBuffer& spill )
+{
+    char* keep = lexer.LineStart;
+    if( lexer.CommentLineStart && lexer.CommentLineStart < keep )
+        keep = lexer.CommentLineStart;
+
+    spill.Stream = tmpfile();
+    if( !spill.Stream )
+        return false;
+    spill.Size = lexer.End - keep;
+    if( fwrite( keep, 1, spill.Size, spill.Stream ) != spill.Size )
+    {
+        fclose( spill.Stream );
+        return false;
+    }
+
+    spill.Begin = lexer.Begin - keep;
+    spill.LineStart = lexer.LineStart - keep;
+    spill.CommentLineStart = ( lexer.CommentLineStart ? lexer.CommentLineStart - keep : spill.Size + 1 );
+    spill.Limit = lexer.Limit - keep;
+    std::vector<char>().swap( data );
+    return true;
+}
+
+static bool RestoreBuffer( Preprocessor::Lexer& lexer, std::vector<char>& data, SpilledBuffer& spill )
+{
+    data.resize( spill.Size );
+    rewind( spill.Stream );
+    bool ok = ( fread( &data[0], 1, spill.Size, spill.Stream ) == spill.Size );
+    fclose( spill.Stream );
+    if( !ok )
+    {
+        lexer.Begin = lexer.End = lexer.Limit = NULL;
+        return false;
+    }
+
+    char* base = &data[0];
+    lexer.Begin = base + spill.Begin;
+    lexer.End = base + spill.Size;
+    lexer.LineStart = base + spill.LineStart;
+    lexer.CommentLineStart = ( spill.CommentLineStart <= spill.Size ? base + spill.CommentLineStart : NULL );
+    lexer.Limit = base + spill.Limit;
+    return true;
+}
+
+void Preprocessor::RecursivePreprocess( std::string filename, FileLoader& file_source, LexemList& lexems, DefineTable& define_table )
+{
+    if( IsCancelled() || BudgetExceeded )
+        return;
+
+    unsigned int start_line = CurrentLine;
+    LinesThisFile = 0;
+    CurrentFile = filename;
+    SetFileMacro( define_table, CurrentFile );
+    SetLineMacro( define_table, LinesThisFile );
+
+    // Path formatting must be done in main application
+    std::string CurrentFileRoot = RootPath + CurrentFile;
+    std::pair<std::unordered_map<std::string, unsigned int>::iterator, bool> file_ins =
+        FilesPreprocessedIndex.insert( std::make_pair( CurrentFileRoot, (unsigned int) FilesPreprocessed.size() ) );
+    unsigned int file_index = file_ins.first->second;
+    if( file_ins.second )
+        FilesPreprocessed.push_back( CurrentFileRoot );
+
+    ProfileFileScope profile_scope( CurProfile, CurrentFileRoot );
+    if( CurTrace && file_ins.second )
+        TraceFileNames.push_back( CurTrace->GetName( CurrentFileRoot ) );
+    TraceScope       trace_scope( CurTrace, CurTrace ? TraceFileNames[file_index] : 0 );
+
+    FileBufferScope    buffer( Reuse ? &FileBuffers : NULL );
+    std::vector<char>& data = buffer.Data;
+    const char*        mapped = NULL;
+    size_t             size = 0;
+    bool               loaded;
+    {
+        PhaseScope phase( *this, Statistics::PHASE_LOAD );
+        TraceScope trace( CurTrace, Trace::NAME_LOAD );
+        loaded = file_source.MapFile( RootPath, filename, mapped, size );
+        if( !loaded )
+        {
+            size_t pooled = data.capacity();
+            mapped = NULL;
+            loaded = file_source.LoadFile( RootPath, filename, data );
+            size = data.size();
+            if( data.capacity() != pooled )
+                Memory.CountHeapAllocations( 1 );
+        }
+    }
+    if( !loaded )
+    {
+        PrintErrorMessage( std::string( "Could not open file " ) + RootPath + filename );
+        return;
+    }
+
+    if( size == 0 )
+        return;
+    Memory.Track( MemoryContext::MEMORY_FILES, data.capacity(), true );
+
+    // Lexer does not write to buffer, mapped one is never modified
+    char* d_begin = ( mapped ? const_cast<char*>( mapped ) : &data[0] );
+    char* d_end = d_begin + size;
+    Lexer lexer( d_begin, d_end, file_index );
+
+    FileLexems.push_back( &lexems );
+    if( CurStatistics )
+        CurStatistics->BytesRead += size;
+
+    // Cached or big file is lexed as whole, inactive regions are not skipped
+    bool parallel = ( LexThreads != 1 && size >= LexThreadsMinSize );
+    if( CurLexemCache || parallel )
+    {
+        PhaseScope phase( *this, Statistics::PHASE_LEX );
+        TraceScope trace( CurTrace, Trace::NAME_LEX );
+        bool       cached = ( CurLexemCache && CurLexemCache->Load( CurrentFileRoot, d_begin, size, lexems ) );
+        if( cached )
+        {
+            for( LexemList::iterator it = lexems.begin(); it != lexems.end(); ++it )
+                it->File = file_index;
+        }
+        else
+        {
+            if( parallel )
+                LexParallel( d_begin, d_end, lexems, file_index, LexThreads, CurTrace );
+            else
+                Lex( d_begin, d_end, lexems, file_index );
+            if( CurLexemCache )
+            {
+                MemoryContext* memory = MemoryContext::Current();
+                MemoryContext::Current() = NULL;
+                CurLexemCache->Store( CurrentFileRoot, d_begin, size, lexems );
+                MemoryContext::Current() = memory;
+            }
+        }
+        lexer.Begin = lexer.End;
+        if( CurJob )
+            CurJob->BytesLexed += size;
+        if( CurProfile && !cached )
+            CurProfile->Files[CurProfile->Stack.back().Entry].LexemsLexed += lexems.size();
+        if( CurStatistics )
+        {
+            if( !cached )
+                CurStatistics->LexemsLexed += lexems.size();
+            UpdatePeakLexems();
+        }
+    }
+
+    LexemList::iterator itr = lexems.begin();
+    LexemList::iterator end = lexems.end();
+    ConditionalStack    conditionals;
+    bool                active = true;
+    FileCursors.push_back( &itr );
+    while( true )
+    {
+        if( itr == end )
+        {
+            if( lexer.Done() || IsCancelled() || BudgetExceeded )
+                break;
+            if( MemoryBudget && !EnforceBudget() )
+                break;
+
+            // Lexes up to next directive, which may change active state
+            PhaseScope phase( *this, Statistics::PHASE_LEX );
+            size_t     size = lexems.size();
+            char*      lexed = lexer.Begin;
+            itr = ( active ? lexer.LexDirective( lexems ) : lexer.SkipInactive( lexems ) );
+            size = lexems.size() - size;
+            if( CurJob )
+                CurJob->BytesLexed += lexer.Begin - lexed;
+            if( CurProfile )
+                CurProfile->Files[CurProfile->Stack.back().Entry].LexemsLexed += size;
+            if( CurStatistics )
+            {
+                CurStatistics->LexemsLexed += size;
+                UpdatePeakLexems();
+            }
+        }
+        else if( itr->Type == Lexem::NEWLINE )
+        {
+            unsigned int newlines = (unsigned int) itr->Value.size();
+            CurrentLine += newlines;
+            LinesThisFile += newlines;
+            SetLineMacro( define_table, LinesThisFile );
+            ++itr;
+        }
+        else if( itr->Type == Lexem::PREPROCESSOR )
+        {
+            if( IsCancelled() )
+                break;
+
+            LLITR     start_of_line = itr;
+            LLITR     end_of_line = ParsePreprocessor( lexems, itr, end );
+
+            LexemList directive( start_of_line, end_of_line );
+
+            if( SkipPragmas && active && directive.begin()->Value == "#pragma" )
+            {
+                itr = end_of_line;
+                Lexem wspace;
+                wspace.Type = Lexem::WHITESPACE;
+                wspace.Value = " ";
+                for( LLITR it = start_of_line; it != end_of_line;)
+                {
+                    ++it;
+                    it = lexems.insert( it, wspace );
+                    ++it;
+                }
+                continue;
+            }
+
+            itr = lexems.erase( start_of_line, end_of_line );
+
+            std::string value = directive.begin()->Value;
+            TraceScope  trace( CurTrace, CurTrace ? Trace::GetDirectiveName( value ) : 0 );
+            if( ParseConditional( value, directive, conditionals, define_table ) )
+            {
+                active = conditionals.empty() || conditionals.back().Active;
+            }
+            else if( !active )
+            {
+                if( CurStatistics )
+                {
+                    CurStatistics->LexemsDropped += directive.size();
+                    CurStatistics->IncludesSkipped += ( value == "#include" );
+                }
+            }
+            else if( value == "#define" )
+            {
+                ParseDefine( define_table, directive );
+            }
+            else if (value == "#undef")
+            {
+                ParseUndef( directive, define_table );
+            }
+            else if( value == "#include" )
+            {
+                if( CurStatistics )
+                    CurStatistics->IncludesProcessed++;
+                if( LNT )
+                    LNT->AddLineRange( PrependRootPath( filename ), start_line, CurrentLine - LinesThisFile );
+                unsigned int save_lines_this_file = LinesThisFile;
+                std::string  file_name;
+                ParseIf( directive, file_name );
+
+                std::string file_name_ = RemoveQuotes( file_name );
+                if( IncludeTranslator )
+                    IncludeTranslator->Call( file_name_ );
+                if( FileDependenciesIndex.insert( file_name_ ).second )
+                    FileDependencies.push_back( file_name_ );
+
+                // Rest of this file is not needed until included one is done
+                SpilledBuffer spill;
+                size_t        capacity = data.capacity();
+                bool          spilled = ( MemoryBudget && Memory.Used > MemoryBudget / 2 && !mapped && !lexer.Done() && SpillBuffer( lexer, data, spill ) );
+                if( spilled )
+                    Memory.Track( MemoryContext::MEMORY_FILES, capacity, false );
+
+                LexemList next_file;
+                RecursivePreprocess( AddPaths( filename, file_name_ ), file_source, next_file, define_table );
+                lexems.splice( itr, next_file );
+
+                if( spilled )
+                {
+                    if( !RestoreBuffer( lexer, data, spill ) )
+                        PrintErrorMessage( std::string( "Could not restore spilled file " ) + RootPath + filename );
+                    if( data.capacity() )
+                        Memory.CountHeapAllocations( 1 );
+                    Memory.Track( MemoryContext::MEMORY_FILES, data.capacity(), true );
+                    if( CurStatistics )
+                        CurStatistics->BytesSpilled += spill.Size;
+                }
+                start_line = CurrentLine;
+                LinesThisFile = save_lines_this_file;
+                CurrentFile = filename;
+                SetFileMacro( define_table, CurrentFile );
+                SetLineMacro( define_table, LinesThisFile );
+            }
+            else if( value == "#pragma" )
+            {
+                ParsePragma( directive );
+            }
+            else if( value == "#message" )
+            {
+                std::string message;
+                ParseTextLine( directive, message );
+                PrintMessage( message );
+            }
+            else if( value == "#warning" )
+            {
+                std::string warning;
+                ParseTextLine( directive, warning );
+                PrintWarningMessage( warning );
+            }
+            else if( value == "#error" )
+            {
+                std::string error;
+                ParseTextLine( directive, error );
+                PrintErrorMessage( error );
+            }
+            else
+            {
+                PrintErrorMessage( "Unknown directive '" + value + "'." );
+            }
+        }
+        else if( !active )
+        {
+            if( CurStatistics )
+                CurStatistics->LexemsDropped++;
+            itr = lexems.erase( itr );
+        }
+        else if( itr->Type == Lexem::IDENTIFIER )
+        {
+            if( IsCancelled() )
+                break;
+
+            PhaseScope phase( *this, Statistics::PHASE_EXPANSION );
+            itr = ExpandDefine( itr, end, lexems, define_table );
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+
+    if( CurStatistics )
+        CurStatistics->LinesSkipped += lexer.LinesSkipped;
+
+    for( size_t i = 0; i < conditionals.size() && !Cancelled && !BudgetExceeded; i++ )
+    {
+        if( !conditionals[i].Active )
+        {
+            PrintErrorMessage( "0x0FA4 Unexpected end of file." );
+            break;
+        }
+    }
+
+    if( LNT )
+        LNT->AddLineRange( PrependRootPath( filename ), start_line, CurrentLine - LinesThisFile );
+
+    FileLexems.pop_back();
+    FileCursors.pop_back();
+    Memory.Track( MemoryContext::MEMORY_FILES, data.capacity(), false );
+    if( CurJob )
+        CurJob->FilesDone++;
+}
+
+int Preprocessor::Preprocess( std::string file_path, OutStream& result, OutStream* errors, FileLoader* loader, bool skip_pragmas )
+{
+    static OutStream  null_stream;
+    static FileLoader default_loader;
+
+    if( LNT && Reuse )
+        LNT->lines.clear();
+    else
+    {
+        delete LNT;
+        LNT = new LineNumberTranslator();
+    }
+
+    CurrentFile = "ERROR";
+    CurrentLine = 0;
+
+    Errors = ( errors ? errors : &null_stream );
+    ErrorsCount = 0;
+    Cancelled = false;
+    BudgetExceeded = false;
+    SkipExpansions = false;
+
+    FileDependencies.clear();
+    FilesPreprocessed.clear();
+    FileDependenciesIndex.clear();
+    FilesPreprocessedIndex.clear();
+    TraceFileNames.clear();
+
+    Pragmas.clear();
+    PragmaRecords.clear();
+    SkipPragmas = skip_pragmas;
+    if( CurPragmaRegistry )
+        CurPragmaRegistry->BeginRun();
+
+    if( CurSourceMap )
+        CurSourceMap->Clear();
+
+    double start_time = 0.0;
+    if( CurStatistics )
+    {
+        CurStatistics->Clear();
+        start_time = GetTime();
+    }
+
+    if( Memory.Stats )
+        Memory.Stats->Clear();
+    MemoryContext* prev_memory = MemoryContext::Current();
+    Memory.Used = 0;
+    Memory.Hook = ( CurAllocationHook ? CurAllocationHook : &RunArena );
+    MemoryContext::Current() = &Memory;
+    Memory.Track( MemoryContext::MEMORY_LINES, LNT->lines.capacity() * sizeof( LineNumberTranslator::Entry ), true );
+
+    size_t n = file_path.find_last_of( "\\/" );
+    RootFile = ( n != std::string::npos ? file_path.substr( n + 1 ) : file_path );
+    RootPath = ( n != std::string::npos ? file_path.substr( 0, n + 1 ) : "./" );
+
+    DefineTable       define_table = CustomDefines;
+    LexemList         lexems;
+    CountingOutStream counter( result );
+    OutStream&        destination = ( CurStatistics ? counter : result );
+    SpoolOutStream    spool;
+
+    // Token stream needs all lexems for its string table, failed run writes nothing
+    StreamDestination = ( MemoryBudget && CurOutputFormat == OUTPUT_TEXT ? &spool : NULL );
+    StreamSpace = false;
+    StreamColumn = 0;
+
+    {
+        PhaseScope phase( *this, Statistics::PHASE_DIRECTIVES );
+        RecursivePreprocess( RootFile, loader ? *loader : default_loader, lexems, define_table );
+    }
+
+    if( CurProfile )
+        ProfileEmitted( lexems.begin(), lexems.end() );
+
+    if( !Cancelled && !BudgetExceeded )
+    {
+        PhaseScope phase( *this, Statistics::PHASE_EMIT );
+        TraceScope trace( CurTrace, Trace::NAME_EMIT );
+        if( CurOutputFormat == OUTPUT_TOKENS )
+        {
+            if( !PrintTokenStream( lexems, destination, FilesPreprocessed, CurJob ? &CurJob->CancelRequested : NULL ) )
+                Cancelled = true;
+        }
+        else
+        {
+            bool  copied = spool.CopyTo( destination );
+            if( !copied )
+                PrintErrorMessage( "Could not write streamed output to temporary file." );
+
+            // Cancellation is polled between slices
+            LLITR slice = lexems.begin();
+            while( copied && slice != lexems.end() && !IsCancelled() )
+            {
+                LLITR slice_end = slice;
+                for( size_t i = 0; i < EmitSlice && slice_end != lexems.end(); i++ )
+                    ++slice_end;
+                PrintLexems( slice, slice_end, destination, CurSourceMap, StreamSpace, StreamColumn );
+                slice = slice_end;
+            }
+        }
+        if( CurStatistics )
+        {
+            CurStatistics->OutputBytes = counter.Bytes;
+            CurStatistics->PeakLexems = std::max( CurStatistics->PeakLexems, lexems.size() );
+        }
+    }
+    if( Cancelled )
+        PrintErrorMessage( "Preprocessing cancelled." );
+    if( CurSourceMap )
+        CurSourceMap->Files = FilesPreprocessed;
+
+    if( CurStatistics )
+        CurStatistics->TotalTime = GetTime() - start_time;
+
+    if( Memory.Stats && Memory.Stats->ForbiddenAllocations )
+        PrintErrorMessage( IntToString( (int) Memory.Stats->ForbiddenAllocations ) + " heap allocations while allocations are forbidden." );
+
+    StreamDestination = NULL;
+
+    // Per run containers return memory before hook is reset
+    lexems.clear();
+    define_table.clear();
+    Memory.Hook->Reset();
+    MemoryContext::Current() = prev_memory;
+
+    if( CurPragmaCallback && !PragmaBatch.empty() )
+    {
+        CurPragmaCallback->CallPragmas( PragmaBatch );
+        PragmaBatch.clear();
+    }
+    return ErrorsCount;
+}
+
+/************************************************************************/
+/* Configurations                                                       */
+/************************************************************************/
+
+static bool SameDefinition( const Preprocessor::DefineEntry* first, const Preprocessor::DefineEntry* second )
+{
+    if( !first || !second )
+        return !first && !second;
+    if( first->Arguments != second->Arguments || first->Lexems.size() != second->Lexems.size() )
+        return false;
+    for( Preprocessor::LexemList::const_iterator a = first->Lexems.begin(), b = second->Lexems.begin(); a != first->Lexems.end(); ++a, ++b )
+    {
+        if( a->Type != b->Type || a->Value != b->Value )
+            return false;
+    }
+    return true;
+}
+
+static const Preprocessor::DefineEntry* FindDefinition( const Preprocessor::DefineTable& table, const std::string& name )
+{
+    Preprocessor::DefineTable::const_iterator it = table.find( name );
+    return it != table.end() ? &it->second : NULL;
+}
+
+// Configurations walking same path, they disagree only on Differing names. Fields from Output on
+// are swapped with preprocessor while group is walked.
+struct Preprocessor::ConfigurationGroup
+{
+    struct Frame
+    {
+        std::string      File;
+        LexemList        Lexems;
+        LLITR            Cursor;
+        ConditionalStack Conditionals;
+        unsigned int     StartLine;     // Of line range being walked
+        unsigned int     IncludeLines;  // LinesThisFile at last #include
+    };
+
+    std::vector<size_t>                           Members;      // Configuration indices, first one leads
+    DefineTable                                   Defines;      // Agreed by all members, differing names are left out
+    std::set<std::string>                         Differing;
+    std::vector<DefineTable>                      Own;          // Differing names as each member defines them
+    std::list<Frame>                              Frames;       // Files being walked, root first
+
+    StringOutStream                               Output;
+    bool                                          Space;
+    unsigned int                                  Column;
+    StringOutStream                               Errors;
+    unsigned int                                  ErrorsCount;
+    LineNumberTranslator                          Lines;
+    std::string                                   CurrentFile;
+    unsigned int                                  CurrentLine;
+    unsigned int                                  LinesThisFile;
+    std::vector<std::string>                      FileDependencies;
+    std::unordered_set<std::string>               FileDependenciesIndex;
+    std::vector<std::string>                      FilesPreprocessed;
+    std::unordered_map<std::string, unsigned int> FilesPreprocessedIndex;
+    std::vector<std::string>                      Pragmas;
+    std::vector<Pragma::Record>                   PragmaRecords;
+
+    ConfigurationGroup() : Space( false ), Column( 0 ), ErrorsCount( 0 ), CurrentFile( "ERROR" ), CurrentLine( 0 ), LinesThisFile( 0 ) {}
+
+    void Swap( Preprocessor& preprocessor )
+    {
+        std::swap( Space, preprocessor.StreamSpace );
+        std::swap( Column, preprocessor.StreamColumn );
+        std::swap( ErrorsCount, preprocessor.ErrorsCount );
+        CurrentFile.swap( preprocessor.CurrentFile );
+        std::swap( CurrentLine, preprocessor.CurrentLine );
+        std::swap( LinesThisFile, preprocessor.LinesThisFile );
+        FileDependencies.swap( preprocessor.FileDependencies );
+        FileDependenciesIndex.swap( preprocessor.FileDependenciesIndex );
+        FilesPreprocessed.swap( preprocessor.FilesPreprocessed );
+        FilesPreprocessedIndex.swap( preprocessor.FilesPreprocessedIndex );
+        Pragmas.swap( preprocessor.Pragmas );
+        PragmaRecords.swap( preprocessor.PragmaRecords );
+    }
+
+    void Enter( Preprocessor& preprocessor )
+    {
+        Swap( preprocessor );
+        preprocessor.Errors = &Errors;
+        preprocessor.LNT = &Lines;
+        preprocessor.StreamDestination = &Output;
+        for( std::list<Frame>::iterator it = Frames.begin(); it != Frames.end(); ++it )
+        {
+            preprocessor.FileLexems.push_back( &it->Lexems );
+            preprocessor.FileCursors.push_back( &it->Cursor );
+        }
+    }
+
+    void Leave( Preprocessor& preprocessor )
+    {
+        Swap( preprocessor );
+        preprocessor.FileLexems.clear();
+        preprocessor.FileCursors.clear();
+    }
+
+    // Copied frames point to lexems of group they were copied from
+    void CopyCursors( const ConfigurationGroup& source )
+    {
+        std::list<Frame>::const_iterator from = source.Frames.begin();
+        for( std::list<Frame>::iterator it = Frames.begin(); it != Frames.end(); ++it, ++from )
+        {
+            it->Cursor = it->Lexems.begin();
+            std::advance( it->Cursor, std::distance( from->Lexems.begin(), LexemList::const_iterator( from->Cursor ) ) );
+        }
+    }
+
+    const DefineEntry* Find( size_t member, const std::string& name ) const
+    {
+        return FindDefinition( Differing.count( name ) ? Own[member] : Defines, name );
+    }
+
+    // Name is defined same way by all members from now on
+    void Agree( const std::string& name )
+    {
+        if( !Differing.erase( name ) )
+            return;
+        for( size_t m = 0; m < Own.size(); m++ )
+            Own[m].erase( name );
+    }
+
+    // Differing names defined same way by remaining members are moved to Defines
+    void Restrict( const std::vector<size_t>& positions )
+    {
+        std::vector<size_t>      members;
+        std::vector<DefineTable> own;
+        for( size_t i = 0; i < positions.size(); i++ )
+        {
+            members.push_back( Members[positions[i]] );
+            own.push_back( DefineTable() );
+            own.back().swap( Own[positions[i]] );
+        }
+        Members.swap( members );
+        Own.swap( own );
+
+        for( std::set<std::string>::iterator name = Differing.begin(); name != Differing.end(); )
+        {
+            const DefineEntry* first = FindDefinition( Own[0], *name );
+            size_t             m = 1;
+            while( m < Own.size() && SameDefinition( first, FindDefinition( Own[m], *name ) ) )
+                m++;
+            if( m < Own.size() )
+            {
+                ++name;
+                continue;
+            }
+            if( first )
+                Defines[*name] = *first;
+            for( m = 0; m < Own.size(); m++ )
+                Own[m].erase( *name );
+            Differing.erase( name++ );
+        }
+    }
+
+    // Differing names which lexems may expand to, through definitions of any member
+    void DifferingNames( LexemList::const_iterator begin, LexemList::const_iterator end, std::set<std::string>& names ) const
+    {
+        std::set<std::string>    seen;
+        std::vector<std::string> pending;
+        names.clear();
+        for( ; begin != end; ++begin )
+        {
+            if( begin->Type == Lexem::IDENTIFIER && seen.insert( begin->Value ).second )
+                pending.push_back( begin->Value );
+        }
+        while( !pending.empty() )
+        {
+            std::string name = pending.back();
+            pending.pop_back();
+            bool        differing = Differing.count( name ) != 0;
+            if( differing )
+                names.insert( name );
+            for( size_t m = 0; m < ( differing ? Own.size() : 1 ); m++ )
+            {
+                const DefineEntry* entry = ( differing ? FindDefinition( Own[m], name ) : FindDefinition( Defines, name ) );
+                if( !entry )
+                    continue;
+                for( LexemList::const_iterator it = entry->Lexems.begin(); it != entry->Lexems.end(); ++it )
+                {
+                    if( it->Type == Lexem::IDENTIFIER && seen.insert( it->Value ).second )
+                        pending.push_back( it->Value );
+                }
+            }
+        }
+    }
+
+    // Member's definitions of differing names are put to Defines until Restore()
+    void Overlay( size_t member, const std::set<std::string>& names )
+    {
+        for( std::set<std::string>::const_iterator it = names.begin(); it != names.end(); ++it )
+        {
+            const DefineEntry* entry = FindDefinition( Own[member], *it );
+            if( entry )
+                Defines[*it] = *entry;
+        }
+    }
+
+    void Restore( const std::set<std::string>& names )
+    {
+        for( std::set<std::string>::const_iterator it = names.begin(); it != names.end(); ++it )
+            Defines.erase( *it );
+    }
+};
+
+struct Preprocessor::ConfigurationWalk
+{
+    // Loaded and lexed once for all groups
+    struct File
+    {
+        bool      Loaded;
+        bool      Empty;
+        LexemList Lexems;   // Without file index
+    };
+
+    FileLoader&                           Source;
+    std::unordered_map<std::string, File> Files;      // By path relative to root path
+    std::list<ConfigurationGroup>         Pending;    // Forked groups, last one is walked first
+
+    ConfigurationWalk( FileLoader& source ) : Source( source ) {}
+};
+
+// #if, #elif or #define as one member of group sees it, messages are kept instead of printed
+struct MemberDirective
+{
+    std::string               Key;          // Same for members which directive affects same way
+    std::string               Messages;
+    unsigned int              ErrorsCount;
+    bool                      Defined;      // Name of #define is defined afterwards
+    Preprocessor::DefineEntry Definition;
+};
+
+static void RunMemberDirective( Preprocessor& preprocessor, Preprocessor::ConfigurationGroup& group, size_t member, const std::string& value,
+                                const Preprocessor::LexemList& directive, const std::set<std::string>& names, MemberDirective& result )
+{
+    Preprocessor::LexemList::const_iterator second = ++directive.begin();
+    bool                                    define = ( value == "#define" );
+    std::string                             name = ( define && second != directive.end() && second->Type == Preprocessor::Lexem::IDENTIFIER ? second->Value : "" );
+    const Preprocessor::DefineEntry*        prior = ( name.empty() || names.count( name ) ? NULL : FindDefinition( group.Defines, name ) );
+    Preprocessor::DefineEntry               saved;
+    if( prior )
+        saved = *prior;
+
+    Preprocessor::OutStream*       errors = preprocessor.Errors;
+    unsigned int                   errors_count = preprocessor.ErrorsCount;
+    Preprocessor::StringOutStream  messages;
+    Preprocessor::LexemList        copy( directive );
+    preprocessor.Errors = &messages;
+    preprocessor.ErrorsCount = 0;
+    group.Overlay( member, names );
+    if( define )
+    {
+        preprocessor.ParseDefine( group.Defines, copy );
+        const Preprocessor::DefineEntry* entry = ( name.empty() ? NULL : FindDefinition( group.Defines, name ) );
+        result.Defined = ( entry != NULL );
+        if( entry )
+            result.Definition = *entry;
+    }
+    else
+        result.Key = ( preprocessor.EvaluateExpression( group.Defines, copy ) ? "1" : "0" );
+    group.Restore( names );
+    if( prior )
+        group.Defines[name] = saved;
+    else if( !name.empty() && !names.count( name ) )
+        group.Defines.erase( name );
+
+    result.Messages = messages.String;
+    result.ErrorsCount = preprocessor.ErrorsCount;
+    result.Key += messages.String;
+    preprocessor.Errors = errors;
+    preprocessor.ErrorsCount = errors_count;
+}
+
+// Name of #define gets definition of each member, it differs if they disagree
+static void DefineForMembers( Preprocessor& preprocessor, Preprocessor::ConfigurationGroup& group, Preprocessor::LexemList& directive,
+                              const std::set<std::string>& names )
+{
+    std::vector<MemberDirective> results( group.Members.size() );
+    for( size_t m = 0; m < results.size(); m++ )
+        RunMemberDirective( preprocessor, group, m, "#define", directive, names, results[m] );
+    ( *preprocessor.Errors ) << results[0].Messages;
+    preprocessor.ErrorsCount += results[0].ErrorsCount;
+
+    Preprocessor::LexemList::iterator second = ++directive.begin();
+    if( second == directive.end() || second->Type != Preprocessor::Lexem::IDENTIFIER )
+        return;
+    const std::string& name = second->Value;
+    size_t             same = 1;
+    while( same < results.size() && SameDefinition( results[0].Defined ? &results[0].Definition : NULL,
+                                                    results[same].Defined ? &results[same].Definition : NULL ) )
+        same++;
+
+    group.Agree( name );
+    group.Defines.erase( name );
+    if( same == results.size() )
+    {
+        if( results[0].Defined )
+            group.Defines[name] = results[0].Definition;
+        return;
+    }
+    group.Differing.insert( name );
+    for( size_t m = 0; m < results.size(); m++ )
+    {
+        if( results[m].Defined )
+            group.Own[m][name] = results[m].Definition;
+    }
+}
+
+bool Preprocessor::ForkConfigurations( ConfigurationWalk& walk, ConfigurationGroup& group, const std::vector<std::string>& keys )
+{
+    std::vector<std::vector<size_t> > classes;
+    std::map<std::string, size_t>     index;
+    for( size_t m = 0; m < keys.size(); m++ )
+    {
+        std::pair<std::map<std::string, size_t>::iterator, bool> ins = index.insert( std::make_pair( keys[m], classes.size() ) );
+        if( ins.second )
+            classes.push_back( std::vector<size_t>() );
+        classes[ins.first->second].push_back( m );
+    }
+    if( classes.size() == 1 )
+        return false;
+
+    // Finished text is shared, copies start with cursors at lexem being decided
+    if( CurOutputFormat == OUTPUT_TEXT )
+        StreamFinished();
+    group.Leave( *this );
+    for( size_t c = 1; c < classes.size(); c++ )
+    {
+        walk.Pending.push_back( group );
+        ConfigurationGroup& fork = walk.Pending.back();
+        fork.CopyCursors( group );
+        fork.Restrict( classes[c] );
+    }
+    group.Restrict( classes[0] );
+    group.Enter( *this );
+    return true;
+}
+
+bool Preprocessor::IncludeConfigurationFile( ConfigurationWalk& walk, ConfigurationGroup& group, const std::string& filename )
+{
+    if( IsCancelled() )
+        return false;
+
+    unsigned int start_line = CurrentLine;
+    LinesThisFile = 0;
+    CurrentFile = filename;
+    SetFileMacro( group.Defines, CurrentFile );
+    SetLineMacro( group.Defines, LinesThisFile );
+
+    std::string CurrentFileRoot = RootPath + CurrentFile;
+    std::pair<std::unordered_map<std::string, unsigned int>::iterator, bool> file_ins =
+        FilesPreprocessedIndex.insert( std::make_pair( CurrentFileRoot, (unsigned int) FilesPreprocessed.size() ) );
+    unsigned int file_index = file_ins.first->second;
+    if( file_ins.second )
+        FilesPreprocessed.push_back( CurrentFileRoot );
+
+    std::pair<std::unordered_map<std::string, ConfigurationWalk::File>::iterator, bool> ins =
+        walk.Files.insert( std::make_pair( filename, ConfigurationWalk::File() ) );
+    ConfigurationWalk::File& file = ins.first->second;
+    if( ins.second )
+    {
+        std::vector<char> data;
+        const char*       mapped = NULL;
+        size_t            size = 0;
+        file.Loaded = walk.Source.MapFile( RootPath, filename, mapped, size );
+        if( !file.Loaded )
+        {
+            mapped = NULL;
+            file.Loaded = walk.Source.LoadFile( RootPath, filename, data );
+            size = data.size();
+        }
+        file.Empty = ( size == 0 );
+        if( file.Loaded && size && !( CurLexemCache && CurLexemCache->Load( CurrentFileRoot, mapped ? mapped : &data[0], size, file.Lexems ) ) )
+        {
+            char* d_begin = ( mapped ? const_cast<char*>( mapped ) : &data[0] );
+            if( LexThreads != 1 && size >= LexThreadsMinSize )
+                LexParallel( d_begin, d_begin + size, file.Lexems, Lexem::NoPosition, LexThreads );
+            else
+                Lex( d_begin, d_begin + size, file.Lexems );
+            if( CurLexemCache )
+                CurLexemCache->Store( CurrentFileRoot, d_begin, size, file.Lexems );
+        }
+    }
+    if( !file.Loaded )
+    {
+        PrintErrorMessage( std::string( "Could not open file " ) + RootPath + filename );
+        return false;
+    }
+    if( file.Empty )
+        return false;
+
+    group.Frames.push_back( ConfigurationGroup::Frame() );
+    ConfigurationGroup::Frame& frame = group.Frames.back();
+    frame.File = filename;
+    frame.Lexems = file.Lexems;
+    frame.Cursor = frame.Lexems.begin();
+    frame.StartLine = start_line;
+    frame.IncludeLines = 0;
+    for( LexemList::iterator it = frame.Lexems.begin(); it != frame.Lexems.end(); ++it )
+        it->File = file_index;
+    FileLexems.push_back( &frame.Lexems );
+    FileCursors.push_back( &frame.Cursor );
+    return true;
+}
+
+void Preprocessor::EndConfigurationFile( ConfigurationGroup& group )
+{
+    ConfigurationGroup::Frame& frame = group.Frames.back();
+    for( size_t i = 0; i < frame.Conditionals.size() && !Cancelled; i++ )
+    {
+        if( !frame.Conditionals[i].Active )
+        {
+            PrintErrorMessage( "0x0FA4 Unexpected end of file." );
+            break;
+        }
+    }
+    LNT->AddLineRange( PrependRootPath( frame.File ), frame.StartLine, CurrentLine - LinesThisFile );
+    FileLexems.pop_back();
+    FileCursors.pop_back();
+
+    if( group.Frames.size() == 1 )
+    {
+        if( CurOutputFormat == OUTPUT_TOKENS )
+            PrintTokenStream( frame.Lexems, group.Output, FilesPreprocessed );
+        else
+            PrintLexems( frame.Lexems.begin(), frame.Lexems.end(), group.Output, NULL, StreamSpace, StreamColumn );
+        group.Frames.pop_back();
+        return;
+    }
+
+    // Included file is finished, walk goes on after it
+    ConfigurationGroup::Frame& parent = *--( --group.Frames.end() );
+    parent.Lexems.splice( parent.Cursor, frame.Lexems );
+    group.Frames.pop_back();
+
+    parent.StartLine = CurrentLine;
+    LinesThisFile = parent.IncludeLines;
+    CurrentFile = parent.File;
+    SetFileMacro( group.Defines, CurrentFile );
+    SetLineMacro( group.Defines, LinesThisFile );
+}
+
+void Preprocessor::WalkConfigurations( ConfigurationWalk& walk, ConfigurationGroup& group )
+{
+    while( !group.Frames.empty() && !IsCancelled() )
+    {
+        ConfigurationGroup::Frame& frame = group.Frames.back();
+        LexemList&                 lexems = frame.Lexems;
+        LLITR&                     itr = frame.Cursor;
+        bool                       active = frame.Conditionals.empty() || frame.Conditionals.back().Active;
+        if( itr == lexems.end() )
+        {
+            EndConfigurationFile( group );
+        }
+        else if( itr->Type == Lexem::NEWLINE )
+        {
+            unsigned int newlines = (unsigned int) itr->Value.size();
+            CurrentLine += newlines;
+            LinesThisFile += newlines;
+            SetLineMacro( group.Defines, LinesThisFile );
+            ++itr;
+        }
+        else if( itr->Type == Lexem::PREPROCESSOR )
+        {
+            LLITR       start_of_line = itr;
+            LLITR       end_of_line = ParsePreprocessor( lexems, itr, lexems.end() );
+            LexemList   directive( start_of_line, end_of_line );
+            std::string value = directive.begin()->Value;
+
+            if( SkipPragmas && active && value == "#pragma" )
+            {
+                itr = end_of_line;
+                Lexem wspace;
+                wspace.Type = Lexem::WHITESPACE;
+                wspace.Value = " ";
+                for( LLITR it = start_of_line; it != end_of_line;)
+                {
+                    ++it;
+                    it = lexems.insert( it, wspace );
+                    ++it;
+                }
+                continue;
+            }
+
+            // Members disagreeing on differing names directive depends on are forked off first
+            std::set<std::string> names;
+            bool                  evaluated = active && ( value == "#if" || value == "#ifdef" || value == "#ifndef" || value == "#define" );
+            if( value == "#elif" )
+                evaluated = !frame.Conditionals.empty() && !frame.Conditionals.back().Else && !frame.Conditionals.back().Taken;
+            if( evaluated && !group.Differing.empty() )
+            {
+                LexemList::const_iterator first = ++directive.begin();
+                if( value == "#ifdef" || value == "#ifndef" )
+                {
+                    if( first != directive.end() && group.Differing.count( first->Value ) )
+                        names.insert( first->Value );
+                }
+                else
+                    group.DifferingNames( first, directive.end(), names );
+            }
+            if( !names.empty() )
+            {
+                // Definitions made by #define may differ, its messages may not
+                std::vector<std::string> keys( group.Members.size() );
+                for( size_t m = 0; m < keys.size(); m++ )
+                {
+                    if( value == "#ifdef" || value == "#ifndef" )
+                        keys[m] = ( group.Own[m].count( *names.begin() ) ? "1" : "0" );
+                    else
+                    {
+                        MemberDirective result;
+                        RunMemberDirective( *this, group, m, value, directive, names, result );
+                        keys[m] = result.Key;
+                    }
+                }
+                if( ForkConfigurations( walk, group, keys ) )
+                    group.DifferingNames( ++directive.begin(), directive.end(), names );
+            }
+
+            itr = lexems.erase( start_of_line, end_of_line );
+
+            group.Overlay( 0, names );
+            bool conditional = ParseConditional( value, directive, frame.Conditionals, group.Defines );
+            group.Restore( names );
+            if( !conditional && active )
+            {
+                if( value == "#define" )
+                {
+                    if( names.empty() )
+                        ParseDefine( group.Defines, directive );
+                    else
+                        DefineForMembers( *this, group, directive, names );
+                }
+                else if( value == "#undef" )
+                {
+                    LexemList::iterator name = ++directive.begin();
+                    if( name != directive.end() )
+                        group.Agree( name->Value );
+                    ParseUndef( directive, group.Defines );
+                }
+                else if( value == "#include" )
+                {
+                    LNT->AddLineRange( PrependRootPath( frame.File ), frame.StartLine, CurrentLine - LinesThisFile );
+                    frame.IncludeLines = LinesThisFile;
+                    std::string file_name;
+                    ParseIf( directive, file_name );
+
+                    std::string file_name_ = RemoveQuotes( file_name );
+                    if( IncludeTranslator )
+                        IncludeTranslator->Call( file_name_ );
+                    if( FileDependenciesIndex.insert( file_name_ ).second )
+                        FileDependencies.push_back( file_name_ );
+
+                    if( !IncludeConfigurationFile( walk, group, AddPaths( frame.File, file_name_ ) ) )
+                    {
+                        frame.StartLine = CurrentLine;
+                        LinesThisFile = frame.IncludeLines;
+                        CurrentFile = frame.File;
+                        SetFileMacro( group.Defines, CurrentFile );
+                        SetLineMacro( group.Defines, LinesThisFile );
+                    }
+                }
+                else if( value == "#pragma" )
+                {
+                    ParsePragma( directive );
+                }
+                else if( value == "#message" )
+                {
+                    std::string message;
+                    ParseTextLine( directive, message );
+                    PrintMessage( message );
+                }
+                else if( value == "#warning" )
+                {
+                    std::string warning;
+                    ParseTextLine( directive, warning );
+                    PrintWarningMessage( warning );
+                }
+                else if( value == "#error" )
+                {
+                    std::string error;
+                    ParseTextLine( directive, error );
+                    PrintErrorMessage( error );
+                }
+                else
+                {
+                    PrintErrorMessage( "Unknown directive '" + value + "'." );
+                }
+            }
+        }
+        else if( !active )
+        {
+            itr = lexems.erase( itr );
+        }
+        else if( itr->Type == Lexem::IDENTIFIER )
+        {
+            // Expansion of differing macro forks members by its definition
+            if( group.Differing.count( itr->Value ) )
+            {
+                std::vector<std::string> keys( group.Members.size() );
+                for( size_t m = 0; m < keys.size(); m++ )
+                {
+                    const DefineEntry* entry = FindDefinition( group.Own[m], itr->Value );
+                    size_t             same = 0;
+                    while( same < m && !SameDefinition( entry, FindDefinition( group.Own[same], itr->Value ) ) )
+                        same++;
+                    keys[m] = IntToString( (int) same );
+                }
+                ForkConfigurations( walk, group, keys );
+            }
+            itr = ExpandDefine( itr, lexems.end(), lexems, group.Defines );
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+}
+
+int Preprocessor::PreprocessConfigurations( std::string file_path, std::vector<Configuration>& configurations, FileLoader* loader, bool skip_pragmas )
+{
+    static OutStream  null_stream;
+    static FileLoader default_loader;
+
+    if( configurations.empty() )
+        return 0;
+
+    // Walk keeps its lists and tables on heap, swaps results of each group into preprocessor
+    MemoryContext* prev_memory = MemoryContext::Current();
+    MemoryContext::Current() = NULL;
+    LineNumberTranslator* lnt = LNT;
+    SourceMap*            source_map = CurSourceMap;
+    Statistics*           stats = CurStatistics;
+    Profile*              profile = CurProfile;
+    Trace*                trace = CurTrace;
+    Pragma::Callback*     pragma_callback = CurPragmaCallback;
+    CurSourceMap = NULL;
+    CurStatistics = NULL;
+    CurProfile = NULL;
+    CurTrace = NULL;
+    CurPragmaCallback = NULL;
+
+    Cancelled = false;
+    BudgetExceeded = false;
+    SkipPragmas = skip_pragmas;
+    size_t n = file_path.find_last_of( "\\/" );
+    RootFile = ( n != std::string::npos ? file_path.substr( n + 1 ) : file_path );
+    RootPath = ( n != std::string::npos ? file_path.substr( 0, n + 1 ) : "./" );
+
+    ConfigurationWalk walk( loader ? *loader : default_loader );
+    walk.Pending.push_back( ConfigurationGroup() );
+    ConfigurationGroup& root = walk.Pending.back();
+
+    // All names are differing until Restrict() finds members agreeing on them
+    DefineTable custom_defines = CustomDefines;
+    for( size_t i = 0; i < configurations.size(); i++ )
+    {
+        CustomDefines = custom_defines;
+        for( size_t d = 0; d < configurations[i].Defines.size(); d++ )
+            Define( configurations[i].Defines[d] );
+        CustomDefines.erase( "__LINE__" );
+        CustomDefines.erase( "__FILE__" );
+        for( DefineTable::iterator it = CustomDefines.begin(); it != CustomDefines.end(); ++it )
+            root.Differing.insert( it->first );
+        root.Members.push_back( i );
+        root.Own.push_back( DefineTable() );
+        root.Own.back().swap( CustomDefines );
+    }
+    CustomDefines = custom_defines;
+    std::vector<size_t> members( root.Members.size() );
+    for( size_t i = 0; i < members.size(); i++ )
+        members[i] = i;
+    root.Restrict( members );
+
+    root.Enter( *this );
+    IncludeConfigurationFile( walk, root, RootFile );
+    root.Leave( *this );
+
+    std::vector<std::vector<Pragma::Record> > records( configurations.size() );
+    while( !walk.Pending.empty() )
+    {
+        std::list<ConfigurationGroup> current;
+        current.splice( current.begin(), walk.Pending, --walk.Pending.end() );
+        ConfigurationGroup& group = current.front();
+
+        group.Enter( *this );
+        WalkConfigurations( walk, group );
+        if( Cancelled )
+        {
+            PrintErrorMessage( "Preprocessing cancelled." );
+            group.Output.String.clear();
+        }
+        group.Leave( *this );
+
+        for( size_t m = 0; m < group.Members.size(); m++ )
+        {
+            Configuration& config = configurations[group.Members[m]];
+            config.Output.String = group.Output.String;
+            config.Errors.String = group.Errors.String;
+            config.ErrorsCount = (int) group.ErrorsCount;
+            config.Lines = group.Lines;
+            config.Dependencies = group.FileDependencies;
+            config.FilesPreprocessed = group.FilesPreprocessed;
+            config.Pragmas = group.Pragmas;
+            config.SharedWith = group.Members[0];
+            records[group.Members[m]] = group.PragmaRecords;
+        }
+    }
+
+    // Pragmas of each configuration are dispatched as its own run would, warnings follow its messages
+    CurPragmaCallback = pragma_callback;
+    int errors_count = 0;
+    for( size_t i = 0; i < configurations.size(); i++ )
     {
-        Lexem::LexemType lexem_type = def_lexems.begin()->Type;
-        if( lexem_type == Lexem::BACKSLASH || lexem_type == Lexem::NEWLINE || lexem_type == Lexem::WHITESPACE )
-            def_lexems.pop_front();
-        else
+        Configuration& config = configurations[i];
+        if( CurPragmaCallback )
+        {
+            Errors = &config.Errors;
+            ErrorsCount = (unsigned int) config.ErrorsCount;
+            if( CurPragmaRegistry )
+                CurPragmaRegistry->BeginRun();
+            for( size_t r = 0; r < records[i].size(); r++ )
+            {
+                CurrentFile = records[i][r].CurrentFile;
+                LinesThisFile = records[i][r].CurrentFileLine;
+                DispatchPragma( records[i][r] );
+            }
+            if( !PragmaBatch.empty() )
+            {
+                CurPragmaCallback->CallPragmas( PragmaBatch );
+                PragmaBatch.clear();
+            }
+            config.ErrorsCount = (int) ErrorsCount;
+        }
+        errors_count += config.ErrorsCount;
+    }
+
+    Errors = &null_stream;
+    LNT = lnt;
+    StreamDestination = NULL;
+    CurSourceMap = source_map;
+    CurStatistics = stats;
+    CurProfile = profile;
+    CurTrace = trace;
+    MemoryContext::Current() = prev_memory;
+    return errors_count;
+}
+
+void Preprocessor::Define( const std::string& str )
+{
+    if( str.length() == 0 )
+        return;
+    std::string data = "#define ";
+    data += str;
+    char*       d_end = &data[data.length() - 1];
+    ++d_end;
+
+    // Custom defines outlive run whose pragma callback may call this
+    MemoryContext* memory = MemoryContext::Current();
+    MemoryContext::Current() = NULL;
+    {
+        LexemList lexems;
+        Lex( &data[0], d_end, lexems );
+        ParseDefine( CustomDefines, lexems );
+    }
+    MemoryContext::Current() = memory;
+}
+
+void Preprocessor::Define( const std::string& str, const std::string& val )
+{
+	std::string def = str + " " + val;
+	Define(def);
+}
+
+void Preprocessor::Undef( const std::string& str )
+{
+    for( DefineTable::iterator it = CustomDefines.begin(), end = CustomDefines.end(); it != end; ++it )
+    {
+        if( ( *it ).first == str )
+        {
+            CustomDefines.erase( it );
+            Undef( str );
             break;
+        }
+    }
+}
+
+void Preprocessor::UndefAll()
+{
+    CustomDefines.clear();
+}
+
+bool Preprocessor::IsDefined( const std::string& str )
+{
+    for( DefineTable::iterator it = CustomDefines.begin(), end = CustomDefines.end(); it != end; ++it )
+    {
+        if( ( *it ).first == str )
+            return true;
+    }
+    return false;
+}
+
+Preprocessor::LineNumberTranslator* Preprocessor::GetLineNumberTranslator()
+{
+    return LNT;
+}
+
+std::string Preprocessor::ResolveOriginalFile( unsigned int line_number, LineNumberTranslator* lnt )
+{
+    lnt = ( lnt ? lnt : LNT );
+    return lnt ? lnt->Search( line_number ).File : "ERROR";
+}
+
+unsigned int Preprocessor::ResolveOriginalLine( unsigned int line_number, LineNumberTranslator* lnt )
+{
+    lnt = ( lnt ? lnt : LNT );
+    return lnt ? line_number - lnt->Search( line_number ).Offset : 0;
+}
+
+std::vector<std::string>& Preprocessor::GetFileDependencies()
+{
+    return FileDependencies;
+}
+
+std::vector<std::string>& Preprocessor::GetFilesPreprocessed()
+{
+    return FilesPreprocessed;
+}
+
+Preprocessor::Job::Job() :
+    FilesDone( 0 ),
+    BytesLexed( 0 ),
+    CancelRequested( false ),
+    Cancelled( false )
+{
+    Future = Promise.get_future().share();
+}
+
+std::shared_ptr<Preprocessor::Job> Preprocessor::PreprocessAsync( std::string file_path, FileLoader* loader, bool skip_pragmas, Job::Callback* callback )
+{
+    // Previous job is cancelled, new thread waits for it so caller never blocks
+    std::thread previous;
+    if( AsyncThread.joinable() )
+    {
+        AsyncJob->Cancel();
+        previous = std::move( AsyncThread );
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    // Thread keeps job alive, caller may drop it
+    AsyncJob = job;
+    AsyncThread = std::thread( [this, job, file_path, loader, skip_pragmas, callback]( std::thread previous )
+        {
+            if( previous.joinable() )
+                previous.join();
+
+            CurJob = job.get();
+            int                errors = 0;
+            std::exception_ptr error;
+            try
+            {
+                errors = Preprocess( file_path, job->Result, &job->Errors, loader, skip_pragmas );
+            }
+            catch( ... )
+            {
+                error = std::current_exception();
+            }
+            job->Cancelled = Cancelled;
+            if( Cancelled )
+                job->Result.String.clear();
+            CurJob = NULL;
+            if( callback )
+                callback->JobDone( *job );
+            if( error )
+                job->Promise.set_exception( error );
+            else
+                job->Promise.set_value( errors );
+        }, std::move( previous ) );
+    return job;
+}
+
+bool Preprocessor::IsCancelled()
+{
+    if( !Cancelled && CurJob && CurJob->CancelRequested )
+        Cancelled = true;
+    return Cancelled;
+}
+
+std::vector<std::string>& Preprocessor::GetParsedPragmas()
+{
+    return Pragmas;
+}
+
+std::vector<Preprocessor::Pragma::Record>& Preprocessor::GetPragmaRecords()
+{
+    return PragmaRecords;
+}
+
+void Preprocessor::PrintLexemList( LexemList& out, OutStream& destination, SourceMap* source_map )
+{
+    bool         need_a_space = false;
+    unsigned int column = 0;
+    PrintLexems( out.begin(), out.end(), destination, source_map, need_a_space, column );
+}
+
+void Preprocessor::PrintLexems( LLITR begin, LLITR end, OutStream& destination, SourceMap* source_map, bool& need_a_space, unsigned int& column )
+{
+    for( LLITR itr = begin; itr != end; ++itr )
+    {
+        if( itr->Type == Lexem::IDENTIFIER || itr->Type == Lexem::NUMBER )
+        {
+            if( need_a_space )
+            {
+                destination << " ";
+                column++;
+            }
+            need_a_space = true;
+            destination << itr->Value;
+        }
+        else
+        {
+            need_a_space = false;
+            destination << itr->Value;
+        }
+
+        if( source_map )
+        {
+            if( itr->Type == Lexem::NEWLINE )
+            {
+                // Skipped inactive lines share one lexem
+                for( size_t i = 0; i < itr->Value.size(); i++ )
+                    source_map->AddLine();
+                column = 0;
+                continue;
+            }
+            if( itr->Value.empty() )
+                continue;
+
+            source_map->AddMapping( column, *itr );
+
+            // String literals may span several lines
+            const char* str = itr->Value.c_str();
+            const char* str_end = str + itr->Value.length();
+            const char* nl;
+            while( ( nl = (const char*) memchr( str, '\n', str_end - str ) ) != NULL )
+            {
+                source_map->AddLine();
+                column = 0;
+                str = nl + 1;
+            }
+            column += (unsigned int) ( str_end - str );
+        }
+    }
+}
+
+/************************************************************************/
+/* Binary token stream                                                  */
+/************************************************************************/
+
+static void WriteUInt( std::string& out, unsigned int value )
+{
+    char bytes[4] = { (char) ( value & 0xFF ), (char) ( ( value >> 8 ) & 0xFF ), (char) ( ( value >> 16 ) & 0xFF ), (char) ( value >> 24 ) };
+    out.append( bytes, 4 );
+}
+
+bool Preprocessor::PrintTokenStream( LexemList& out, OutStream& destination, const std::vector<std::string>& files, const std::atomic<bool>* cancel )
+{
+    std::unordered_map<std::string, unsigned int> string_ids;
+    std::vector<const std::string*>               strings;
+    std::vector<unsigned int>                     file_names;
+    std::string                                   tokens;
+
+    for( size_t i = 0; i < files.size(); i++ )
+    {
+        std::pair<std::unordered_map<std::string, unsigned int>::iterator, bool> ins = string_ids.insert( std::make_pair( files[i], (unsigned int) strings.size() ) );
+        if( ins.second )
+            strings.push_back( &ins.first->first );
+        file_names.push_back( ins.first->second );
+    }
+
+    unsigned int token_count = 0;
+    for( LLITR itr = out.begin(); itr != out.end(); ++itr )
+    {
+        if( cancel && token_count % EmitSlice == 0 && *cancel )
+            return false;
+
+        std::pair<std::unordered_map<std::string, unsigned int>::iterator, bool> ins = string_ids.insert( std::make_pair( itr->Value, (unsigned int) strings.size() ) );
+        if( ins.second )
+            strings.push_back( &ins.first->first );
+
+        WriteUInt( tokens, (unsigned int) itr->Type );
+        WriteUInt( tokens, ins.first->second );
+        WriteUInt( tokens, itr->File );
+        WriteUInt( tokens, itr->Line );
+        WriteUInt( tokens, itr->Column );
+        token_count++;
+    }
+
+    std::string  head;
+    unsigned int offset = 0;
+    for( size_t i = 0; i < strings.size(); i++ )
+        offset += (unsigned int) strings[i]->length();
+    unsigned int string_data_size = ( offset + 3 ) & ~3U;
+
+    head.append( "ASPT", 4 );
+    WriteUInt( head, TokenStream::Version );
+    WriteUInt( head, (unsigned int) file_names.size() );
+    WriteUInt( head, (unsigned int) strings.size() );
+    WriteUInt( head, token_count );
+    WriteUInt( head, string_data_size );
+    WriteUInt( head, 0 );
+    WriteUInt( head, 0 );
+
+    offset = 0;
+    for( size_t i = 0; i < strings.size(); i++ )
+    {
+        WriteUInt( head, offset );
+        offset += (unsigned int) strings[i]->length();
+    }
+    WriteUInt( head, offset );
+    for( size_t i = 0; i < file_names.size(); i++ )
+        WriteUInt( head, file_names[i] );
+
+    destination.Write( head.c_str(), head.length() );
+    destination.Write( tokens.c_str(), tokens.length() );
+    for( size_t i = 0; i < strings.size(); i++ )
+        destination.Write( strings[i]->c_str(), strings[i]->length() );
+    destination.Write( "\0\0\0", string_data_size - offset );
+    return true;
+}
+
+Preprocessor::TokenStream::TokenStream() :
+    Head(NULL),
+    StringOffsets(NULL),
+    FileNames(NULL),
+    Tokens(NULL),
+    StringData(NULL)
+{
+}
+
+bool Preprocessor::TokenStream::Open( const void* data, size_t size )
+{
+    Head = NULL;
+    if( size < sizeof( Header ) || ( (size_t) data & 3 ) )
+        return false;
+
+    const Header* head = (const Header*) data;
+    if( memcmp( head->Magic, "ASPT", 4 ) || head->Version != Version )
+        return false;
+
+    size_t need = sizeof( Header ) + ( (size_t) head->StringCount + 1 + head->FileCount ) * sizeof( unsigned int ) +
+                  (size_t) head->TokenCount * sizeof( Token ) + head->StringDataSize;
+    if( size < need )
+        return false;
+
+    const char* ptr = (const char*) data + sizeof( Header );
+    StringOffsets = (const unsigned int*) ptr;
+    ptr += ( head->StringCount + 1 ) * sizeof( unsigned int );
+    FileNames = (const unsigned int*) ptr;
+    ptr += head->FileCount * sizeof( unsigned int );
+    Tokens = (const Token*) ptr;
+    ptr += head->TokenCount * sizeof( Token );
+    StringData = ptr;
+
+    for( unsigned int i = 0; i < head->StringCount; i++ )
+        if( StringOffsets[i] > StringOffsets[i + 1] )
+            return false;
+    if( StringOffsets[head->StringCount] > head->StringDataSize )
+        return false;
+    for( unsigned int i = 0; i < head->FileCount; i++ )
+        if( FileNames[i] >= head->StringCount )
+            return false;
+    for( unsigned int i = 0; i < head->TokenCount; i++ )
+        if( Tokens[i].Value >= head->StringCount || ( Tokens[i].File >= head->FileCount && Tokens[i].File != Lexem::NoPosition ) )
+            return false;
+
+    Head = head;
+    return true;
+}
+
+const char* Preprocessor::TokenStream::GetString( unsigned int id, size_t& length ) const
+{
+    length = StringOffsets[id + 1] - StringOffsets[id];
+    return StringData + StringOffsets[id];
+}
+
+std::string Preprocessor::TokenStream::GetString( unsigned int id ) const
+{
+    size_t      length;
+    const char* str = GetString( id, length );
+    return std::string( str, length );
+}
+
+/************************************************************************/
+/* Output store                                                         */
+/************************************************************************/
+
+const unsigned int Preprocessor::OutputStore::Version;
+
+size_t Preprocessor::OutputStore::Add( const std::string& text, const LineNumberTranslator* lnt )
+{
+    // Ranges of line translator start at include directives and where included files end
+    std::vector<unsigned int> cuts;
+    if( lnt )
+    {
+        for( size_t i = 0; i < lnt->lines.size(); i++ )
+            cuts.push_back( lnt->lines[i].StartLine );
+        std::sort( cuts.begin(), cuts.end() );
+        cuts.erase( std::unique( cuts.begin(), cuts.end() ), cuts.end() );
+    }
+
+    Roots.push_back( Rope() );
+    Rope&        rope = Roots.back();
+    size_t       begin = 0, pos = 0;
+    unsigned int line = 0;
+    for( size_t c = 0; c < cuts.size(); c++ )
+    {
+        for( ; line < cuts[c] && pos < text.size(); line++ )
+        {
+            pos = text.find( '\n', pos );
+            pos = ( pos == std::string::npos ? text.size() : pos + 1 );
+        }
+        if( pos > begin )
+            rope.push_back( Intern( text.c_str() + begin, pos - begin ) );
+        begin = pos;
+    }
+    if( text.size() > begin )
+        rope.push_back( Intern( text.c_str() + begin, text.size() - begin ) );
+    return Roots.size() - 1;
+}
+
+unsigned int Preprocessor::OutputStore::Intern( const char* text, size_t length )
+{
+    std::string                segment( text, length );
+    std::vector<unsigned int>& ids = Index[std::hash<std::string>()( segment )];
+    for( size_t i = 0; i < ids.size(); i++ )
+        if( Segments[ids[i]] == segment )
+            return ids[i];
+
+    ids.push_back( (unsigned int) Segments.size() );
+    Segments.push_back( std::string() );
+    Segments.back().swap( segment );
+    return ids.back();
+}
+
+void Preprocessor::OutputStore::Write( size_t root, OutStream& out ) const
+{
+    const Rope& rope = Roots[root];
+    for( size_t i = 0; i < rope.size(); i++ )
+        out.Write( Segments[rope[i]].c_str(), Segments[rope[i]].size() );
+}
+
+size_t Preprocessor::OutputStore::GetSize( size_t root ) const
+{
+    size_t      size = 0;
+    const Rope& rope = Roots[root];
+    for( size_t i = 0; i < rope.size(); i++ )
+        size += Segments[rope[i]].size();
+    return size;
+}
+
+size_t Preprocessor::OutputStore::GetTotalSize() const
+{
+    size_t size = 0;
+    for( size_t i = 0; i < Roots.size(); i++ )
+        size += GetSize( i );
+    return size;
+}
+
+size_t Preprocessor::OutputStore::GetUniqueSize() const
+{
+    size_t size = 0;
+    for( size_t i = 0; i < Segments.size(); i++ )
+        size += Segments[i].size();
+    return size;
+}
+
+void Preprocessor::OutputStore::Clear()
+{
+    Segments.clear();
+    Roots.clear();
+    Index.clear();
+}
+
+bool Preprocessor::OutputStore::Save( const std::string& path ) const
+{
+    std::string  offsets, ropes, data;
+    unsigned int rope_size = 0;
+    for( size_t i = 0; i < Segments.size(); i++ )
+    {
+        WriteUInt( offsets, (unsigned int) data.size() );
+        data += Segments[i];
+    }
+    WriteUInt( offsets, (unsigned int) data.size() );
+    for( size_t i = 0; i < Roots.size(); i++ )
+    {
+        WriteUInt( offsets, rope_size );
+        rope_size += (unsigned int) Roots[i].size();
+        for( size_t j = 0; j < Roots[i].size(); j++ )
+            WriteUInt( ropes, Roots[i][j] );
+    }
+    WriteUInt( offsets, rope_size );
+
+    std::string out;
+    out.append( "ASPO", 4 );
+    WriteUInt( out, Version );
+    WriteUInt( out, (unsigned int) Segments.size() );
+    WriteUInt( out, (unsigned int) Roots.size() );
+    WriteUInt( out, rope_size );
+    WriteUInt( out, (unsigned int) data.size() );
+    out += offsets;
+    out += ropes;
+    out += data;
+    out.append( ( 4 - data.size() % 4 ) % 4, '\0' );
+
+    FILE* fs = fopen( path.c_str(), "wb" );
+    if( !fs )
+        return false;
+    bool ok = ( fwrite( out.data(), 1, out.size(), fs ) == out.size() );
+    return ( fclose( fs ) == 0 && ok );
+}
+
+bool Preprocessor::OutputStore::Load( const std::string& path )
+{
+    Clear();
+
+    std::vector<char> file;
+    FileLoader        loader;
+    if( !loader.LoadFile( "", path, file ) || file.size() < sizeof( Header ) )
+        return false;
+
+    Header head;
+    memcpy( &head, &file[0], sizeof( Header ) );
+    size_t fields = (size_t) head.SegmentCount + 1 + head.RootCount + 1 + head.RopeSize;
+    if( memcmp( head.Magic, "ASPO", 4 ) || head.Version != Version ||
+        file.size() < sizeof( Header ) + fields * sizeof( unsigned int ) + head.DataSize )
+        return false;
+
+    std::vector<unsigned int> values( fields );
+    memcpy( &values[0], &file[sizeof( Header )], fields * sizeof( unsigned int ) );
+    const unsigned int* segment_offsets = &values[0];
+    const unsigned int* rope_offsets = segment_offsets + head.SegmentCount + 1;
+    const unsigned int* rope_data = rope_offsets + head.RootCount + 1;
+    const char*         data = &file[0] + sizeof( Header ) + fields * sizeof( unsigned int );
+
+    for( unsigned int i = 0; i < head.SegmentCount; i++ )
+    {
+        if( segment_offsets[i] > segment_offsets[i + 1] || segment_offsets[i + 1] > head.DataSize )
+        {
+            Clear();
+            return false;
+        }
+        Intern( data + segment_offsets[i], segment_offsets[i + 1] - segment_offsets[i] );
+    }
+    // Saved segments are unique, so ids did not change
+    if( Segments.size() != head.SegmentCount )
+    {
+        Clear();
+        return false;
     }
 
-    DefineEntry def;
-    if( !def_lexems.empty() )
+    for( unsigned int i = 0; i < head.RootCount; i++ )
     {
-        if( def_lexems.begin()->Type == Lexem::PREPROCESSOR && def_lexems.begin()->Value == "#" )
+        if( rope_offsets[i] > rope_offsets[i + 1] || rope_offsets[i + 1] > head.RopeSize )
         {
-            // Macro has arguments
-            def_lexems.pop_front();
-            if( def_lexems.empty() )
-            {
-                PrintErrorMessage( "Expected arguments." );
-                return;
-            }
-            if( def_lexems.begin()->Value != "(" )
+            Clear();
+            return false;
+        }
+        Roots.push_back( Rope( rope_data + rope_offsets[i], rope_data + rope_offsets[i + 1] ) );
+        for( size_t j = 0; j < Roots.back().size(); j++ )
+        {
+            if( Roots.back()[j] >= head.SegmentCount )
             {
-                PrintErrorMessage( "Expected arguments." );
-                return;
+                Clear();
+                return false;
             }
-            def_lexems.pop_front();
+        }
+    }
+    return true;
+}
 
-            int num_args = 0;
-            while( !def_lexems.empty() && def_lexems.begin()->Value != ")" )
-            {
-                if( def_lexems.begin()->Type != Lexem::IDENTIFIER )
-                {
-                    PrintErrorMessage( "Expected identifier." );
-                    return;
-                }
-                def.Arguments[def_lexems.begin()->Value] = num_args;
-                def_lexems.pop_front();
-                if( !def_lexems.empty() && def_lexems.begin()->Value == "," )
-                {
-                    def_lexems.pop_front();
-                }
-                num_args++;
-            }
+/************************************************************************/
+/* File loader                                                          */
+/************************************************************************/
 
-            if( !def_lexems.empty() )
+bool Preprocessor::FileLoader::LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+{
+    FILE* fs = fopen( ( dir + file_name ).c_str(), "rb" );
+    if( !fs )
+        return false;
+
+    fseek( fs, 0, SEEK_END );
+    int len = (int) ftell( fs );
+    fseek( fs, 0, SEEK_SET );
+
+    data.resize( len );
+
+    if( !fread( &data[0], len, 1, fs ) )
+    {
+        fclose( fs );
+        return false;
+    }
+    fclose( fs );
+
+    return true;
+}
+
+bool Preprocessor::FileLoader::MapFile( const std::string& /*dir*/, const std::string& /*file_name*/, const char*& /*data*/, size_t& /*size*/ )
+{
+    return false;
+}
+
+/************************************************************************/
+/* Archive loader                                                       */
+/************************************************************************/
+
+static std::string ArchivePath( const std::string& path )
+{
+    size_t start = 0;
+    while( path.compare( start, 2, "./" ) == 0 )
+        start += 2;
+    return path.substr( start );
+}
+
+Preprocessor::ArchiveLoader::ArchiveLoader() :
+    Head( NULL ),
+    Seeds( NULL ),
+    Entries( NULL ),
+    Data( NULL ),
+    Mapping( NULL ),
+    MappingSize( 0 )
+{
+}
+
+Preprocessor::ArchiveLoader::~ArchiveLoader()
+{
+    Close();
+}
+
+bool Preprocessor::ArchiveLoader::Open( const std::string& path )
+{
+    Close();
+
+    const char* base = NULL;
+    size_t      size = 0;
+    #if !defined(_WIN32)
+    int         fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 )
+        return false;
+    struct stat st;
+    if( fstat( fd, &st ) == 0 && st.st_size > 0 )
+    {
+        void* mapping = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( mapping != MAP_FAILED )
+        {
+            Mapping = mapping;
+            MappingSize = (size_t) st.st_size;
+            base = (const char*) mapping;
+            size = MappingSize;
+        }
+    }
+    close( fd );
+    #else
+    size_t n = path.find_last_of( "\\/" );
+    if( FileLoader::LoadFile( n != std::string::npos ? path.substr( 0, n + 1 ) : "", n != std::string::npos ? path.substr( n + 1 ) : path, Buffer ) && !Buffer.empty() )
+    {
+        base = &Buffer[0];
+        size = Buffer.size();
+    }
+    #endif
+    if( !base )
+        return false;
+
+    const Header* head = (const Header*) base;
+    if( size < sizeof( Header ) || memcmp( head->Magic, "ASPA", 4 ) || head->Version != Version || !head->BucketCount )
+    {
+        Close();
+        return false;
+    }
+
+    size_t need = sizeof( Header ) + (size_t) head->BucketCount * sizeof( int ) + (size_t) head->FileCount * sizeof( Entry ) + head->DataSize;
+    if( size < need )
+    {
+        Close();
+        return false;
+    }
+
+    Seeds = (const int*) ( base + sizeof( Header ) );
+    Entries = (const Entry*) ( Seeds + head->BucketCount );
+    Data = (const char*) ( Entries + head->FileCount );
+    for( unsigned int i = 0; i < head->FileCount; i++ )
+    {
+        const Entry& e = Entries[i];
+        if( (size_t) e.PathOffset + e.PathSize > head->DataSize || (size_t) e.DataOffset + e.DataSize > head->DataSize )
+        {
+            Close();
+            return false;
+        }
+    }
+    for( unsigned int i = 0; i < head->BucketCount; i++ )
+    {
+        if( Seeds[i] < 0 && (unsigned int) ( -1 - Seeds[i] ) >= head->FileCount )
+        {
+            Close();
+            return false;
+        }
+    }
+
+    Head = head;
+    return true;
+}
+
+void Preprocessor::ArchiveLoader::Close()
+{
+    #if !defined(_WIN32)
+    if( Mapping )
+        munmap( Mapping, MappingSize );
+    #endif
+    Mapping = NULL;
+    MappingSize = 0;
+    std::vector<char>().swap( Buffer );
+    Head = NULL;
+    Seeds = NULL;
+    Entries = NULL;
+    Data = NULL;
+}
+
+unsigned int Preprocessor::ArchiveLoader::Hash( unsigned int seed, const char* str, size_t length )
+{
+    // FNV-1a with seeded basis and final mix
+    unsigned int h = 2166136261U ^ ( seed * 0x9E3779B9U );
+    for( size_t i = 0; i < length; i++ )
+    {
+        h ^= (unsigned char) str[i];
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    return h;
+}
+
+bool Preprocessor::ArchiveLoader::Find( const std::string& path, const char*& data, size_t& size ) const
+{
+    if( !Head || !Head->FileCount )
+        return false;
+
+    std::string  key = ArchivePath( path );
+    int          seed = Seeds[Hash( 0, key.c_str(), key.length() ) % Head->BucketCount];
+    unsigned int slot = ( seed < 0 ? (unsigned int) ( -1 - seed ) : Hash( (unsigned int) seed, key.c_str(), key.length() ) % Head->FileCount );
+    const Entry& e = Entries[slot];
+    if( e.PathSize != key.length() || memcmp( Data + e.PathOffset, key.c_str(), e.PathSize ) )
+        return false;
+
+    data = Data + e.DataOffset;
+    size = e.DataSize;
+    return true;
+}
+
+bool Preprocessor::ArchiveLoader::LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+{
+    if( !Overlay.empty() && FileLoader::LoadFile( Overlay + dir, file_name, data ) )
+        return true;
+
+    const char* ptr;
+    size_t      size;
+    if( !Find( dir + file_name, ptr, size ) )
+        return false;
+    data.assign( ptr, ptr + size );
+    return true;
+}
+
+bool Preprocessor::ArchiveLoader::MapFile( const std::string& dir, const std::string& file_name, const char*& data, size_t& size )
+{
+    // Loose file is read by LoadFile()
+    if( !Overlay.empty() )
+    {
+        FILE* fs = fopen( ( Overlay + dir + file_name ).c_str(), "rb" );
+        if( fs )
+        {
+            fclose( fs );
+            return false;
+        }
+    }
+    return Find( dir + file_name, data, size );
+}
+
+bool Preprocessor::ArchiveLoader::Build( const std::string& path, const std::map<std::string, std::string>& files )
+{
+    // Hash and displace: buckets with most entries pick seed first, single entry buckets take free slots
+    std::vector<std::string> paths;
+    for( std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it )
+        paths.push_back( ArchivePath( it->first ) );
+
+    if( std::set<std::string>( paths.begin(), paths.end() ).size() != paths.size() )
+        return false;
+
+    unsigned int                            count = (unsigned int) paths.size();
+    unsigned int                            bucket_count = std::max( 1U, count / 2 );
+    std::vector<std::vector<unsigned int> > buckets( bucket_count );
+    for( unsigned int i = 0; i < count; i++ )
+        buckets[Hash( 0, paths[i].c_str(), paths[i].length() ) % bucket_count].push_back( i );
+
+    std::vector<unsigned int> order( bucket_count );
+    for( unsigned int i = 0; i < bucket_count; i++ )
+        order[i] = i;
+    std::stable_sort( order.begin(), order.end(), [&]( unsigned int a, unsigned int b ) { return buckets[a].size() > buckets[b].size(); } );
+
+    std::vector<int>          seeds( bucket_count, 0 );
+    std::vector<unsigned int> slot_of( count );
+    std::vector<bool>         used( count, false );
+    std::vector<unsigned int> slots;
+    unsigned int              free_slot = 0;
+    for( unsigned int o = 0; o < bucket_count; o++ )
+    {
+        const std::vector<unsigned int>& bucket = buckets[order[o]];
+        if( bucket.empty() )
+            break;
+
+        if( bucket.size() == 1 )
+        {
+            while( used[free_slot] )
+                free_slot++;
+            used[free_slot] = true;
+            slot_of[bucket[0]] = free_slot;
+            seeds[order[o]] = -1 - (int) free_slot;
+            continue;
+        }
+
+        for( int seed = 1;; seed++ )
+        {
+            if( seed == 0x7FFFFFFF )
+                return false;
+
+            slots.clear();
+            for( size_t k = 0; k < bucket.size(); k++ )
             {
-                if( def_lexems.begin()->Value != ")" )
-                {
-                    PrintErrorMessage( "Expected closing parantheses." );
-                    return;
-                }
-                def_lexems.pop_front();
+                unsigned int slot = Hash( (unsigned int) seed, paths[bucket[k]].c_str(), paths[bucket[k]].length() ) % count;
+                if( used[slot] || std::find( slots.begin(), slots.end(), slot ) != slots.end() )
+                    break;
+                slots.push_back( slot );
             }
-            else
+            if( slots.size() != bucket.size() )
+                continue;
+
+            for( size_t k = 0; k < bucket.size(); k++ )
             {
-                PrintErrorMessage( "0x0FA3 Unexpected end of line." );
-                return;
+                used[slots[k]] = true;
+                slot_of[bucket[k]] = slots[k];
             }
+            seeds[order[o]] = seed;
+            break;
         }
+    }
+
+    std::vector<Entry> entries( count );
+    std::string        data;
+    unsigned int       i = 0;
+    for( std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it, i++ )
+    {
+        Entry& e = entries[slot_of[i]];
+        e.PathOffset = (unsigned int) data.size();
+        e.PathSize = (unsigned int) paths[i].size();
+        data += paths[i];
+        e.DataOffset = (unsigned int) data.size();
+        e.DataSize = (unsigned int) it->second.size();
+        data += it->second;
+    }
+
+    std::string out;
+    out.append( "ASPA", 4 );
+    WriteUInt( out, Version );
+    WriteUInt( out, count );
+    WriteUInt( out, bucket_count );
+    WriteUInt( out, (unsigned int) data.size() );
+    for( int r = 0; r < 3; r++ )
+        WriteUInt( out, 0 );
+    for( unsigned int b = 0; b < bucket_count; b++ )
+        WriteUInt( out, (unsigned int) seeds[b] );
+    for( unsigned int e = 0; e < count; e++ )
+    {
+        WriteUInt( out, entries[e].PathOffset );
+        WriteUInt( out, entries[e].PathSize );
+        WriteUInt( out, entries[e].DataOffset );
+        WriteUInt( out, entries[e].DataSize );
+    }
+    out += data;
+
+    FILE* fs = fopen( path.c_str(), "wb" );
+    if( !fs )
+        return false;
+    bool ok = ( fwrite( out.data(), 1, out.size(), fs ) == out.size() );
+    return ( fclose( fs ) == 0 && ok );
+}
+
+/************************************************************************/
+/* Asynchronous file loading                                            */
+/************************************************************************/
+
+Preprocessor::AsyncFileLoader* Preprocessor::AsyncFileLoader::Create( unsigned int queue_depth )
+{
+    UringFileLoader* uring = new UringFileLoader();
+    if( uring->Open( queue_depth ) )
+        return uring;
+    delete uring;
+    return new ThreadPoolFileLoader( std::max( 1U, queue_depth / 4 ) );
+}
+
+Preprocessor::ThreadPoolFileLoader::ThreadPoolFileLoader( unsigned int threads, FileLoader* loader ) :
+    Loader( loader ? loader : &Default ),
+    NextId( 0 ),
+    Pending( 0 ),
+    Quit( false )
+{
+    for( unsigned int i = 0; i < std::max( 1U, threads ); i++ )
+        Threads.push_back( std::thread( &ThreadPoolFileLoader::Run, this ) );
+}
+
+Preprocessor::ThreadPoolFileLoader::~ThreadPoolFileLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        Quit = true;
+    }
+    Wake.notify_all();
+    for( size_t i = 0; i < Threads.size(); i++ )
+        Threads[i].join();
+}
+
+unsigned int Preprocessor::ThreadPoolFileLoader::Submit( const std::string& dir, const std::string& file_name )
+{
+    unsigned int id;
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        id = NextId++;
+        Requests.push_back( Completion() );
+        Completion& request = Requests.back();
+        request.Id = id;
+        request.Dir = dir;
+        request.FileName = file_name;
+        request.Loaded = false;
+        Pending++;
+    }
+    Wake.notify_one();
+    return id;
+}
+
+bool Preprocessor::ThreadPoolFileLoader::Wait( Completion& completion )
+{
+    std::unique_lock<std::mutex> lock( Locker );
+    if( !Pending )
+        return false;
+    while( Results.empty() )
+        Finished.wait( lock );
+
+    completion = std::move( Results.front() );
+    Results.pop_front();
+    Pending--;
+    return true;
+}
+
+void Preprocessor::ThreadPoolFileLoader::Run()
+{
+    std::unique_lock<std::mutex> lock( Locker );
+    while( true )
+    {
+        while( !Quit && Requests.empty() )
+            Wake.wait( lock );
+        if( Quit )
+            break;
+
+        Completion request = std::move( Requests.front() );
+        Requests.pop_front();
+        lock.unlock();
+        request.Loaded = Loader->LoadFile( request.Dir, request.FileName, request.Data );
+        lock.lock();
+        Results.push_back( std::move( request ) );
+        Finished.notify_one();
+    }
+}
+
+#if HAVE_IO_URING
+
+static int UringSetup( unsigned int entries, struct io_uring_params* params )
+{
+    return (int) syscall( __NR_io_uring_setup, entries, params );
+}
+
+static int UringEnter( int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags )
+{
+    return (int) syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+#endif
+
+Preprocessor::UringFileLoader::UringFileLoader() :
+    RingFd( -1 ),
+    Entries( 0 ),
+    SqRing( NULL ),
+    SqRingSize( 0 ),
+    CqRing( NULL ),
+    CqRingSize( 0 ),
+    Sqes( NULL ),
+    SqesSize( 0 ),
+    SqTail( NULL ),
+    SqMask( NULL ),
+    SqArray( NULL ),
+    CqHead( NULL ),
+    CqTail( NULL ),
+    CqMask( NULL ),
+    Cqes( NULL ),
+    Unsubmitted( 0 ),
+    NextId( 0 )
+{
+}
+
+Preprocessor::UringFileLoader::~UringFileLoader()
+{
+    Close();
+}
+
+bool Preprocessor::UringFileLoader::Open( unsigned int entries )
+{
+    Close();
+    #if HAVE_IO_URING
+    struct io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    RingFd = UringSetup( std::max( 1U, entries ), &params );
+    if( RingFd < 0 )
+        return false;
+
+    SqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+    CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    SqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+    SqRing = mmap( NULL, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING );
+    CqRing = mmap( NULL, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING );
+    Sqes = mmap( NULL, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQES );
+    if( SqRing == MAP_FAILED || CqRing == MAP_FAILED || Sqes == MAP_FAILED )
+    {
+        Close();
+        return false;
+    }
+
+    char* sq = (char*) SqRing;
+    char* cq = (char*) CqRing;
+    SqTail = (unsigned int*) ( sq + params.sq_off.tail );
+    SqMask = (unsigned int*) ( sq + params.sq_off.ring_mask );
+    SqArray = (unsigned int*) ( sq + params.sq_off.array );
+    CqHead = (unsigned int*) ( cq + params.cq_off.head );
+    CqTail = (unsigned int*) ( cq + params.cq_off.tail );
+    CqMask = (unsigned int*) ( cq + params.cq_off.ring_mask );
+    Cqes = cq + params.cq_off.cqes;
+
+    // Completion ring is at least as large, so it can not overflow
+    Entries = params.sq_entries;
+    Operations.resize( Entries );
+    for( unsigned int i = Entries; i > 0; i-- )
+        FreeOperations.push_back( i - 1 );
+    return true;
+    #else
+    (void) entries;
+    return false;
+    #endif
+}
+
+void Preprocessor::UringFileLoader::Close()
+{
+    #if HAVE_IO_URING
+    // Reads in flight write to operation buffers, they must end before those are freed
+    Completion completion;
+    while( RingFd >= 0 && Operations.size() != FreeOperations.size() && Wait( completion ) )
+        ;
+    if( SqRing && SqRing != MAP_FAILED )
+        munmap( SqRing, SqRingSize );
+    if( CqRing && CqRing != MAP_FAILED )
+        munmap( CqRing, CqRingSize );
+    if( Sqes && Sqes != MAP_FAILED )
+        munmap( Sqes, SqesSize );
+    if( RingFd >= 0 )
+        close( RingFd );
+    #endif
+    RingFd = -1;
+    Entries = 0;
+    SqRing = CqRing = Sqes = NULL;
+    SqTail = SqMask = SqArray = CqHead = CqTail = CqMask = NULL;
+    Cqes = NULL;
+    Operations.clear();
+    FreeOperations.clear();
+    Backlog.clear();
+    Results.clear();
+    Unsubmitted = 0;
+}
+
+unsigned int Preprocessor::UringFileLoader::Submit( const std::string& dir, const std::string& file_name )
+{
+    Completion request;
+    request.Id = NextId++;
+    request.Dir = dir;
+    request.FileName = file_name;
+    request.Loaded = false;
+    if( RingFd < 0 )
+        Results.push_back( std::move( request ) );
+    else if( FreeOperations.empty() )
+        Backlog.push_back( std::move( request ) );
+    else
+        Start( request );
+    return NextId - 1;
+}
+
+void Preprocessor::UringFileLoader::Flush()
+{
+    #if HAVE_IO_URING
+    while( Unsubmitted )
+    {
+        int submitted = UringEnter( RingFd, Unsubmitted, 0, 0 );
+        if( submitted < 0 && errno != EINTR )
+            break;
+        Unsubmitted -= ( submitted > 0 ? (unsigned int) submitted : 0 );
+    }
+    #endif
+}
+
+bool Preprocessor::UringFileLoader::Wait( Completion& completion )
+{
+    #if HAVE_IO_URING
+    while( Results.empty() && Operations.size() != FreeOperations.size() )
+    {
+        int submitted = UringEnter( RingFd, Unsubmitted, 1, IORING_ENTER_GETEVENTS );
+        if( submitted < 0 && errno != EINTR )
+            break;
+        Unsubmitted -= ( submitted > 0 ? (unsigned int) submitted : 0 );
 
-        LLITR dlb = def_lexems.begin();
-        while( dlb != def_lexems.end() )
+        unsigned int head = *CqHead;
+        unsigned int tail = __atomic_load_n( CqTail, __ATOMIC_ACQUIRE );
+        for( ; head != tail; head++ )
         {
-            if( dlb->Value == "##" && dlb->Type == Lexem::IGNORED )
-                dlb->Value = "";
-            dlb = ExpandDefine( dlb, def_lexems.end(), def_lexems, define_table );
+            const struct io_uring_cqe& cqe = ( (const struct io_uring_cqe*) Cqes )[head & *CqMask];
+            unsigned int               op = (unsigned int) cqe.user_data;
+            int                        res = cqe.res;
+            // Slot is released before handling, which may push new submissions
+            __atomic_store_n( CqHead, head + 1, __ATOMIC_RELEASE );
+            Reap( op, res );
         }
     }
+    #endif
+    if( Results.empty() )
+        return false;
+    completion = std::move( Results.front() );
+    Results.pop_front();
+    return true;
+}
 
-    def.Lexems = def_lexems;
-    define_table[name.Value] = def;
+void Preprocessor::UringFileLoader::Start( Completion& request )
+{
+    unsigned int op = FreeOperations.back();
+    FreeOperations.pop_back();
+
+    Operation& o = Operations[op];
+    o.Request = std::move( request );
+    o.Path = o.Request.Dir + o.Request.FileName;
+    o.Fd = -1;
+    o.Done = 0;
+    Push( op );
 }
 
-Preprocessor::LLITR Preprocessor::ParseIfDef( LLITR itr, LLITR end )
+void Preprocessor::UringFileLoader::Push( unsigned int op )
 {
-    int  depth = 0;
-    int  newlines = 0;
-    bool found_end = false;
-    while( itr != end )
+    #if HAVE_IO_URING
+    Operation&             o = Operations[op];
+    unsigned int           tail = *SqTail;
+    unsigned int           index = tail & *SqMask;
+    struct io_uring_sqe&   sqe = ( (struct io_uring_sqe*) Sqes )[index];
+    memset( &sqe, 0, sizeof( sqe ) );
+    if( o.Fd < 0 )
     {
-        if( itr->Type == Lexem::NEWLINE )
-            newlines++;
-        else if( itr->Type == Lexem::PREPROCESSOR )
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = (unsigned long long) (uintptr_t) o.Path.c_str();
+        sqe.open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    else
+    {
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = o.Fd;
+        sqe.addr = (unsigned long long) (uintptr_t) ( &o.Request.Data[0] + o.Done );
+        sqe.len = (unsigned int) std::min( o.Request.Data.size() - o.Done, (size_t) 0x40000000 );
+        sqe.off = o.Done;
+    }
+    sqe.user_data = op;
+    SqArray[index] = index;
+    __atomic_store_n( SqTail, tail + 1, __ATOMIC_RELEASE );
+    Unsubmitted++;
+    #else
+    Finish( op, false );
+    #endif
+}
+
+void Preprocessor::UringFileLoader::Reap( unsigned int op, int res )
+{
+    #if HAVE_IO_URING
+    Operation& o = Operations[op];
+    if( o.Fd < 0 )
+    {
+        // Kernels before 5.6 reject opening and reading through ring, those are done here
+        if( res == -EINVAL )
+            res = open( o.Path.c_str(), O_RDONLY | O_CLOEXEC );
+        if( res < 0 )
         {
-            if( itr->Value == "#endif" && depth == 0 )
-            {
-                ++itr;
-                found_end = true;
-                break;
-            }
-            if( itr->Value == "#ifdef" || itr->Value == "#ifndef" || itr->Value == "#if" )
-                depth++;
-            if( itr->Value == "#endif" && depth > 0 )
-                depth--;
+            Finish( op, false );
+            return;
         }
-        ++itr;
+
+        o.Fd = res;
+        struct stat st;
+        if( fstat( o.Fd, &st ) != 0 )
+        {
+            Finish( op, false );
+            return;
+        }
+        o.Request.Data.resize( (size_t) st.st_size );
+        if( o.Request.Data.empty() )
+            Finish( op, true );
+        else
+            Push( op );
+        return;
     }
-    if( itr == end && !found_end )
+
+    if( res == -EINVAL )
+        res = (int) pread( o.Fd, &o.Request.Data[0] + o.Done, o.Request.Data.size() - o.Done, (off_t) o.Done );
+    if( res == -EINTR || res == -EAGAIN )
     {
-        PrintErrorMessage( "0x0FA4 Unexpected end of file." );
-        return itr;
+        Push( op );
+        return;
     }
-    while( newlines > 0 )
+    if( res < 0 )
     {
-        --itr;
-        itr->Type = Lexem::NEWLINE;
-        itr->Value = "\n";
-        --newlines;
+        Finish( op, false );
+        return;
     }
-    return itr;
+
+    o.Done += (size_t) res;
+    if( res == 0 )
+    {
+        // File got shorter since fstat()
+        o.Request.Data.resize( o.Done );
+        Finish( op, true );
+    }
+    else if( o.Done < o.Request.Data.size() )
+        Push( op );
+    else
+        Finish( op, true );
+    #else
+    (void) res;
+    Finish( op, false );
+    #endif
 }
 
-void Preprocessor::ParseIf( LexemList& directive, std::string& name_out )
+void Preprocessor::UringFileLoader::Finish( unsigned int op, bool loaded )
 {
-    directive.pop_front();
-    if( directive.empty() )
+    Operation& o = Operations[op];
+    #if HAVE_IO_URING
+    if( o.Fd >= 0 )
+        close( o.Fd );
+    #endif
+    o.Fd = -1;
+    o.Request.Loaded = loaded;
+    if( !loaded )
+        o.Request.Data.clear();
+    Results.push_back( std::move( o.Request ) );
+    FreeOperations.push_back( op );
+
+    if( !Backlog.empty() )
     {
-        PrintErrorMessage( "Expected argument." );
-        return;
+        Completion request = std::move( Backlog.front() );
+        Backlog.pop_front();
+        Start( request );
     }
-    name_out = directive.begin()->Value;
-    directive.pop_front();
-    if( !directive.empty() )
-        PrintErrorMessage( "Too many arguments." );
 }
 
-void Preprocessor::ParseUndef( LexemList& directive, DefineTable& define_table )
+Preprocessor::PrefetchLoader::PrefetchLoader( AsyncFileLoader* async, unsigned int max_in_flight ) :
+    Async( async ),
+    MaxInFlight( std::max( 1U, max_in_flight ) )
 {
-    directive.pop_front();
-
-    if( directive.empty() )
-        PrintErrorMessage( "Undef directive without arguments." );
-    else if( directive.size() > 1 )
-        PrintErrorMessage( "Undef directive with multiple arguments." );
+}
 
-    auto it = define_table.find( directive.begin()->Value );
-    if( it != define_table.end() )
-        define_table.erase( it );
+Preprocessor::PrefetchLoader::~PrefetchLoader()
+{
+    Clear();
 }
 
-bool Preprocessor::ConvertExpression( LexemList& expression, LexemList& output )
+bool Preprocessor::PrefetchLoader::LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
 {
-    if( expression.empty() )
+    std::string key = dir + file_name;
+    std::unordered_map<std::string, AsyncFileLoader::Completion>::iterator it = Ready.find( key );
+    if( it == Ready.end() )
     {
-        PrintMessage( "Empty expression." );
-        return true;
+        if( !InFlight.count( key ) )
+        {
+            InFlight[key] = Async->Submit( dir, file_name );
+            Async->Flush();
+        }
+        while( ( it = Ready.find( key ) ) == Ready.end() )
+            WaitOne();
     }
 
-    // Convert to RPN
-    std::vector<Lexem> stack;
-    for( LLITR it = expression.begin(); it != expression.end(); ++it )
+    bool loaded = it->second.Loaded;
+    data.swap( it->second.Data );
+    Ready.erase( it );
+    if( !loaded )
+        return false;
+
+    // Names of #include "file" lines, resolved as RecursivePreprocess() does
+    const char* ptr = data.empty() ? NULL : &data[0];
+    const char* end = ptr + data.size();
+    bool        prefetched = false;
+    while( ptr < end )
     {
-        PreprocessLexem( it, expression );
-        Lexem& lexem = *it;
-        if( IsIdentifier( lexem ) )
-        {
-            output.push_back( lexem );
-        }
-        else if( IsOperator( lexem ) )
+        while( ptr < end && ( *ptr == ' ' || *ptr == '\t' ) )
+            ptr++;
+        if( ptr < end && *ptr == '#' )
         {
-            while( stack.size() )
+            ptr++;
+            while( ptr < end && ( *ptr == ' ' || *ptr == '\t' ) )
+                ptr++;
+            if( end - ptr > 7 && !memcmp( ptr, "include", 7 ) )
             {
-                Lexem& lex = stack.back();
-                if( IsOperator( lex ) &&
-                    ( (OperLeftAssoc( lexem ) && ( OperPrecedence( lexem ) <= OperPrecedence( lex ))) ||
-                      (OperPrecedence( lexem ) < OperPrecedence( lex )) ) )
+                ptr += 7;
+                while( ptr < end && ( *ptr == ' ' || *ptr == '\t' ) )
+                    ptr++;
+                const char* name = ( ptr < end && *ptr == '"' ? ++ptr : NULL );
+                while( ptr < end && *ptr != '"' && *ptr != '\n' )
+                    ptr++;
+                if( name && ptr < end && *ptr == '"' && ptr > name )
                 {
-                    output.push_back( lex );
-                    stack.pop_back();
+                    Prefetch( dir, AddPaths( file_name, std::string( name, ptr ) ) );
+                    prefetched = true;
                 }
-                else
-                    break;
             }
-            stack.push_back( lexem );
-        }
-        else if( IsLeft( lexem ) )
-        {
-            stack.push_back( lexem );
         }
-        else if( IsRight( lexem ) )
-        {
-            bool foundLeft = false;
-            while( stack.size() )
-            {
-                Lexem& lex = stack.back();
-                if( IsLeft( lex ) )
-                {
-                    foundLeft = true;
-                    break;
-                }
-                else
-                {
-                    output.push_back( lex );
-                    stack.pop_back();
-                }
-            }
+        while( ptr < end && *ptr != '\n' )
+            ptr++;
+        ptr++;
+    }
+    if( prefetched )
+        Async->Flush();
+    return true;
+}
 
-            if( !foundLeft )
-            {
-                PrintErrorMessage( "Mismatched parentheses." );
-                return false;
-            }
+void Preprocessor::PrefetchLoader::Prefetch( const std::string& dir, const std::string& file_name )
+{
+    std::string key = dir + file_name;
+    if( InFlight.count( key ) || Ready.count( key ) )
+        return;
+    if( InFlight.size() >= MaxInFlight )
+    {
+        Queued.push_back( std::make_pair( dir, file_name ) );
+        return;
+    }
+    InFlight[key] = Async->Submit( dir, file_name );
+}
 
-            stack.pop_back();
-        }
-        else
-        {
-            PrintErrorMessage( "Unknown token: " + lexem.Value );
-            return false;
-        }
+void Preprocessor::PrefetchLoader::Clear()
+{
+    Queued.clear();
+    while( !InFlight.empty() )
+        WaitOne();
+    Ready.clear();
+}
+
+void Preprocessor::PrefetchLoader::WaitOne()
+{
+    AsyncFileLoader::Completion completion;
+    if( !Async->Wait( completion ) )
+    {
+        // Lost requests are reported as not loaded
+        for( std::unordered_map<std::string, unsigned int>::iterator it = InFlight.begin(); it != InFlight.end(); ++it )
+            Ready[it->first].Loaded = false;
+        InFlight.clear();
+        return;
     }
 
-    // input end, flush the stack
-    while( stack.size() )
+    std::string key = completion.Dir + completion.FileName;
+    InFlight.erase( key );
+    Ready[key] = std::move( completion );
+
+    bool submitted = false;
+    while( !Queued.empty() && InFlight.size() < MaxInFlight )
     {
-        Lexem& lex = stack.back();
-        if( IsLeft( lex ) || IsRight( lex ) )
-        {
-            PrintErrorMessage( "Mismatched parentheses." );
-            return false;
-        }
-        output.push_back( lex );
-        stack.pop_back();
+        std::pair<std::string, std::string> next = Queued.front();
+        Queued.pop_front();
+        Prefetch( next.first, next.second );
+        submitted = true;
     }
-    return true;
+    if( submitted )
+        Async->Flush();
 }
 
-int Preprocessor::EvaluateConvertedExpression( DefineTable& define_table, LexemList& expr )
+/************************************************************************/
+/* File watching                                                        */
+/************************************************************************/
+
+Preprocessor::StatCache::StatCache() :
+    StatCalls( 0 )
 {
-    std::vector<int> stack;
+}
 
-    while( expr.size() )
+bool Preprocessor::StatCache::Get( const std::string& path, Entry& entry )
+{
     {
-        Lexem lexem = expr.front();
-        expr.pop_front();
-
-        if( IsIdentifier( lexem ) )
+        std::lock_guard<std::mutex> lock( Locker );
+        std::unordered_map<std::string, Entry>::iterator it = Entries.find( path );
+        if( it != Entries.end() )
         {
-            if( lexem.Type == Lexem::NUMBER )
-                stack.push_back( atoi( lexem.Value.c_str() ) );
-            else
-            {
-                LexemList ll;
-                ll.push_back( lexem );
-                ExpandDefine( ll.begin(), ll.end(), ll, define_table );
-                LexemList out;
-                bool      success = ConvertExpression( ll, out );
-                if( !success )
-                {
-                    PrintErrorMessage( "Error while expanding macros." );
-                    return 0;
-                }
-                stack.push_back( EvaluateConvertedExpression( define_table, out ) );
-            }
+            entry = it->second;
+            return entry.Exists;
         }
-        else if( IsOperator( lexem ) )
-        {
-            if( lexem.Value == "!" )
-            {
-                if( !stack.size() )
-                {
-                    PrintErrorMessage( "Syntax error in #if: no argument for ! operator." );
-                    return 0;
-                }
-                stack.back() = stack.back() != 0 ? 0 : 1;
-            }
-            else
-            {
-                if( stack.size() < 2 )
-                {
-                    PrintErrorMessage( "Syntax error in #if: not enough arguments for " + lexem.Value + " operator." );
-                    return 0;
-                }
-                int rhs = stack.back();
-                stack.pop_back();
-                int lhs = stack.back();
-                stack.pop_back();
+        StatCalls++;
+    }
 
-                std::string op = lexem.Value;
-                if( op == "*" )
-                    stack.push_back( lhs *  rhs );
-                if( op == "/" )
-                    stack.push_back( lhs /  rhs );
-                if( op == "%" )
-                    stack.push_back( lhs %  rhs );
-                if( op == "+" )
-                    stack.push_back( lhs +  rhs );
-                if( op == "-" )
-                    stack.push_back( lhs -  rhs );
-                if( op == "<" )
-                    stack.push_back( lhs <  rhs );
-                if( op == "<=" )
-                    stack.push_back( lhs <= rhs );
-                if( op == ">" )
-                    stack.push_back( lhs >  rhs );
-                if( op == ">=" )
-                    stack.push_back( lhs >= rhs );
-                if( op == "==" )
-                    stack.push_back( lhs == rhs );
-                if( op == "!=" )
-                    stack.push_back( lhs != rhs );
-                if( op == "&&" )
-                    stack.push_back( ( lhs != 0 && rhs != 0 ) ? 1 : 0 );
-                if( op == "||" )
-                    stack.push_back( ( lhs != 0 || rhs != 0 ) ? 1 : 0 );
-            }
-        }
-        else
-        {
-            PrintErrorMessage( "Internal error on lexem " + lexem.Value + "." );
-            return 0;
-        }
+    Stat( path, entry );
+
+    std::lock_guard<std::mutex> lock( Locker );
+    Entries[path] = entry;
+    return entry.Exists;
+}
+
+bool Preprocessor::StatCache::Stat( const std::string& path, Entry& entry )
+{
+    memset( &entry, 0, sizeof( entry ) );
+    #if !defined(_WIN32)
+    struct stat st;
+    if( stat( path.c_str(), &st ) == 0 )
+    {
+        entry.Exists = true;
+        entry.Size = (unsigned long long) st.st_size;
+        entry.Inode = (unsigned long long) st.st_ino;
+        #if defined(__APPLE__)
+        entry.Modified = (long long) st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+        #else
+        entry.Modified = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        #endif
     }
-    if( stack.size() == 1 )
-        return stack.back();
-    PrintErrorMessage( "Invalid #if expression." );
-    return 0;
+    #else
+    struct _stat64 st;
+    if( _stat64( path.c_str(), &st ) == 0 )
+    {
+        entry.Exists = true;
+        entry.Size = (unsigned long long) st.st_size;
+        entry.Modified = (long long) st.st_mtime * 1000000000LL;
+    }
+    #endif
+
+    return entry.Exists;
+}
+
+void Preprocessor::StatCache::Invalidate( const std::string& path )
+{
+    std::lock_guard<std::mutex> lock( Locker );
+    Entries.erase( path );
+}
+
+void Preprocessor::StatCache::Clear()
+{
+    std::lock_guard<std::mutex> lock( Locker );
+    Entries.clear();
 }
 
-bool Preprocessor::EvaluateExpression( DefineTable& define_table, LexemList& directive )
+unsigned int Preprocessor::StatCache::GetStatCalls()
 {
-    LexemList output;
-    directive.pop_front();
-    bool      success = ConvertExpression( directive, output );
-    if( !success )
-        return false;
-    return EvaluateConvertedExpression( define_table, output ) != 0;
+    std::lock_guard<std::mutex> lock( Locker );
+    return StatCalls;
 }
 
-std::string Preprocessor::AddPaths( const std::string& first, const std::string& second )
+Preprocessor::FileWatcher::FileWatcher( StatCache* stats, Listener* changes ) :
+    Stats( stats ),
+    Changes( changes ),
+    Fd( -1 ),
+    Generation( 0 )
 {
-    std::string result;
-    size_t      slash_pos = first.find_last_of( '/' );
-    if( slash_pos == 0 || slash_pos >= first.size() )
-        return second;
-    result = first.substr( 0, slash_pos + 1 );
-    result += second;
-    return result;
+    WakeFds[0] = WakeFds[1] = -1;
 }
 
-void Preprocessor::ParsePragma( LexemList& args )
+Preprocessor::FileWatcher::~FileWatcher()
 {
-    args.pop_front();
-    if( args.empty() )
+    Close();
+}
+
+bool Preprocessor::FileWatcher::Open()
+{
+    Close();
+    #if HAVE_INOTIFY
+    Fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if( Fd < 0 )
+        return false;
+    if( pipe2( WakeFds, O_CLOEXEC ) != 0 )
     {
-        PrintErrorMessage( "Pragmas need arguments." );
-        return;
+        Close();
+        return false;
     }
-    std::string p_name = args.begin()->Value;
-    args.pop_front();
-    std::string p_args;
-    if( !args.empty() )
+    Thread = std::thread( &FileWatcher::Run, this );
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+void Preprocessor::FileWatcher::Close()
+{
+    #if HAVE_INOTIFY
+    if( Thread.joinable() )
     {
-        if( args.begin()->Type != Lexem::STRING )
-            PrintErrorMessage( "Pragma parameter should be a string literal." );
-        p_args = RemoveQuotes( args.begin()->Value );
-        args.pop_front();
+        char quit = 0;
+        while( write( WakeFds[1], &quit, 1 ) < 0 && errno == EINTR )
+            ;
+        Thread.join();
     }
-    if( !args.empty() )
-        PrintErrorMessage( "Too many parameters to pragma." );
-
-    Pragmas.push_back( p_name );
-    Pragmas.push_back( p_args );
-
-    Pragma::Instance pi;
-    pi.Text = p_args;
-    pi.CurrentFile = CurrentFile;
-    pi.CurrentFileLine = LinesThisFile;
-    pi.RootFile = RootFile;
-    pi.GlobalLine = CurrentLine;
-    if( CurPragmaCallback )
-        CurPragmaCallback->CallPragma( p_name, pi );
+    for( int i = 0; i < 2; i++ )
+        if( WakeFds[i] >= 0 )
+            close( WakeFds[i] );
+    if( Fd >= 0 )
+        close( Fd );
+    #endif
+    Fd = -1;
+    WakeFds[0] = WakeFds[1] = -1;
+
+    std::lock_guard<std::mutex> lock( Locker );
+    Dirs.clear();
+    WatchedDirs.clear();
+    Files.clear();
+    Dirty.clear();
 }
 
-void Preprocessor::ParseTextLine( LexemList& directive, std::string& message )
+bool Preprocessor::FileWatcher::Watch( const std::vector<std::string>& paths )
 {
-    message = "";
-    directive.pop_front();
-    if( directive.empty() )
-        return;
+    if( Fd < 0 )
+        return false;
 
-    bool first = true;
-    while( !directive.empty() )
+    bool                        ok = true;
+    std::lock_guard<std::mutex> lock( Locker );
+    for( size_t i = 0; i < paths.size(); i++ )
     {
-        if( !first )
-            message += " ";
-        else
-            first = false;
-        message += directive.begin()->Value;
-        directive.pop_front();
+        Files.insert( paths[i] );
+        size_t      slash = paths[i].find_last_of( '/' );
+        std::string dir = ( slash == std::string::npos ? std::string() : paths[i].substr( 0, slash + 1 ) );
+        if( WatchedDirs.count( dir ) )
+            continue;
+
+        #if HAVE_INOTIFY
+        int wd = inotify_add_watch( Fd, dir.empty() ? "." : dir.c_str(),
+                                    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                    IN_DELETE_SELF | IN_MOVE_SELF );
+        if( wd < 0 )
+        {
+            ok = false;
+            continue;
+        }
+        // Same directory reached by other path has same descriptor
+        Dirs[wd].push_back( dir );
+        WatchedDirs.insert( dir );
+        #endif
     }
+    return ok;
 }
 
-void Preprocessor::SetLineMacro( DefineTable& define_table, unsigned int line )
+bool Preprocessor::FileWatcher::IsDirty( const std::string& path )
 {
-    DefineEntry       def;
-    Lexem             l;
-    l.Type = Lexem::NUMBER;
-    std::stringstream sstr;
-    sstr << line;
-    sstr >> l.Value;
-    def.Lexems.push_back( l );
-    define_table["__LINE__"] = def;
+    std::lock_guard<std::mutex> lock( Locker );
+    return Dirty.count( path ) != 0;
 }
 
-void Preprocessor::SetFileMacro( DefineTable& define_table, const std::string& file )
+bool Preprocessor::FileWatcher::AnyDirty( const std::vector<std::string>& paths )
 {
-    DefineEntry def;
-    Lexem       l;
-    l.Type = Lexem::STRING;
-    l.Value = std::string( "\"" ) + file + "\"";
-    def.Lexems.push_back( l );
-    define_table["__FILE__"] = def;
+    std::lock_guard<std::mutex> lock( Locker );
+    if( Dirty.empty() )
+        return false;
+    for( size_t i = 0; i < paths.size(); i++ )
+        if( Dirty.count( paths[i] ) )
+            return true;
+    return false;
 }
 
-void Preprocessor::RecursivePreprocess( std::string filename, FileLoader& file_source, LexemList& lexems, DefineTable& define_table )
+void Preprocessor::FileWatcher::TakeDirty( std::vector<std::string>& paths )
 {
-    unsigned int start_line = CurrentLine;
-    LinesThisFile = 0;
-    CurrentFile = filename;
-    SetFileMacro( define_table, CurrentFile );
-    SetLineMacro( define_table, LinesThisFile );
-
-    // Path formatting must be done in main application
-    std::string CurrentFileRoot = RootPath + CurrentFile;
-    if( std::find( FilesPreprocessed.begin(), FilesPreprocessed.end(), CurrentFileRoot ) == FilesPreprocessed.end() )
-        FilesPreprocessed.push_back( CurrentFileRoot );
-
-    std::vector<char> data;
-    bool              loaded = file_source.LoadFile( RootPath, filename, data );
-    if( !loaded )
-    {
-        PrintErrorMessage( std::string( "Could not open file " ) + RootPath + filename );
-        return;
-    }
+    std::lock_guard<std::mutex> lock( Locker );
+    paths.assign( Dirty.begin(), Dirty.end() );
+    Dirty.clear();
+}
 
-    if( data.size() == 0 )
-        return;
-    char* d_end = &data[data.size() - 1];
-    ++d_end;
-    Lex( &data[0], d_end, lexems );
+unsigned int Preprocessor::FileWatcher::GetGeneration()
+{
+    return Generation.load();
+}
 
-    LexemList::iterator itr = lexems.begin();
-    LexemList::iterator end = lexems.end();
-    LLITR               old = end;
-    while( itr != end )
+void Preprocessor::FileWatcher::Run()
+{
+    #if HAVE_INOTIFY
+    alignas( struct inotify_event ) char buffer[16 * 1024];
+    std::vector<std::string>             changed;
+    while( true )
     {
-        if( itr->Type == Lexem::NEWLINE )
+        struct pollfd fds[2];
+        fds[0].fd = Fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = WakeFds[0];
+        fds[1].events = POLLIN;
+        if( poll( fds, 2, -1 ) < 0 )
         {
-            if( itr != old )
-            {
-                CurrentLine++;
-                LinesThisFile++;
-                SetLineMacro( define_table, LinesThisFile );
-            }
-            old = itr;
-            ++itr;
+            if( errno == EINTR )
+                continue;
+            break;
         }
-        else if( itr->Type == Lexem::PREPROCESSOR )
-        {
-            LLITR     start_of_line = itr;
-            LLITR     end_of_line = ParsePreprocessor( lexems, itr, end );
-
-            LexemList directive( start_of_line, end_of_line );
+        if( fds[1].revents )
+            break;
 
-            if( SkipPragmas && directive.begin()->Value == "#pragma" )
+        ssize_t length;
+        while( ( length = read( Fd, buffer, sizeof( buffer ) ) ) > 0 )
+        {
+            std::lock_guard<std::mutex> lock( Locker );
+            for( char* ptr = buffer; ptr < buffer + length;)
             {
-                itr = end_of_line;
-                Lexem wspace;
-                wspace.Type = Lexem::WHITESPACE;
-                wspace.Value = " ";
-                for( LLITR it = start_of_line; it != end_of_line;)
+                const struct inotify_event* ev = (const struct inotify_event*) ptr;
+                ptr += sizeof( struct inotify_event ) + ev->len;
+
+                if( ev->mask & IN_Q_OVERFLOW )
                 {
-                    ++it;
-                    it = lexems.insert( it, wspace );
-                    ++it;
+                    // Events were lost, anything may have changed
+                    changed.insert( changed.end(), Files.begin(), Files.end() );
+                    continue;
                 }
-                continue;
-            }
 
-            itr = lexems.erase( start_of_line, end_of_line );
+                std::unordered_map<int, std::vector<std::string> >::iterator dir = Dirs.find( ev->wd );
+                if( dir == Dirs.end() )
+                    continue;
 
-            std::string value = directive.begin()->Value;
-            if( value == "#define" )
-            {
-                ParseDefine( define_table, directive );
-            }
-            else if( value == "#ifdef" )
-            {
-                std::string           def_name;
-                ParseIf( directive, def_name );
-                DefineTable::iterator dti = define_table.find( def_name );
-                if( dti == define_table.end() )
-                {
-                    LLITR splice_to = ParseIfDef( itr, end );
-                    itr = lexems.erase( itr, splice_to );
-                }
-            }
-            else if( value == "#ifndef" )
-            {
-                std::string           def_name;
-                ParseIf( directive, def_name );
-                DefineTable::iterator dti = define_table.find( def_name );
-                if( dti != define_table.end() )
-                {
-                    LLITR splice_to = ParseIfDef( itr, end );
-                    itr = lexems.erase( itr, splice_to );
-                }
-            }
-            else if( value == "#if" )
-            {
-                bool satisfied = EvaluateExpression( define_table, directive ) != 0;
-                if( !satisfied )
+                for( size_t d = 0; d < dir->second.size(); d++ )
                 {
-                    LLITR splice_to = ParseIfDef( itr, end );
-                    itr = lexems.erase( itr, splice_to );
+                    const std::string& prefix = dir->second[d];
+                    if( ev->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) )
+                    {
+                        // Directory is gone, its files are dirty and Watch() may add it again
+                        for( std::unordered_set<std::string>::iterator it = Files.begin(); it != Files.end(); ++it )
+                            if( it->compare( 0, prefix.size(), prefix ) == 0 && it->find( '/', prefix.size() ) == std::string::npos )
+                                changed.push_back( *it );
+                        if( ev->mask & IN_IGNORED )
+                            WatchedDirs.erase( prefix );
+                    }
+                    else if( ev->len )
+                        changed.push_back( prefix + ev->name );
                 }
+                if( ev->mask & IN_IGNORED )
+                    Dirs.erase( dir );
             }
-            else if( value == "#endif" )
-            {
-                // ignore
-            }
-            else if (value == "#undef")
-            {
-                ParseUndef( directive, define_table );
-            }
-            else if( value == "#include" )
-            {
-                if( LNT )
-                    LNT->AddLineRange( PrependRootPath( filename ), start_line, CurrentLine - LinesThisFile );
-                unsigned int save_lines_this_file = LinesThisFile;
-                std::string  file_name;
-                ParseIf( directive, file_name );
-
-                std::string file_name_ = RemoveQuotes( file_name );
-                if( IncludeTranslator )
-                    IncludeTranslator->Call( file_name_ );
-                if( std::find( FileDependencies.begin(), FileDependencies.end(), file_name_ ) == FileDependencies.end() )
-                    FileDependencies.push_back( file_name_ );
-
-                LexemList next_file;
-                RecursivePreprocess( AddPaths( filename, file_name_ ), file_source, next_file, define_table );
-                lexems.splice( itr, next_file );
-                start_line = CurrentLine;
-                LinesThisFile = save_lines_this_file;
-                CurrentFile = filename;
-                SetFileMacro( define_table, CurrentFile );
-                SetLineMacro( define_table, LinesThisFile );
-            }
-            else if( value == "#pragma" )
-            {
-                ParsePragma( directive );
-            }
-            else if( value == "#message" )
-            {
-                std::string message;
-                ParseTextLine( directive, message );
-                PrintMessage( message );
-            }
-            else if( value == "#warning" )
-            {
-                std::string warning;
-                ParseTextLine( directive, warning );
-                PrintWarningMessage( warning );
-            }
-            else if( value == "#error" )
-            {
-                std::string error;
-                ParseTextLine( directive, error );
-                PrintErrorMessage( error );
-            }
-            else
-            {
-                PrintErrorMessage( "Unknown directive '" + value + "'." );
-            }
-        }
-        else if( itr->Type == Lexem::IDENTIFIER )
-        {
-            itr = ExpandDefine( itr, end, lexems, define_table );
-        }
-        else
-        {
-            ++itr;
         }
-    }
 
-    if( LNT )
-        LNT->AddLineRange( PrependRootPath( filename ), start_line, CurrentLine - LinesThisFile );
+        if( !changed.empty() )
+            MarkDirty( changed );
+    }
+    #endif
 }
 
-int Preprocessor::Preprocess( std::string file_path, OutStream& result, OutStream* errors, FileLoader* loader, bool skip_pragmas )
+void Preprocessor::FileWatcher::MarkDirty( std::vector<std::string>& paths )
 {
-    static OutStream  null_stream;
-    static FileLoader default_loader;
-
-    if( LNT )
-        delete LNT;
-    LNT = new LineNumberTranslator();
-
-    CurrentFile = "ERROR";
-    CurrentLine = 0;
-
-    Errors = ( errors ? errors : &null_stream );
-    ErrorsCount = 0;
-
-    FileDependencies.clear();
-    FilesPreprocessed.clear();
-
-    Pragmas.clear();
-    SkipPragmas = skip_pragmas;
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        Dirty.insert( paths.begin(), paths.end() );
+        Generation++;
+    }
+    if( Stats )
+        for( size_t i = 0; i < paths.size(); i++ )
+            Stats->Invalidate( paths[i] );
+    if( Changes )
+        Changes->FilesChanged( paths );
+    paths.clear();
+}
 
-    size_t n = file_path.find_last_of( "\\/" );
-    RootFile = ( n != std::string::npos ? file_path.substr( n + 1 ) : file_path );
-    RootPath = ( n != std::string::npos ? file_path.substr( 0, n + 1 ) : "./" );
+/************************************************************************/
+/* Shared file cache                                                    */
+/************************************************************************/
 
-    DefineTable define_table = CustomDefines;
-    LexemList   lexems;
+const unsigned int Preprocessor::SharedFileCache::Version;
 
-    RecursivePreprocess( RootFile, loader ? *loader : default_loader, lexems, define_table );
-    PrintLexemList( lexems, result );
-    return ErrorsCount;
+Preprocessor::SharedFileCache::SharedFileCache() :
+    Stats( NULL ),
+    Head( NULL ),
+    Slots( NULL ),
+    Data( NULL ),
+    DataCapacity( 0 ),
+    MappingSize( 0 )
+{
 }
 
-void Preprocessor::Define( const std::string& str )
+Preprocessor::SharedFileCache::~SharedFileCache()
 {
-    if( str.length() == 0 )
-        return;
-    std::string data = "#define ";
-    data += str;
-    char*       d_end = &data[data.length() - 1];
-    ++d_end;
-    LexemList   lexems;
-    Lex( &data[0], d_end, lexems );
-
-    ParseDefine( CustomDefines, lexems );
+    Close();
 }
 
-void Preprocessor::Define( const std::string& str, const std::string& val )
+static std::string SharedObjectName( const std::string& name )
 {
-	std::string def = str + " " + val;
-	Define(def);
+    return name.compare( 0, 1, "/" ) == 0 ? name : "/" + name;
 }
 
-void Preprocessor::Undef( const std::string& str )
+bool Preprocessor::SharedFileCache::Open( const std::string& name, size_t size, unsigned int slots )
 {
-    for( DefineTable::iterator it = CustomDefines.begin(), end = CustomDefines.end(); it != end; ++it )
+    Close();
+    #if !defined(_WIN32)
+    std::string object = SharedObjectName( name );
+    size_t      slots_begin = ( sizeof( Header ) + 63 ) & ~(size_t) 63;
+    slots = std::max( 1U, slots );
+    size = std::max( size, slots_begin + slots * sizeof( Slot ) + 4096 );
+
+    int  fd = shm_open( object.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+    bool created = ( fd >= 0 );
+    if( created )
     {
-        if( ( *it ).first == str )
+        if( ftruncate( fd, (off_t) size ) != 0 )
         {
-            CustomDefines.erase( it );
-            Undef( str );
-            break;
+            close( fd );
+            shm_unlink( object.c_str() );
+            return false;
         }
     }
-}
+    else
+    {
+        if( errno != EEXIST || ( fd = shm_open( object.c_str(), O_RDWR, 0 ) ) < 0 )
+            return false;
+        // Creator may not have set size yet
+        struct stat st;
+        for( int wait = 0; fstat( fd, &st ) == 0 && (size_t) st.st_size < sizeof( Header ) && wait < 1000; wait++ )
+            usleep( 1000 );
+        size = (size_t) st.st_size;
+    }
 
-void Preprocessor::UndefAll()
-{
-    CustomDefines.clear();
-}
+    void* mapping = ( size >= sizeof( Header ) ? mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED );
+    close( fd );
+    if( mapping == MAP_FAILED )
+    {
+        if( created )
+            shm_unlink( object.c_str() );
+        return false;
+    }
+    Head = (Header*) mapping;
+    MappingSize = size;
 
-bool Preprocessor::IsDefined( const std::string& str )
-{
-    for( DefineTable::iterator it = CustomDefines.begin(), end = CustomDefines.end(); it != end; ++it )
+    if( created )
     {
-        if( ( *it ).first == str )
-            return true;
+        memcpy( Head->Magic, "ASPS", 4 );
+        Head->Version = Version;
+        Head->SlotCount = slots;
+        Head->Size = size;
+        Head->DataUsed.store( 0 );
+        Head->Ready.store( 1, std::memory_order_release );
     }
+    else
+    {
+        for( int wait = 0; !Head->Ready.load( std::memory_order_acquire ) && wait < 1000; wait++ )
+            usleep( 1000 );
+        if( !Head->Ready.load( std::memory_order_acquire ) || memcmp( Head->Magic, "ASPS", 4 ) || Head->Version != Version ||
+            Head->Size != size || !Head->SlotCount || slots_begin + Head->SlotCount * sizeof( Slot ) > size )
+        {
+            Close();
+            return false;
+        }
+    }
+
+    Slots = (Slot*) ( (char*) mapping + slots_begin );
+    Data = (char*) ( Slots + Head->SlotCount );
+    DataCapacity = size - ( Data - (char*) mapping );
+    return true;
+    #else
+    UNUSED_VAR( name );
+    UNUSED_VAR( size );
+    UNUSED_VAR( slots );
     return false;
+    #endif
 }
 
-Preprocessor::LineNumberTranslator* Preprocessor::GetLineNumberTranslator()
+void Preprocessor::SharedFileCache::Close()
 {
-    return LNT;
+    #if !defined(_WIN32)
+    if( Head )
+        munmap( Head, MappingSize );
+    #endif
+    Head = NULL;
+    Slots = NULL;
+    Data = NULL;
+    DataCapacity = 0;
+    MappingSize = 0;
 }
 
-std::string Preprocessor::ResolveOriginalFile( unsigned int line_number, LineNumberTranslator* lnt )
+bool Preprocessor::SharedFileCache::Remove( const std::string& name )
 {
-    lnt = ( lnt ? lnt : LNT );
-    return lnt ? lnt->Search( line_number ).File : "ERROR";
+    #if !defined(_WIN32)
+    return shm_unlink( SharedObjectName( name ).c_str() ) == 0;
+    #else
+    UNUSED_VAR( name );
+    return false;
+    #endif
 }
 
-unsigned int Preprocessor::ResolveOriginalLine( unsigned int line_number, LineNumberTranslator* lnt )
+size_t Preprocessor::SharedFileCache::GetUsed() const
 {
-    lnt = ( lnt ? lnt : LNT );
-    return lnt ? line_number - lnt->Search( line_number ).Offset : 0;
+    return Head ? std::min( (size_t) Head->DataUsed.load(), DataCapacity ) : 0;
 }
 
-std::vector<std::string>& Preprocessor::GetFileDependencies()
+bool Preprocessor::SharedFileCache::LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
 {
-    return FileDependencies;
+    std::string      path = dir + file_name;
+    StatCache::Entry entry;
+    const char*      ptr;
+    size_t           size;
+    if( Head && ( Stats ? Stats->Get( path, entry ) : StatCache::Stat( path, entry ) ) &&
+        Find( path, ArchiveLoader::Hash( 0, path.c_str(), path.length() ), &entry, ptr, size ) && ptr )
+    {
+        data.assign( ptr, ptr + size );
+        return true;
+    }
+    return FileLoader::LoadFile( dir, file_name, data );
 }
 
-std::vector<std::string>& Preprocessor::GetFilesPreprocessed()
+bool Preprocessor::SharedFileCache::MapFile( const std::string& dir, const std::string& file_name, const char*& data, size_t& size )
 {
-    return FilesPreprocessed;
+    std::string      path = dir + file_name;
+    StatCache::Entry entry;
+    if( !Head || !( Stats ? Stats->Get( path, entry ) : StatCache::Stat( path, entry ) ) )
+        return false;
+
+    unsigned int hash = ArchiveLoader::Hash( 0, path.c_str(), path.length() );
+    if( Find( path, hash, &entry, data, size ) && data )
+        return true;
+
+    // Missing or out of date, first process to load it stores it for others
+    std::vector<char> file;
+    if( entry.Size && !FileLoader::LoadFile( dir, file_name, file ) )
+        return false;
+    if( !Store( path, hash, entry, file, data ) )
+        return false;
+    size = file.size();
+    return true;
 }
 
-std::vector<std::string>& Preprocessor::GetParsedPragmas()
+Preprocessor::SharedFileCache::Slot* Preprocessor::SharedFileCache::Find( const std::string& path, unsigned int hash, const StatCache::Entry* entry,
+                                                                         const char*& data, size_t& size ) const
 {
-    return Pragmas;
+    data = NULL;
+    size = 0;
+    for( unsigned int i = 0; i < Head->SlotCount; i++ )
+    {
+        Slot&        slot = Slots[( hash + i ) % Head->SlotCount];
+        unsigned int version = slot.Version.load( std::memory_order_acquire );
+        if( version == 0 )
+            return NULL;
+        // Being claimed, path is not known yet
+        if( version == 1 )
+            continue;
+        if( slot.PathHash.load( std::memory_order_relaxed ) != hash || slot.PathSize.load( std::memory_order_relaxed ) != path.length() ||
+            memcmp( Data + slot.PathOffset.load( std::memory_order_relaxed ), path.c_str(), path.length() ) )
+            continue;
+
+        // Fields are consistent if version did not change while reading them
+        for( int retry = 0; entry && retry < 1000; retry++ )
+        {
+            unsigned int       before = slot.Version.load( std::memory_order_acquire );
+            unsigned long long offset = slot.DataOffset.load( std::memory_order_relaxed );
+            unsigned int       data_size = slot.DataSize.load( std::memory_order_relaxed );
+            long long          modified = slot.Modified.load( std::memory_order_relaxed );
+            unsigned long long file_size = slot.FileSize.load( std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( ( before & 1 ) || slot.Version.load( std::memory_order_relaxed ) != before )
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            if( modified == entry->Modified && file_size == entry->Size && data_size == file_size )
+            {
+                data = Data + offset;
+                size = data_size;
+            }
+            break;
+        }
+        return &slot;
+    }
+    return NULL;
 }
 
-void Preprocessor::PrintLexemList( LexemList& out, OutStream& destination )
+bool Preprocessor::SharedFileCache::Store( const std::string& path, unsigned int hash, const StatCache::Entry& entry,
+                                           const std::vector<char>& file, const char*& data )
 {
-    bool need_a_space = false;
-    for( LLITR itr = out.begin(); itr != out.end(); ++itr )
+    const char*        existing;
+    size_t             existing_size;
+    unsigned long long offset;
+    Slot*              slot = Find( path, hash, NULL, existing, existing_size );
+    if( !slot )
     {
-        if( itr->Type == Lexem::IDENTIFIER || itr->Type == Lexem::NUMBER )
+        // Slot is claimed before space is taken, so losing writer takes nothing
+        for( unsigned int i = 0; i < Head->SlotCount && !slot; i++ )
         {
-            if( need_a_space )
-                destination << " ";
-            need_a_space = true;
-            destination << itr->Value;
+            Slot&        free_slot = Slots[( hash + i ) % Head->SlotCount];
+            unsigned int version = 0;
+            if( free_slot.Version.compare_exchange_strong( version, 1 ) )
+            {
+                if( !Allocate( path.length() + file.size(), offset ) )
+                {
+                    free_slot.Version.store( 0, std::memory_order_release );
+                    return false;
+                }
+                memcpy( Data + offset, path.c_str(), path.length() );
+                if( !file.empty() )
+                    memcpy( Data + offset + path.length(), &file[0], file.size() );
+
+                free_slot.PathHash.store( hash, std::memory_order_relaxed );
+                free_slot.PathOffset.store( offset, std::memory_order_relaxed );
+                free_slot.PathSize.store( (unsigned int) path.length(), std::memory_order_relaxed );
+                free_slot.DataOffset.store( offset + path.length(), std::memory_order_relaxed );
+                free_slot.DataSize.store( (unsigned int) file.size(), std::memory_order_relaxed );
+                free_slot.Modified.store( entry.Modified, std::memory_order_relaxed );
+                free_slot.FileSize.store( entry.Size, std::memory_order_relaxed );
+                free_slot.LexemSize.store( 0, std::memory_order_relaxed );
+                free_slot.LexemOffset.store( 0, std::memory_order_relaxed );
+                free_slot.Version.store( 2, std::memory_order_release );
+                data = Data + offset + path.length();
+                return true;
+            }
+
+            // Other process may be storing same path
+            for( int wait = 0; version == 1 && wait < 100000; wait++ )
+            {
+                std::this_thread::yield();
+                version = free_slot.Version.load( std::memory_order_acquire );
+            }
+            if( version > 1 && free_slot.PathHash.load( std::memory_order_relaxed ) == hash &&
+                free_slot.PathSize.load( std::memory_order_relaxed ) == path.length() &&
+                !memcmp( Data + free_slot.PathOffset.load( std::memory_order_relaxed ), path.c_str(), path.length() ) )
+                slot = &free_slot;
         }
-        else
+        if( !slot )
+            return false;
+    }
+
+    // Writers of same entry take turns, data stored by earlier one is used if it is up to date
+    unsigned int version = 0;
+    for( int wait = 0; ; wait++ )
+    {
+        size_t size;
+        if( Find( path, hash, &entry, data, size ) && data )
+            return true;
+        version = slot->Version.load( std::memory_order_acquire );
+        if( !( version & 1 ) && slot->Version.compare_exchange_strong( version, version + 1 ) )
+            break;
+        if( wait >= 100000 )
+            return false;
+        std::this_thread::yield();
+    }
+    if( !Allocate( file.size(), offset ) )
+    {
+        slot->Version.store( version + 2, std::memory_order_release );
+        return false;
+    }
+    if( !file.empty() )
+        memcpy( Data + offset, &file[0], file.size() );
+    slot->DataOffset.store( offset, std::memory_order_relaxed );
+    slot->DataSize.store( (unsigned int) file.size(), std::memory_order_relaxed );
+    slot->Modified.store( entry.Modified, std::memory_order_relaxed );
+    slot->FileSize.store( entry.Size, std::memory_order_relaxed );
+    slot->LexemSize.store( 0, std::memory_order_relaxed );
+    slot->LexemOffset.store( 0, std::memory_order_relaxed );
+    slot->Version.store( version + 2, std::memory_order_release );
+    data = Data + offset;
+    return true;
+}
+
+bool Preprocessor::SharedFileCache::Load( const std::string& path, const char* data, size_t size, LexemList& lexems )
+{
+    const char* existing;
+    size_t      existing_size;
+    Slot*       slot = ( Head && data ? Find( path, ArchiveLoader::Hash( 0, path.c_str(), path.length() ), NULL, existing, existing_size ) : NULL );
+    if( !slot )
+        return false;
+
+    for( int retry = 0; retry < 1000; retry++ )
+    {
+        unsigned int       before = slot->Version.load( std::memory_order_acquire );
+        unsigned long long offset = slot->DataOffset.load( std::memory_order_relaxed );
+        unsigned int       data_size = slot->DataSize.load( std::memory_order_relaxed );
+        unsigned long long lexem_offset = slot->LexemOffset.load( std::memory_order_relaxed );
+        unsigned int       lexem_size = slot->LexemSize.load( std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if( ( before & 1 ) || slot->Version.load( std::memory_order_relaxed ) != before )
         {
-            need_a_space = false;
-            destination << itr->Value;
+            std::this_thread::yield();
+            continue;
+        }
+        if( Data + offset != data || data_size != size || !lexem_size || lexem_offset + lexem_size > DataCapacity )
+            return false;
+
+        // Published segment is never written again
+        const char*   segment = Data + lexem_offset;
+        unsigned int  count;
+        memcpy( &count, segment, sizeof( count ) );
+        if( sizeof( count ) + (size_t) count * sizeof( LexemRecord ) > lexem_size )
+            return false;
+
+        const LexemRecord* records = (const LexemRecord*) ( segment + sizeof( count ) );
+        LexemList          cached( lexems.get_allocator() );
+        for( unsigned int i = 0; i < count; i++ )
+        {
+            const LexemRecord& record = records[i];
+            if( (size_t) record.Value + record.Size > lexem_size )
+                return false;
+            cached.push_back( Lexem() );
+            Lexem& lexem = cached.back();
+            lexem.Type = (Lexem::LexemType) record.Type;
+            lexem.Value.assign( segment + record.Value, record.Size );
+            lexem.Line = record.Line;
+            lexem.Column = record.Column;
         }
+        lexems.splice( lexems.end(), cached );
+        return true;
     }
+    return false;
 }
 
-/************************************************************************/
-/* File loader                                                          */
-/************************************************************************/
-
-bool Preprocessor::FileLoader::LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+void Preprocessor::SharedFileCache::Store( const std::string& path, const char* data, size_t size, const LexemList& lexems )
 {
-    FILE* fs = fopen( ( dir + file_name ).c_str(), "rb" );
-    if( !fs )
-        return false;
+    if( !Head || data < Data || data >= Data + DataCapacity )
+        return;
 
-    fseek( fs, 0, SEEK_END );
-    int len = (int) ftell( fs );
-    fseek( fs, 0, SEEK_SET );
+    size_t strings = 0;
+    for( LexemList::const_iterator it = lexems.begin(); it != lexems.end(); ++it )
+        strings += it->Value.size();
+    size_t records = sizeof( unsigned int ) + lexems.size() * sizeof( LexemRecord );
+    if( records + strings > UINT_MAX )
+        return;
 
-    data.resize( len );
+    const char* existing;
+    size_t      existing_size;
+    Slot*       slot = Find( path, ArchiveLoader::Hash( 0, path.c_str(), path.length() ), NULL, existing, existing_size );
+    if( !slot )
+        return;
 
-    if( !fread( &data[0], len, 1, fs ) )
+    // Same even version on claim means fields checked before did not change
+    unsigned int version = slot->Version.load( std::memory_order_acquire );
+    if( ( version & 1 ) || Data + slot->DataOffset.load( std::memory_order_relaxed ) != data ||
+        slot->DataSize.load( std::memory_order_relaxed ) != size || slot->LexemSize.load( std::memory_order_relaxed ) )
+        return;
+    std::atomic_thread_fence( std::memory_order_acquire );
+    if( !slot->Version.compare_exchange_strong( version, version + 1 ) )
+        return;
+
+    unsigned long long offset;
+    if( !Allocate( records + strings, offset ) )
     {
-        fclose( fs );
-        return false;
+        slot->Version.store( version + 2, std::memory_order_release );
+        return;
     }
-    fclose( fs );
 
-    return true;
+    char*        segment = Data + offset;
+    unsigned int count = (unsigned int) lexems.size();
+    size_t       value = records;
+    memcpy( segment, &count, sizeof( count ) );
+    LexemRecord* record = (LexemRecord*) ( segment + sizeof( count ) );
+    for( LexemList::const_iterator it = lexems.begin(); it != lexems.end(); ++it, ++record )
+    {
+        record->Type = it->Type;
+        record->Value = (unsigned int) value;
+        record->Size = (unsigned int) it->Value.size();
+        record->Line = it->Line;
+        record->Column = it->Column;
+        if( !it->Value.empty() )
+            memcpy( segment + value, it->Value.data(), it->Value.size() );
+        value += it->Value.size();
+    }
+    slot->LexemOffset.store( offset, std::memory_order_relaxed );
+    slot->LexemSize.store( (unsigned int) ( records + strings ), std::memory_order_relaxed );
+    slot->Version.store( version + 2, std::memory_order_release );
+}
+
+bool Preprocessor::SharedFileCache::Allocate( size_t size, unsigned long long& offset )
+{
+    // Data is never freed, space taken past capacity is lost
+    unsigned long long aligned = ( size + 7 ) & ~7ULL;
+    offset = Head->DataUsed.fetch_add( aligned );
+    return offset + aligned <= DataCapacity;
 }
 
 /************************************************************************/
@@ -1178,7 +5560,7 @@ std::string Preprocessor::IntToString( int i )
     return r;
 }
 
-bool Preprocessor::SearchString( std::string str, char in )
+bool Preprocessor::SearchString( const std::string& str, char in )
 {
     return ( str.find_first_of( in ) < str.length() );
 }
@@ -1363,16 +5745,11 @@ char* Preprocessor::ParseBlockComment( char* start, char* end, Lexem& out )
     out.Type = Lexem::COMMENT;
     out.Value += "/*";
 
-    int newlines = 0;
     while( true )
     {
         ++start;
         if( start == end )
             break;
-        if( *start == '\n' )
-        {
-            newlines++;
-        }
         out.Value += *start;
         if( *start == '*' )
         {
@@ -1391,12 +5768,6 @@ char* Preprocessor::ParseBlockComment( char* start, char* end, Lexem& out )
             }
         }
     }
-    while( newlines > 0 )
-    {
-        --start;
-        *start = '\n';
-        --newlines;
-    }
     return start;
 }
 
@@ -1480,16 +5851,318 @@ char* Preprocessor::ParseLexem( char* start, char* end, Lexem& out )
     return ++start;
 }
 
-int Preprocessor::Lex( char* begin, char* end, std::list<Lexem>& results )
+int Preprocessor::Lex( char* begin, char* end, LexemList& results, unsigned int file )
 {
-    while( true )
+    Lexer lexer( begin, end, file );
+    while( !lexer.Done() )
+        lexer.LexDirective( results );
+    return 0;
+}
+
+// Lexer state at start of line, as far as it spans lines
+enum ScanState
+{
+    SCAN_CODE,
+    SCAN_COMMENT,
+    SCAN_STRING,
+    SCAN_CHARACTER,
+    SCAN_COUNT,
+};
+
+struct ScanResult
+{
+    int          State;             // At end of chunk
+    char*        Resume;            // First lexem starting in chunk, NULL if chunk is inside comment or string
+    unsigned int ResumeNewlines;    // Counted before Resume
+    char*        ResumeLineStart;
+    unsigned int Newlines;          // NEWLINE lexems, newlines inside strings are not lexed as such
+    char*        LineStart;         // After last of them, NULL if none
+};
+
+// Follows only what may span lines, mirroring ParseLexem() and its helpers
+static ScanResult ScanChunk( char* begin, char* end, int state )
+{
+    ScanResult r;
+    r.Resume = ( state == SCAN_CODE ? begin : NULL );
+    r.ResumeNewlines = 0;
+    r.ResumeLineStart = NULL;
+    r.Newlines = 0;
+    r.LineStart = NULL;
+    for( char* itr = begin; itr != end; ++itr )
+    {
+        char c = *itr;
+        if( state == SCAN_CODE || state == SCAN_COMMENT )
+        {
+            if( c == '\n' )
+            {
+                r.Newlines++;
+                r.LineStart = itr + 1;
+            }
+            else if( state == SCAN_COMMENT )
+            {
+                if( c == '*' && itr + 1 != end && itr[1] == '/' )
+                {
+                    state = SCAN_CODE;
+                    ++itr;
+                }
+            }
+            else if( c == '"' )
+                state = SCAN_STRING;
+            else if( c == '\'' )
+                state = SCAN_CHARACTER;
+            else if( c == '/' && itr + 1 != end && itr[1] == '/' )
+            {
+                while( itr + 1 != end && itr[1] != '\n' )
+                    ++itr;
+            }
+            else if( c == '/' && itr + 1 != end && itr[1] == '*' )
+            {
+                state = SCAN_COMMENT;
+                ++itr;
+            }
+        }
+        else if( c == '\\' && itr + 1 != end )
+            ++itr;
+        else if( c == ( state == SCAN_STRING ? '"' : '\'' ) )
+            state = SCAN_CODE;
+
+        if( !r.Resume && state == SCAN_CODE )
+        {
+            r.Resume = itr + 1;
+            r.ResumeNewlines = r.Newlines;
+            r.ResumeLineStart = r.LineStart;
+        }
+    }
+    r.State = state;
+    return r;
+}
+
+int Preprocessor::LexParallel( char* begin, char* end, LexemList& results, unsigned int file, unsigned int threads, Trace* trace )
+{
+    if( !threads )
+        threads = std::max( std::thread::hardware_concurrency(), 1U );
+
+    // Chunks begin at line starts
+    std::vector<char*> bounds( 1, begin );
+    size_t             chunk_size = (size_t) ( end - begin ) / threads + 1;
+    while( (size_t) ( end - bounds.back() ) > chunk_size )
+    {
+        char* newline = (char*) memchr( bounds.back() + chunk_size, '\n', end - bounds.back() - chunk_size );
+        if( !newline || newline + 1 == end )
+            break;
+        bounds.push_back( newline + 1 );
+    }
+    bounds.push_back( end );
+    size_t chunks = bounds.size() - 1;
+    if( chunks == 1 )
+        return Lex( begin, end, results, file );
+
+    // Scan of each chunk for every possible state at its start, first one starts in code
+    std::vector<ScanResult>  scans( chunks * SCAN_COUNT );
+    std::vector<std::thread> workers;
+    for( size_t i = 0; i < chunks; i++ )
+    {
+        workers.push_back( std::thread( [&scans, &bounds, i, trace]()
+            {
+                TraceScope scope( trace, Trace::NAME_SCAN_CHUNK );
+                for( int state = 0; state < ( i ? SCAN_COUNT : 1 ); state++ )
+                    scans[i * SCAN_COUNT + state] = ScanChunk( bounds[i], bounds[i + 1], state );
+            } ) );
+    }
+    for( size_t i = 0; i < chunks; i++ )
+        workers[i].join();
+    workers.clear();
+
+    // Actual start state and position of each chunk
+    std::vector<Lexer> lexers;
+    int                state = SCAN_CODE;
+    unsigned int       line = 0;
+    char*              line_start = begin;
+    for( size_t i = 0; i < chunks; i++ )
+    {
+        const ScanResult& scan = scans[i * SCAN_COUNT + state];
+        Lexer             lexer( scan.Resume ? scan.Resume : bounds[i + 1], end, file );
+        lexer.Limit = bounds[i + 1];
+        lexer.Line = line + scan.ResumeNewlines;
+        lexer.LineStart = ( scan.ResumeLineStart ? scan.ResumeLineStart : line_start );
+        lexers.push_back( lexer );
+
+        line += scan.Newlines;
+        line_start = ( scan.LineStart ? scan.LineStart : line_start );
+        state = scan.State;
+    }
+
+    // Lexem spanning chunk end is completed by chunk it begins in
+    MemoryContext*         memory = MemoryContext::Current();
+    bool                   shared = ( memory ? memory->Shared : false );
+    std::vector<LexemList> parts( chunks, LexemList( results.get_allocator() ) );
+    if( memory )
+        memory->Shared = true;
+    for( size_t i = 0; i < chunks; i++ )
+    {
+        workers.push_back( std::thread( [&lexers, &parts, i, trace, memory]()
+            {
+                MemoryContext::WorkerBlock block( memory );
+                TraceScope                 scope( trace, Trace::NAME_LEX_CHUNK );
+                while( lexers[i].Begin < lexers[i].Limit || lexers[i].CommentNewlines )
+                    lexers[i].LexDirective( parts[i] );
+            } ) );
+    }
+    for( size_t i = 0; i < chunks; i++ )
+    {
+        workers[i].join();
+        results.splice( results.end(), parts[i] );
+    }
+    if( memory )
+        memory->Shared = shared;
+    return 0;
+}
+
+Preprocessor::Lexer::Lexer( char* begin, char* end, unsigned int file ) :
+    Begin( begin ),
+    End( end ),
+    LineStart( begin ),
+    Line( 0 ),
+    File( file ),
+    CommentLineStart( NULL ),
+    CommentNewlines( 0 ),
+    LinesSkipped( 0 ),
+    Limit( end )
+{
+}
+
+Preprocessor::LLITR Preprocessor::Lexer::LexDirective( LexemList& results )
+{
+    LLITR            first = results.end();
+    bool             directive = false;
+    Lexem::LexemType previous = Lexem::NEWLINE;
+    while( Begin < Limit || CommentNewlines )
     {
         Lexem current_lexem;
-        begin = ParseLexem( begin, end, current_lexem );
-        if( current_lexem.Type != Lexem::WHITESPACE &&
-            current_lexem.Type != Lexem::COMMENT )
-            results.push_back( current_lexem );
-        if( begin == end )
-            return 0;
+        current_lexem.File = File;
+        current_lexem.Line = Line;
+
+        // Newlines of block comment follow it as if they ended its last characters
+        char* lexem_start = Begin - CommentNewlines;
+        current_lexem.Column = (unsigned int) ( lexem_start - LineStart );
+        if( CommentNewlines )
+        {
+            current_lexem.Type = Lexem::NEWLINE;
+            current_lexem.Value = "\n";
+        }
+        else
+            Begin = ParseLexem( Begin, End, current_lexem );
+
+        if( current_lexem.Type == Lexem::COMMENT && current_lexem.Value[1] == '*' )
+        {
+            size_t last = current_lexem.Value.find_last_of( '\n' );
+            if( last != std::string::npos )
+            {
+                CommentNewlines = (unsigned int) std::count( current_lexem.Value.begin(), current_lexem.Value.end(), '\n' );
+                CommentLineStart = lexem_start + last + 1;
+            }
+        }
+
+        if( current_lexem.Type == Lexem::WHITESPACE ||
+            current_lexem.Type == Lexem::COMMENT )
+            continue;
+
+        LLITR added = results.insert( results.end(), current_lexem );
+        if( first == results.end() )
+            first = added;
+
+        if( current_lexem.Type == Lexem::PREPROCESSOR )
+            directive = true;
+        else if( current_lexem.Type == Lexem::NEWLINE )
+        {
+            Line++;
+            LineStart = ( CommentNewlines ? lexem_start + 1 : Begin );
+            // Newlines moved out of block comment, real line starts after the last one of them
+            if( CommentNewlines && --CommentNewlines == 0 )
+                LineStart = CommentLineStart;
+            // Directive continues on next line after backslash
+            if( directive && previous != Lexem::BACKSLASH )
+                break;
+        }
+        previous = current_lexem.Type;
+    }
+    return first;
+}
+
+Preprocessor::LLITR Preprocessor::Lexer::SkipInactive( LexemList& results )
+{
+    // Only comments and string literals are tracked, '#' inside them doesn't start a directive
+    // Newlines still to follow block comment are skipped too
+    char*        start = Begin - CommentNewlines;
+    char*        itr = Begin;
+    char*        line_begin = ( CommentNewlines ? CommentLineStart : Begin );
+    unsigned int newlines = CommentNewlines;
+    bool         line_start = true;
+    bool         comment = false;
+    char         quote = 0;
+    while( itr != End )
+    {
+        char c = *itr;
+        if( c == '\n' )
+        {
+            newlines++;
+            line_begin = itr + 1;
+            line_start = line_start || !quote;
+        }
+        else if( comment )
+        {
+            if( c == '*' && itr + 1 != End && itr[1] == '/' )
+            {
+                comment = false;
+                ++itr;
+            }
+        }
+        else if( quote )
+        {
+            if( c == '\\' && itr + 1 != End && itr[1] != '\n' )
+                ++itr;
+            else if( c == quote )
+                quote = 0;
+        }
+        else if( c == '/' && itr + 1 != End && itr[1] == '*' )
+        {
+            comment = true;
+            ++itr;
+        }
+        else if( c == '/' && itr + 1 != End && itr[1] == '/' )
+        {
+            while( itr + 1 != End && itr[1] != '\n' )
+                ++itr;
+        }
+        else if( c == '#' && line_start )
+            break;
+        else if( c != ' ' && c != '\t' && c != '\r' )
+        {
+            line_start = false;
+            if( c == '"' || c == '\'' )
+                quote = c;
+        }
+        ++itr;
+    }
+
+    LLITR first = results.end();
+    if( newlines )
+    {
+        Lexem newline;
+        newline.Type = Lexem::NEWLINE;
+        newline.Value.assign( newlines, '\n' );
+        newline.File = File;
+        newline.Line = Line;
+        newline.Column = (unsigned int) ( start - LineStart );
+        first = results.insert( results.end(), newline );
     }
+
+    Begin = itr;
+    LineStart = line_begin;
+    Line += newlines;
+    CommentNewlines = 0;
+    LinesSkipped += newlines;
+
+    LLITR directive = LexDirective( results );
+    return first != results.end() ? first : directive;
 }
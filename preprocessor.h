@@ -40,10 +40,22 @@
 #define PREPROCESSOR_H
 
 #include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #define PREPROCESSOR_VERSION_STRING    "0.7"
@@ -125,6 +137,164 @@ struct Preprocessor
         void   AddLineRange( const std::string& file, unsigned int start_line, unsigned int offset );
     };
 
+    /************************************************************************/
+    /* Memory                                                               */
+    /************************************************************************/
+
+    // Source of memory for lexem lists and define tables, may be called from worker threads
+    struct AllocationHook
+    {
+        virtual ~AllocationHook() {}
+        virtual void* Allocate( size_t size ) = 0;
+        virtual void  Deallocate( void* ptr, size_t size ) = 0;
+        // Called when Preprocess() returns, everything it allocated is deallocated
+        virtual void  Reset() {}
+        // Deallocate() takes aligned parts of allocated block, worker threads may carve blocks of their own
+        virtual bool  IsCarvable() const { return false; }
+        // Whether last Allocate() took memory from global heap, hooks which can't tell return true
+        virtual bool  TookFromHeap() const { return true; }
+    };
+
+    // Bump allocator for a single Preprocess() call, freed blocks are reused by size,
+    // chunks are released by Reset() at once, or rewound if Retain is set
+    struct Arena: public AllocationHook
+    {
+        static const size_t Alignment = 16;
+        static const size_t SizeClasses = 16;   // Freed blocks up to SizeClasses * Alignment bytes are reused
+
+        size_t                                 ChunkSize;
+        std::vector<char*>                     Chunks;
+        std::vector<std::pair<char*, size_t> > BigChunks;   // Block bigger than ChunkSize each, never retained
+        size_t                                 ChunkIndex;  // Chunk being filled
+        char*                                  Next;        // Free space in it
+        char*                                  End;
+        void*                                  FreeLists[SizeClasses];
+        size_t                                 Capacity;    // Bytes taken from heap
+        bool                                   Retain;
+        bool                                   TookHeap;    // Last Allocate() took new chunk
+
+        Arena( size_t chunk_size = 1024 * 1024 );
+        virtual ~Arena();
+
+        virtual void* Allocate( size_t size );
+        virtual void  Deallocate( void* ptr, size_t size );
+        virtual void  Reset();
+        virtual bool  IsCarvable() const { return true; }
+        virtual bool  TookFromHeap() const { return TookHeap; }
+    };
+
+    struct MemoryStatistics;
+    struct Lexem;
+
+    // Active for thread during Preprocess(), containers remember context they were created in
+    // and return memory to it
+    struct MemoryContext
+    {
+        enum Category
+        {
+            MEMORY_LEXEMS,
+            MEMORY_DEFINES,
+            MEMORY_FILES,
+            MEMORY_LINES,
+            MEMORY_COUNT,
+        };
+
+        // Part of carvable hook's block used by one worker thread without Locker, counts are
+        // added to context when block is refilled and when worker is done
+        struct WorkerBlock
+        {
+            static const size_t Size = 64 * 1024;
+            static const size_t MaxPart = 1024;
+
+            MemoryContext* Context;
+            char*          Next;
+            char*          End;
+            size_t         Bytes[MEMORY_COUNT];
+            size_t         Requests;
+            size_t         HeapRequests;
+
+            WorkerBlock( MemoryContext* context );
+            ~WorkerBlock();
+
+            void                 Refill();
+            void                 Flush();
+
+            static WorkerBlock*& Current();
+        };
+
+        AllocationHook*   Hook;
+        MemoryStatistics* Stats;
+        int               Phase;
+        bool              Shared;   // Used by several threads, hook and stats are called under Locker
+        size_t            Used;     // Bytes currently allocated and tracked, checked against memory budget
+        std::mutex        Locker;
+
+        MemoryContext();
+
+        void*                  Allocate( size_t size, int category );
+        void                   Deallocate( void* ptr, size_t size, int category );
+        void                   Track( int category, size_t bytes, bool add );
+        // Heap allocations made outside of hook: file buffers, line entries and strings beyond
+        // their inline buffer, the last ones are counted when containers construct elements
+        void                   CountHeapAllocations( size_t count );
+        void                   CountString( const std::string& value );
+        void                   Constructed( const Lexem& lexem );
+        template<typename U>
+        void                   Constructed( const std::pair<const std::string, U>& entry ) { CountString( entry.first ); }
+        template<typename U>
+        void                   Constructed( const U& ) {}
+        // Called under Locker if Shared
+        void                   Count( size_t requests, size_t heap );
+
+        static MemoryContext*& Current();
+    };
+
+    template<typename T, int Category>
+    struct Allocator
+    {
+        typedef T value_type;
+
+        template<typename U>
+        struct rebind
+        {
+            typedef Allocator<U, Category> other;
+        };
+
+        MemoryContext* Context;
+
+        Allocator() : Context( MemoryContext::Current() ) {}
+        template<typename U>
+        Allocator( const Allocator<U, Category>& other ) : Context( other.Context ) {}
+
+        T* allocate( size_t n )
+        {
+            return (T*) ( Context ? Context->Allocate( n * sizeof( T ), Category ) : ::operator new( n * sizeof( T ) ) );
+        }
+        void deallocate( T* ptr, size_t n )
+        {
+            if( Context )
+                Context->Deallocate( ptr, n * sizeof( T ), Category );
+            else
+                ::operator delete( ptr );
+        }
+
+        template<typename U, typename... Args>
+        void construct( U* ptr, Args&&... args )
+        {
+            ::new( (void*) ptr ) U( std::forward<Args>( args )... );
+            if( Context && Context->Stats )
+                Context->Constructed( *ptr );
+        }
+
+        // Copies belong to context of the copying code
+        Allocator select_on_container_copy_construction() const { return Allocator(); }
+
+        template<typename U>
+        bool operator==( const Allocator<U, Category>& other ) const { return Context == other.Context; }
+        template<typename U>
+        bool operator!=( const Allocator<U, Category>& other ) const { return Context != other.Context; }
+    };
+
     /************************************************************************/
     /* Lexems                                                               */
     /************************************************************************/
@@ -148,12 +318,20 @@ struct Preprocessor
             BACKSLASH,
         };
 
-        std::string Value;
-        LexemType   Type;
+        static const unsigned int NoPosition = 0xFFFFFFFF;
+
+        std::string  Value;
+        LexemType    Type;
+        unsigned int File;      // Index in GetFilesPreprocessed(), NoPosition for generated lexems
+        unsigned int Line;      // Zero-based line in File
+        unsigned int Column;    // Zero-based column in Line
+        unsigned int Expansion; // Index in SourceMap::Expansions, NoPosition if not expanded from macro
+
+        Lexem() : Type( IGNORED ), File( NoPosition ), Line( 0 ), Column( 0 ), Expansion( NoPosition ) {}
     };
 
-    typedef std::list<Lexem>    LexemList;
-    typedef LexemList::iterator LLITR;
+    typedef std::list<Lexem, Allocator<Lexem, MemoryContext::MEMORY_LEXEMS> > LexemList;
+    typedef LexemList::iterator                                               LLITR;
 
     static const std::string Numbers;
     static const std::string IdentifierStart;
@@ -163,6 +341,370 @@ struct Preprocessor
     static const std::string Trivials;
     static const Lexem::LexemType TrivialTypes[12];
 
+    // Lexes buffer on demand, directive processing pulls lexems up to next directive line
+    struct Lexer
+    {
+        char*        Begin;             // Next character to lex
+        char*        End;
+        char*        LineStart;
+        unsigned int Line;
+        unsigned int File;
+        char*        CommentLineStart;  // Newlines moved out of block comment, real line starts after the last one
+        unsigned int CommentNewlines;   // Lexed after the comment, buffer is never written to
+        size_t       LinesSkipped;
+        char*        Limit;             // Lexing stops at it, except for newlines moved out of block comment
+
+        Lexer( char* begin, char* end, unsigned int file = Lexem::NoPosition );
+
+        bool  Done() const { return Begin == End && !CommentNewlines; }
+
+        // Appends lexems up to and including line containing directive, returns first appended or results.end()
+        LLITR LexDirective( LexemList& results );
+        // Skips lines up to one beginning with '#' without lexing them, then lexes as LexDirective.
+        // Skipped lines are appended as single NEWLINE lexem holding one '\n' per line.
+        LLITR SkipInactive( LexemList& results );
+    };
+
+    /************************************************************************/
+    /* Source map                                                           */
+    /************************************************************************/
+
+    // Maps output line/column to source file/line/column, encoded as in Source Map v3
+    // ( ';' separated lines, ',' separated segments of base64 VLQ deltas ).
+    // Optional fifth segment field is index in Expansions ( mirrored in "names" ),
+    // describing the macro call which produced the lexem.
+    struct SourceMap
+    {
+        struct Position
+        {
+            unsigned int File;
+            unsigned int Line;
+            unsigned int Column;
+            unsigned int Expansion;
+        };
+
+        struct Expansion
+        {
+            std::string  Macro;
+            unsigned int File;      // Call site
+            unsigned int Line;
+            unsigned int Column;
+            unsigned int Parent;    // Expansion the call site came from, Lexem::NoPosition if none
+        };
+
+        struct Checkpoint
+        {
+            size_t   Offset;
+            Position State;
+        };
+
+        static const unsigned int CheckpointInterval = 32;
+
+        bool                     TrackExpansions;
+        std::vector<std::string> Files;
+        std::vector<Expansion>   Expansions;
+        std::string              Mappings;
+        std::vector<Checkpoint>  Checkpoints;
+
+        SourceMap();
+
+        void         Clear();
+        unsigned int AddExpansion( const std::string& macro, const Lexem& call_site );
+        void         AddMapping( unsigned int column, const Lexem& lexem );
+        void         AddLine();
+
+        bool         Find( unsigned int line, unsigned int column, Position& pos ) const;
+        void         GetExpansionChain( unsigned int expansion, std::vector<Expansion>& chain ) const;
+        void         PrintJSON( OutStream& out, const std::string& output_file ) const;
+
+        unsigned int GeneratedLine;
+        unsigned int PrevGeneratedColumn;
+        Position     Prev;
+    };
+
+    /************************************************************************/
+    /* Binary token stream                                                  */
+    /************************************************************************/
+
+    // Output of OUTPUT_TOKENS format, little-endian, all fields 4-byte aligned:
+    //   Header
+    //   unsigned int StringOffsets[StringCount + 1]  offsets in StringData, last one is end of last string
+    //   unsigned int FileNames[FileCount]            string ids of GetFilesPreprocessed() entries
+    //   Token        Tokens[TokenCount]              lexems in output order, newlines included
+    //   char         StringData[StringDataSize]      not null terminated, padded to 4 bytes
+    // Identifier and number lexems adjacent in stream must be separated by space in text form.
+    struct TokenStream
+    {
+        static const unsigned int Version = 1;
+
+        struct Header
+        {
+            char         Magic[4];  // "ASPT"
+            unsigned int Version;
+            unsigned int FileCount;
+            unsigned int StringCount;
+            unsigned int TokenCount;
+            unsigned int StringDataSize;
+            unsigned int Reserved[2];
+        };
+
+        struct Token
+        {
+            unsigned int Type;      // Lexem::LexemType
+            unsigned int Value;     // String id
+            unsigned int File;      // Index in FileNames, Lexem::NoPosition for generated lexems
+            unsigned int Line;
+            unsigned int Column;
+        };
+
+        const Header*       Head;
+        const unsigned int* StringOffsets;
+        const unsigned int* FileNames;
+        const Token*        Tokens;
+        const char*         StringData;
+
+        TokenStream();
+
+        // Data is not copied, must be 4-byte aligned and outlive the stream
+        bool        Open( const void* data, size_t size );
+        const char* GetString( unsigned int id, size_t& length ) const;
+        std::string GetString( unsigned int id ) const;
+    };
+
+    enum OutputFormat
+    {
+        OUTPUT_TEXT,
+        OUTPUT_TOKENS,
+    };
+
+    /************************************************************************/
+    /* Statistics                                                           */
+    /************************************************************************/
+
+    struct Statistics
+    {
+        enum Phase
+        {
+            PHASE_LOAD,
+            PHASE_LEX,
+            PHASE_DIRECTIVES,
+            PHASE_EXPANSION,
+            PHASE_EMIT,
+            PHASE_COUNT,
+        };
+
+        static const char* PhaseNames[PHASE_COUNT];
+
+        size_t BytesRead;
+        size_t LexemsLexed;
+        size_t PeakLexems;          // Live in lexem lists of all files being processed
+        size_t MacroLookups;
+        size_t MacroExpansions;
+        size_t IncludesProcessed;
+        size_t IncludesSkipped;     // Inside inactive conditional blocks
+        size_t IfEvaluations;
+        size_t LexemsDropped;       // Inside inactive conditional blocks
+        size_t LinesSkipped;        // Inside inactive conditional blocks, never lexed
+        size_t OutputBytes;
+        size_t BytesSpilled;        // Written to temporary files to stay within memory budget
+        double PhaseTime[PHASE_COUNT];  // Seconds, exclusive
+        double TotalTime;
+
+        int    CurrentPhase;
+        double PhaseStart;
+
+        Statistics();
+
+        void   Clear();
+        void   Add( const Statistics& other );
+        double MacroHitRatio() const;
+        int    EnterPhase( int phase );
+        void   LeavePhase( int previous );
+
+        // One "name value" pair per line
+        void   Print( OutStream& out ) const;
+    };
+
+    /************************************************************************/
+    /* Memory statistics                                                    */
+    /************************************************************************/
+
+    struct MemoryStatistics
+    {
+        static const char* CategoryNames[MemoryContext::MEMORY_COUNT];
+
+        size_t Current[MemoryContext::MEMORY_COUNT];    // Bytes
+        size_t Peak[MemoryContext::MEMORY_COUNT];
+        size_t PeakTotal;
+        size_t Allocations[Statistics::PHASE_COUNT];    // Requests to hook or heap
+        size_t HeapAllocations;                         // Of them, ones which took memory from global heap
+        bool   ForbidAllocations;                       // Each heap allocation is reported as error
+        size_t ForbiddenAllocations;
+
+        MemoryStatistics();
+
+        // Keeps ForbidAllocations
+        void Clear();
+        void Print( OutStream& out ) const;
+    };
+
+    /************************************************************************/
+    /* Profile                                                              */
+    /************************************************************************/
+
+    // Cost attributed to files and macros, accumulated over Preprocess() calls until Clear()
+    struct Profile
+    {
+        struct FileEntry
+        {
+            std::string File;
+            size_t      Includes;
+            double      InclusiveTime;  // Seconds
+            double      ExclusiveTime;
+            size_t      LexemsLexed;
+            size_t      LexemsEmitted;  // Including ones expanded from macros defined in file
+        };
+
+        struct MacroEntry
+        {
+            std::string Macro;
+            size_t      Invocations;
+            size_t      LexemsProduced;
+            double      Time;           // Seconds, without rescanning of produced lexems
+        };
+
+        struct Frame
+        {
+            size_t Entry;
+            double Start;
+            double Children;
+        };
+
+        std::vector<FileEntry>        Files;
+        std::vector<MacroEntry>       Macros;
+        std::map<std::string, size_t> FileIndex;
+        std::map<std::string, size_t> MacroIndex;
+        std::vector<Frame>            Stack;
+
+        void        Clear();
+        FileEntry&  GetFile( const std::string& file );
+        MacroEntry& GetMacro( const std::string& macro );
+        void        EnterFile( const std::string& file );
+        void        LeaveFile();
+
+        // Files sorted by exclusive time, macros by time, limit 0 prints all
+        void        PrintTable( OutStream& out, size_t limit = 0 ) const;
+        void        PrintJSON( OutStream& out ) const;
+    };
+
+    /************************************************************************/
+    /* Trace                                                                */
+    /************************************************************************/
+
+    // Timeline in Chrome trace event format, spans are kept in preallocated ring buffer
+    // and may be recorded by several preprocessors in different threads
+    struct Trace
+    {
+        struct Event
+        {
+            unsigned int Name;      // Index in Names
+            unsigned int Thread;
+            double       Start;     // Seconds of steady clock
+            double       Duration;
+        };
+
+        // Names interned by constructor, spans with these names are recorded without locking
+        enum FixedName
+        {
+            NAME_LOAD,
+            NAME_LEX,
+            NAME_EMIT,
+            NAME_SCAN_CHUNK,        // LexParallel() workers
+            NAME_LEX_CHUNK,
+            NAME_DEFINE,
+            NAME_UNDEF,
+            NAME_INCLUDE,
+            NAME_IF,
+            NAME_IFDEF,
+            NAME_IFNDEF,
+            NAME_ELIF,
+            NAME_ELSE,
+            NAME_ENDIF,
+            NAME_PRAGMA,
+            NAME_MESSAGE,
+            NAME_WARNING,
+            NAME_ERROR,
+            NAME_DIRECTIVE,         // Unknown directive
+            NAME_COUNT
+        };
+
+        std::vector<Event>            Events;
+        std::atomic<size_t>           Recorded;
+        std::vector<std::string>      Names;
+        std::map<std::string, size_t> NameIndex;
+        std::mutex                    NamesLocker;
+
+        Trace( size_t capacity = 65536 );
+
+        // Names other than fixed ones are removed, must not be called while spans are recorded
+        void                Clear();
+        // Interns name, used for file names once per file and run
+        unsigned int        GetName( const std::string& name );
+        static unsigned int GetDirectiveName( const std::string& directive );
+        void                AddEvent( unsigned int name, double start, double duration );
+
+        // Oldest events are lost if more than capacity were recorded
+        void         PrintJSON( OutStream& out );
+    };
+
+    /************************************************************************/
+    /* Output store                                                         */
+    /************************************************************************/
+
+    // Outputs of many roots, text is split into segments at include boundaries and identical
+    // segments are stored once, each root keeps rope of segment ids. Saved file format,
+    // little-endian, all fields 4-byte aligned:
+    //   Header
+    //   unsigned int SegmentOffsets[SegmentCount + 1]  in Data, last one is end of last segment
+    //   unsigned int RopeOffsets[RootCount + 1]        in RopeData
+    //   unsigned int RopeData[RopeSize]                segment ids
+    //   char         Data[DataSize]                    padded to 4 bytes
+    struct OutputStore
+    {
+        static const unsigned int Version = 1;
+
+        struct Header
+        {
+            char         Magic[4];      // "ASPO"
+            unsigned int Version;
+            unsigned int SegmentCount;
+            unsigned int RootCount;
+            unsigned int RopeSize;
+            unsigned int DataSize;
+        };
+
+        typedef std::vector<unsigned int> Rope;
+
+        std::vector<std::string> Segments;
+        std::vector<Rope>        Roots;
+
+        // Output without translator is single segment, returns root index
+        size_t Add( const std::string& text, const LineNumberTranslator* lnt = NULL );
+        void   Write( size_t root, OutStream& out ) const;
+        size_t GetSize( size_t root ) const;
+        size_t GetTotalSize() const;    // Of all roots as separate copies
+        size_t GetUniqueSize() const;   // Of stored segments
+        void   Clear();
+
+        bool   Save( const std::string& path ) const;
+        bool   Load( const std::string& path );
+
+    private:
+        std::unordered_map<size_t, std::vector<unsigned int> > Index;  // Hash of text -> segment ids
+
+        unsigned int Intern( const char* text, size_t length );
+    };
+
     /************************************************************************/
     /* Loader                                                               */
     /************************************************************************/
@@ -171,13 +713,356 @@ struct Preprocessor
     {
         virtual ~FileLoader() {}
         virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data );
+        // Zero-copy alternative tried before LoadFile(), data must stay valid until Preprocess() returns
+        virtual bool MapFile( const std::string& dir, const std::string& file_name, const char*& data, size_t& size );
+    };
+
+    // Whole files lexed once and shared by Preprocess() calls, path includes root path.
+    // Data is what loader returned for file, cache may use it to check stored entry.
+    struct LexemCache
+    {
+        virtual ~LexemCache() {}
+        // Appends lexems of file, false if not cached
+        virtual bool Load( const std::string& path, const char* data, size_t size, LexemList& lexems ) = 0;
+        // Called outside of run memory context, lexems may be copied as they are
+        virtual void Store( const std::string& path, const char* data, size_t size, const LexemList& lexems ) = 0;
+    };
+
+    // Single file bundle of scripts written by Build(), little-endian, all fields 4-byte aligned:
+    //   Header
+    //   int          Seeds[BucketCount]    perfect hash displacement of bucket, -1 - slot for bucket with single entry
+    //   Entry        Entries[FileCount]    in slot order
+    //   char         Data[DataSize]        paths and contents, not null terminated
+    // Paths are relative to Preprocess() file_path, leading "./" is ignored.
+    struct ArchiveLoader: public FileLoader
+    {
+        static const unsigned int Version = 1;
+
+        struct Header
+        {
+            char         Magic[4];  // "ASPA"
+            unsigned int Version;
+            unsigned int FileCount;
+            unsigned int BucketCount;
+            unsigned int DataSize;
+            unsigned int Reserved[3];
+        };
+
+        struct Entry
+        {
+            unsigned int PathOffset;    // In Data
+            unsigned int PathSize;
+            unsigned int DataOffset;
+            unsigned int DataSize;
+        };
+
+        const Header*     Head;
+        const int*        Seeds;
+        const Entry*      Entries;
+        const char*       Data;
+        void*             Mapping;      // Whole archive, mapped read-only
+        size_t            MappingSize;
+        std::vector<char> Buffer;       // Whole archive where it can not be mapped
+        std::string       Overlay;      // Loose files in this directory override archive entries, empty disables
+
+        ArchiveLoader();
+        virtual ~ArchiveLoader();
+
+        bool                Open( const std::string& path );
+        void                Close();
+        bool                Find( const std::string& path, const char*& data, size_t& size ) const;
+
+        virtual bool        LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data );
+        virtual bool        MapFile( const std::string& dir, const std::string& file_name, const char*& data, size_t& size );
+
+        // Path in archive -> content
+        static bool         Build( const std::string& path, const std::map<std::string, std::string>& files );
+        static unsigned int Hash( unsigned int seed, const char* str, size_t length );
+    };
+
+    // Loads many files at once, requests are made and completions taken from single thread
+    struct AsyncFileLoader
+    {
+        struct Completion
+        {
+            unsigned int      Id;
+            std::string       Dir;
+            std::string       FileName;
+            std::vector<char> Data;
+            bool              Loaded;
+        };
+
+        virtual ~AsyncFileLoader() {}
+        // Returns id reported back in completion, request may not start before Flush() or Wait()
+        virtual unsigned int Submit( const std::string& dir, const std::string& file_name ) = 0;
+        virtual void         Flush() {}
+        // Blocks until some request completes, false if none is pending
+        virtual bool         Wait( Completion& completion ) = 0;
+
+        // io_uring where kernel allows it, thread pool otherwise
+        static AsyncFileLoader* Create( unsigned int queue_depth = 64 );
+    };
+
+    // Requests are loaded by FileLoader on worker threads
+    struct ThreadPoolFileLoader: public AsyncFileLoader
+    {
+        ThreadPoolFileLoader( unsigned int threads = 8, FileLoader* loader = NULL );
+        virtual ~ThreadPoolFileLoader();
+
+        virtual unsigned int Submit( const std::string& dir, const std::string& file_name );
+        virtual bool         Wait( Completion& completion );
+
+    private:
+        FileLoader               Default;
+        FileLoader*              Loader;
+        std::vector<std::thread> Threads;
+        std::mutex               Locker;
+        std::condition_variable  Wake;
+        std::condition_variable  Finished;
+        std::deque<Completion>   Requests;
+        std::deque<Completion>   Results;
+        unsigned int             NextId;
+        unsigned int             Pending;
+        bool                     Quit;
+
+        void Run();
+    };
+
+    // Linux io_uring, files are opened and read by kernel with up to Open() entries in flight,
+    // Open() fails where io_uring is not available
+    struct UringFileLoader: public AsyncFileLoader
+    {
+        UringFileLoader();
+        virtual ~UringFileLoader();
+
+        bool                 Open( unsigned int entries = 64 );
+        void                 Close();
+
+        virtual unsigned int Submit( const std::string& dir, const std::string& file_name );
+        virtual void         Flush();
+        virtual bool         Wait( Completion& completion );
+
+    private:
+        struct Operation
+        {
+            Completion  Request;
+            std::string Path;
+            int         Fd;         // -1 while opening
+            size_t      Done;       // Bytes read
+        };
+
+        int                       RingFd;
+        unsigned int              Entries;
+        void*                     SqRing;
+        size_t                    SqRingSize;
+        void*                     CqRing;
+        size_t                    CqRingSize;
+        void*                     Sqes;
+        size_t                    SqesSize;
+        unsigned int*             SqTail;
+        unsigned int*             SqMask;
+        unsigned int*             SqArray;
+        unsigned int*             CqHead;
+        unsigned int*             CqTail;
+        unsigned int*             CqMask;
+        void*                     Cqes;
+        std::vector<Operation>    Operations;       // Fixed size, index is user data of submission
+        std::vector<unsigned int> FreeOperations;
+        std::deque<Completion>    Backlog;          // Waiting for free operation
+        std::deque<Completion>    Results;
+        unsigned int              Unsubmitted;
+        unsigned int              NextId;
+
+        void Start( Completion& request );
+        void Push( unsigned int op );
+        void Reap( unsigned int op, int res );
+        void Finish( unsigned int op, bool loaded );
+    };
+
+    // Reads files included by loaded ones ahead through AsyncFileLoader. Includes are found by
+    // scanning for #include "file" lines, so also ones in inactive blocks are read.
+    struct PrefetchLoader: public FileLoader
+    {
+        AsyncFileLoader* Async;
+        unsigned int     MaxInFlight;
+
+        PrefetchLoader( AsyncFileLoader* async, unsigned int max_in_flight = 32 );
+        virtual ~PrefetchLoader();
+
+        virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data );
+        void         Prefetch( const std::string& dir, const std::string& file_name );
+        // Waits for reads in flight and drops everything read ahead
+        void         Clear();
+
+    private:
+        std::unordered_map<std::string, unsigned int>                 InFlight;
+        std::unordered_map<std::string, AsyncFileLoader::Completion> Ready;
+        std::deque<std::pair<std::string, std::string> >             Queued;     // Over MaxInFlight
+
+        void         WaitOne();
+    };
+
+    // Metadata of files by path, entries are kept until invalidated, may be used from several threads
+    struct StatCache
+    {
+        struct Entry
+        {
+            bool               Exists;
+            unsigned long long Size;
+            long long          Modified;    // Nanoseconds since epoch
+            unsigned long long Inode;
+        };
+
+        StatCache();
+
+        // False if file does not exist, file system is asked only for paths not cached
+        bool         Get( const std::string& path, Entry& entry );
+        // Asks file system, nothing is cached
+        static bool  Stat( const std::string& path, Entry& entry );
+        void         Invalidate( const std::string& path );
+        void         Clear();
+        // Number of stat() calls made
+        unsigned int GetStatCalls();
+
+    private:
+        std::mutex                             Locker;
+        std::unordered_map<std::string, Entry> Entries;
+        unsigned int                           StatCalls;
+    };
+
+    // Linux inotify watch of directories of preprocessed files, background thread collects changed
+    // paths into dirty set, so checking for changes needs no system calls. Open() fails where
+    // inotify is not available.
+    struct FileWatcher
+    {
+        struct Listener
+        {
+            virtual ~Listener() {}
+            // Called from watcher thread
+            virtual void FilesChanged( const std::vector<std::string>& paths ) = 0;
+        };
+
+        // Set before Open(), changed paths are invalidated and reported to them
+        StatCache* Stats;
+        Listener*  Changes;
+
+        FileWatcher( StatCache* stats = NULL, Listener* changes = NULL );
+        ~FileWatcher();
+
+        bool         Open();
+        void         Close();
+        // Paths as returned by GetFilesPreprocessed(), their directories are watched
+        bool         Watch( const std::vector<std::string>& paths );
+        bool         IsDirty( const std::string& path );
+        bool         AnyDirty( const std::vector<std::string>& paths );
+        // Moves out dirty set
+        void         TakeDirty( std::vector<std::string>& paths );
+        // Incremented by each change, same value means nothing got dirty since
+        unsigned int GetGeneration();
+
+    private:
+        int                                                Fd;
+        int                                                WakeFds[2];     // Wakes thread for Close()
+        std::thread                                        Thread;
+        std::mutex                                         Locker;
+        std::unordered_map<int, std::vector<std::string> > Dirs;           // Watch descriptor -> path prefixes of directory
+        std::unordered_set<std::string>                    WatchedDirs;
+        std::unordered_set<std::string>                    Files;          // All dirty when events were lost
+        std::unordered_set<std::string>                    Dirty;
+        std::atomic<unsigned int>                          Generation;
+
+        void Run();
+        void MarkDirty( std::vector<std::string>& paths );
+    };
+
+    // Files shared by processes through POSIX shared memory object attached by name. Entries are
+    // versioned and read without locks, file data is only appended, so mapped data stays valid
+    // while attached. Changed files are stored again, once full only existing entries are served.
+    // Set as lexem cache too, lexems of mapped data are stored with it and dropped on change.
+    struct SharedFileCache: public FileLoader, public LexemCache
+    {
+        static const unsigned int Version = 2;
+
+        // Position independent lexems of file, offsets are relative to segment:
+        //   unsigned int LexemCount
+        //   LexemRecord  Lexems[LexemCount]
+        //   char         Strings[]             values, not null terminated
+        struct LexemRecord
+        {
+            unsigned int Type;      // Lexem::LexemType
+            unsigned int Value;     // Offset of value in segment
+            unsigned int Size;
+            unsigned int Line;
+            unsigned int Column;
+        };
+
+        // Used to check cached entries are up to date, NULL asks file system each time
+        StatCache* Stats;
+
+        SharedFileCache();
+        virtual ~SharedFileCache();
+
+        // Object is created with given size and slots if it does not exist, fails where POSIX
+        // shared memory is not available
+        bool         Open( const std::string& name, size_t size = 64 * 1024 * 1024, unsigned int slots = 4096 );
+        void         Close();
+        // Object is freed once all processes closed it
+        static bool  Remove( const std::string& name );
+
+        virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data );
+        virtual bool MapFile( const std::string& dir, const std::string& file_name, const char*& data, size_t& size );
+
+        // Data must be mapped by this cache, lexems of loaded copies are not stored
+        virtual bool Load( const std::string& path, const char* data, size_t size, LexemList& lexems );
+        virtual void Store( const std::string& path, const char* data, size_t size, const LexemList& lexems );
+
+        // Bytes of data area in use
+        size_t       GetUsed() const;
+
+    private:
+        struct Header
+        {
+            char                               Magic[4];    // "ASPS"
+            unsigned int                       Version;
+            std::atomic<unsigned int>          Ready;       // Set by creator when initialized
+            unsigned int                       SlotCount;
+            unsigned long long                 Size;
+            std::atomic<unsigned long long>    DataUsed;
+        };
+
+        // Version is 0 for free slot, odd while written, path fields do not change once set.
+        // Lexem segment belongs to data, it is cleared whenever data is replaced.
+        struct Slot
+        {
+            std::atomic<unsigned int>          Version;
+            std::atomic<unsigned int>          PathHash;
+            std::atomic<unsigned long long>    PathOffset;
+            std::atomic<unsigned int>          PathSize;
+            std::atomic<unsigned int>          DataSize;
+            std::atomic<unsigned long long>    DataOffset;
+            std::atomic<long long>             Modified;
+            std::atomic<unsigned long long>    FileSize;
+            std::atomic<unsigned int>          LexemSize;   // 0 if not lexed
+            std::atomic<unsigned long long>    LexemOffset;
+        };
+
+        Header* Head;
+        Slot*   Slots;
+        char*   Data;
+        size_t  DataCapacity;
+        size_t  MappingSize;
+
+        Slot*   Find( const std::string& path, unsigned int hash, const StatCache::Entry* entry, const char*& data, size_t& size ) const;
+        bool    Store( const std::string& path, unsigned int hash, const StatCache::Entry& entry, const std::vector<char>& file, const char*& data );
+        bool    Allocate( size_t size, unsigned long long& offset );
     };
 
     /************************************************************************/
     /* Define table                                                         */
     /************************************************************************/
 
-    typedef std::map<std::string,int> ArgSet;
+    typedef std::map<std::string, int, std::less<std::string>,
+                     Allocator<std::pair<const std::string, int>, MemoryContext::MEMORY_DEFINES> > ArgSet;
 
     struct DefineEntry
     {
@@ -185,10 +1070,26 @@ struct Preprocessor
         ArgSet    Arguments;
     };
 
-    typedef std::map<std::string,DefineEntry> DefineTable;
+    typedef std::map<std::string, DefineEntry, std::less<std::string>,
+                     Allocator<std::pair<const std::string, DefineEntry>, MemoryContext::MEMORY_DEFINES> > DefineTable;
 
     DefineTable CustomDefines;
 
+    /************************************************************************/
+    /* Conditionals                                                         */
+    /************************************************************************/
+
+    // Open #if/#ifdef/#ifndef block of the file being preprocessed
+    struct Conditional
+    {
+        bool ParentActive;  // Enclosing block is emitted
+        bool Active;        // Current branch is emitted
+        bool Taken;         // No later #elif/#else branch may be emitted
+        bool Else;          // #else was seen
+    };
+
+    typedef std::vector<Conditional> ConditionalStack;
+
     /************************************************************************/
     /* Pragmas                                                              */
     /************************************************************************/
@@ -204,14 +1105,152 @@ struct Preprocessor
             unsigned int GlobalLine;
         };
 
+        struct Record: public Instance
+        {
+            std::string Name;
+        };
+
         struct Callback
         {
             virtual ~Callback() {}
             virtual void CallPragma( const std::string& name, const Pragma::Instance& pi ) = 0;
+            // Used by DISPATCH_BATCH, records are in order of appearance
+            virtual void CallPragmas( const std::vector<Record>& records );
+        };
+
+        enum DispatchMode
+        {
+            DISPATCH_SYNC,      // Callback is called while preprocessing
+            DISPATCH_THREAD,    // Callback is called in order on worker thread, see WaitPragmas()
+            DISPATCH_BATCH,     // Callback gets all records when preprocessing finished
+        };
+
+        // Single thread calling queued callbacks in order
+        struct Worker
+        {
+            Worker();
+            ~Worker();          // Calls remaining callbacks
+
+            void Push( Callback* callback, const Record& record );
+            void Wait();
+
+        private:
+            std::thread                                  Thread;
+            std::mutex                                   Locker;
+            std::condition_variable                      Wake;
+            std::condition_variable                      Idle;
+            std::deque<std::pair<Callback*, Record> >    Queue;
+            bool                                         Busy;
+            bool                                         Quit;
+
+            void Run();
+        };
+
+        struct Handler
+        {
+            virtual ~Handler() {}
+            virtual void Call( const Pragma::Instance& pi ) = 0;
+        };
+
+        enum DedupMode
+        {
+            DEDUP_NONE,
+            DEDUP_RUN,          // Identical name and text is dispatched once per Preprocess() call
+            DEDUP_ALL,          // Identical name and text is dispatched once until ClearSeen()
+        };
+
+        enum UnknownMode
+        {
+            UNKNOWN_IGNORE,
+            UNKNOWN_WARN,       // Warning is printed for pragma without handler
+        };
+
+        // Dispatches pragmas to handlers registered by name, filtering is done by
+        // preprocessor before dispatch, see SetPragmaRegistry()
+        struct Registry: public Callback
+        {
+            DedupMode   Dedup;
+            UnknownMode Unknown;
+            size_t      Dispatched;
+            size_t      Duplicates;
+            size_t      Unknowns;
+
+            Registry( DedupMode dedup = DEDUP_NONE, UnknownMode unknown = UNKNOWN_IGNORE );
+
+            // Handler is not owned, NULL removes
+            void Register( const std::string& name, Handler* handler );
+            void BeginRun();
+            void ClearSeen();
+            // False for unknown or already seen pragmas, which are not dispatched
+            bool Accept( const Record& record, bool& unknown );
+
+            virtual void CallPragma( const std::string& name, const Pragma::Instance& pi );
+
+        private:
+            struct SeenHash
+            {
+                size_t operator()( const std::pair<unsigned int, std::string>& seen ) const
+                {
+                    return std::hash<std::string>()( seen.second ) ^ ( seen.first * 0x9E3779B9U );
+                }
+            };
+
+            std::unordered_map<std::string, unsigned int>                            Names;     // Interned name -> index in Handlers
+            std::vector<Handler*>                                                    Handlers;
+            std::unordered_set<std::pair<unsigned int, std::string>, SeenHash>       Seen;
+        };
+    };
+
+    /************************************************************************/
+    /* Asynchronous preprocessing                                           */
+    /************************************************************************/
+
+    // Handle of PreprocessAsync() call, preprocessor must not be used until Future is ready,
+    // except by next PreprocessAsync() call which cancels this job
+    struct Job
+    {
+        struct Callback
+        {
+            virtual ~Callback() {}
+            // Called on job thread before Future becomes ready
+            virtual void JobDone( Job& job ) = 0;
         };
+
+        std::shared_future<int> Future;         // Errors count, exception thrown by Preprocess() is rethrown by get()
+        StringOutStream         Result;
+        StringOutStream         Errors;
+        std::atomic<size_t>     FilesDone;
+        std::atomic<size_t>     BytesLexed;
+        std::atomic<bool>       CancelRequested;
+        bool                    Cancelled;      // Result is empty, valid when Future is ready
+        std::promise<int>       Promise;
+
+        Job();
+
+        // Preprocessing stops at next directive, expansion, lexed line or emitted slice
+        void Cancel()     { CancelRequested = true; }
+        bool Done() const { return Future.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready; }
+    };
+
+    // Define set of PreprocessConfigurations() call and its results
+    struct Configuration
+    {
+        std::vector<std::string> Defines;       // Applied over custom defines, same format as Define()
+
+        StringOutStream          Output;
+        StringOutStream          Errors;
+        int                      ErrorsCount;
+        LineNumberTranslator     Lines;
+        std::vector<std::string> Dependencies;
+        std::vector<std::string> FilesPreprocessed;
+        std::vector<std::string> Pragmas;
+        size_t                   SharedWith;    // Index of first configuration walked to same results
+
+        Configuration() : ErrorsCount( 0 ), SharedWith( 0 ) {}
     };
 
     Preprocessor();
+    ~Preprocessor();
 
     /************************************************************************/
     /* Pre preprocess settings                                              */
@@ -228,6 +1267,17 @@ struct Preprocessor
     /************************************************************************/
 
     int Preprocess( std::string file_path, OutStream& result, OutStream* errors = NULL, FileLoader* loader = NULL, bool skip_pragmas = false );
+    // Runs Preprocess() on new thread, loader and callback must outlive the job. Job in progress is
+    // cancelled, new thread starts it once previous one is done. Destructor cancels job in progress
+    // and waits for its thread.
+    std::shared_ptr<Job> PreprocessAsync( std::string file_path, FileLoader* loader = NULL, bool skip_pragmas = false, Job::Callback* callback = NULL );
+    bool                 IsCancelled();
+    // Configurations walk files together, each file is loaded and lexed once. Every configuration has own
+    // defines, conditional stack, output and line translator, walk forks only where conditional evaluates
+    // differently or macro defined differently is expanded. Source map, statistics, profile, trace and
+    // memory budget are not used, pragma callback is called after walk for each configuration in order.
+    // Returns sum of errors count of all configurations.
+    int                  PreprocessConfigurations( std::string file_path, std::vector<Configuration>& configurations, FileLoader* loader = NULL, bool skip_pragmas = false );
 
     void        PrintMessage( const std::string& msg );
     void        PrintWarningMessage( const std::string& warnmsg );
@@ -237,7 +1287,7 @@ struct Preprocessor
 
     static std::string RemoveQuotes( const std::string& in );
     static std::string IntToString( int i );
-    static bool        SearchString( std::string str, char in );
+    static bool        SearchString( const std::string& str, char in );
     static bool        IsHex( char in );
     static bool        IsIdentifierStart( char in );
     static bool        IsIdentifierBody( char in );
@@ -250,7 +1300,12 @@ struct Preprocessor
            LLITR       ParseDefineArguments( LLITR itr, LLITR end, LexemList& lexems, std::vector<LexemList>& args );
     static char*       ParseFloatingPoint( char* start, char* end, Lexem& out );
            void        ParseIf( LexemList& directive, std::string& name_out );
-           LLITR       ParseIfDef( LLITR itr, LLITR end );
+           bool        ParseConditional( const std::string& value, LexemList& directive, ConditionalStack& conditionals, DefineTable& define_table );
+           void        UpdatePeakLexems();
+           void        ProfileMacro( const std::string& macro, size_t produced, double start_time );
+           void        ProfileEmitted( LLITR begin, LLITR end );
+           bool        EnforceBudget();
+           void        StreamFinished();
             void       ParseUndef( LexemList& directive, DefineTable& define_table );
     static char*       ParseHexConstant( char* start, char* end, Lexem& out );
     static char*       ParseIdentifier( char* start, char* end, Lexem& out );
@@ -261,7 +1316,9 @@ struct Preprocessor
     static char*       ParseStringLiteral( char* start, char* end, char quote, Lexem& out );
            LLITR       ParseStatement( LLITR itr, LLITR end, LexemList& dest );
 
-    static int         Lex( char* begin, char* end, std::list<Lexem>& results );
+    static int         Lex( char* begin, char* end, LexemList& results, unsigned int file = Lexem::NoPosition );
+    // Same result as Lex(), buffer is split at newlines and lexed by threads, 0 for hardware concurrency
+    static int         LexParallel( char* begin, char* end, LexemList& results, unsigned int file = Lexem::NoPosition, unsigned int threads = 0, Trace* trace = NULL );
            LLITR       ExpandDefine( LLITR itr, LLITR ent, LexemList& lexems, DefineTable& define_table );
            bool        ConvertExpression( LexemList& expression, LexemList& output );
            int         EvaluateConvertedExpression( DefineTable& define_table, LexemList& expr );
@@ -272,7 +1329,20 @@ struct Preprocessor
     static void        SetLineMacro( DefineTable& define_table, unsigned int line );
     static void        SetFileMacro( DefineTable& define_table, const std::string& file );
            void        RecursivePreprocess( std::string filename, FileLoader& file_source, LexemList& lexems, DefineTable& define_table );
-    static void        PrintLexemList( LexemList& out, OutStream& destination );
+
+    // State of PreprocessConfigurations() call and of configurations walking together, see preprocessor.cpp
+    struct ConfigurationWalk;
+    struct ConfigurationGroup;
+           void        WalkConfigurations( ConfigurationWalk& walk, ConfigurationGroup& group );
+           bool        IncludeConfigurationFile( ConfigurationWalk& walk, ConfigurationGroup& group, const std::string& filename );
+           void        EndConfigurationFile( ConfigurationGroup& group );
+           bool        ForkConfigurations( ConfigurationWalk& walk, ConfigurationGroup& group, const std::vector<std::string>& keys );
+    static const size_t EmitSlice = 4096;   // Lexems emitted between polls of cancellation
+    static void        PrintLexemList( LexemList& out, OutStream& destination, SourceMap* source_map = NULL );
+    // Prints part of lexem list, spacing state is carried between consecutive calls
+    static void        PrintLexems( LLITR begin, LLITR end, OutStream& destination, SourceMap* source_map, bool& need_a_space, unsigned int& column );
+    // Returns false without writing anything once *cancel is set
+    static bool        PrintTokenStream( LexemList& out, OutStream& destination, const std::vector<std::string>& files, const std::atomic<bool>* cancel = NULL );
 
     /************************************************************************/
     /* Expressions                                                          */
@@ -292,6 +1362,7 @@ struct Preprocessor
     std::vector<std::string>& GetFileDependencies();
     std::vector<std::string>& GetFilesPreprocessed();
     std::vector<std::string>& GetParsedPragmas();
+    std::vector<Pragma::Record>& GetPragmaRecords();
 
 
     Pragma::Callback* CurPragmaCallback;
@@ -299,6 +1370,77 @@ struct Preprocessor
     void SetPragmaCallback( Pragma::Callback* callback );
     void CallPragma( const std::string& name, std::string pragma );
 
+    Pragma::DispatchMode CurPragmaDispatch;
+    Pragma::Worker*      PragmaWorker;
+    Pragma::Registry*    CurPragmaRegistry;
+
+    void SetPragmaDispatch( Pragma::DispatchMode mode );
+    // Also sets registry as pragma callback, NULL disables
+    void SetPragmaRegistry( Pragma::Registry* registry );
+    void DispatchPragma( const Pragma::Record& record );
+    // Blocks until worker thread called all queued callbacks
+    void WaitPragmas();
+
+    SourceMap* CurSourceMap;
+
+    // Filled by each Preprocess() call while set, NULL disables
+    void SetSourceMap( SourceMap* source_map );
+
+    OutputFormat CurOutputFormat;
+
+    void SetOutputFormat( OutputFormat format );
+
+    Statistics* CurStatistics;
+
+    // Cleared and filled by each Preprocess() call while set, NULL disables
+    void SetStatistics( Statistics* stats );
+
+    Profile* CurProfile;
+
+    // Updated by each Preprocess() call while set, NULL disables
+    void SetProfile( Profile* profile );
+
+    Trace* CurTrace;
+
+    // Spans of each Preprocess() call are added while set, NULL disables
+    void SetTrace( Trace* trace );
+
+    MemoryContext Memory;
+
+    unsigned int LexThreads;
+    size_t       LexThreadsMinSize;
+
+    // Files of at least min_size bytes are lexed by LexParallel() as whole, 1 disables
+    void SetLexThreads( unsigned int threads, size_t min_size = 4 * 1024 * 1024 );
+
+    LexemCache* CurLexemCache;
+
+    // Files are lexed as whole and taken from cache while set, inactive regions are lexed too. NULL disables
+    void SetLexemCache( LexemCache* cache );
+
+    AllocationHook* CurAllocationHook;
+
+    // Per run lexem lists and define tables are allocated from hook while set, from RunArena otherwise
+    void SetAllocationHook( AllocationHook* hook );
+    // Cleared and filled by each Preprocess() call while set, NULL disables
+    void SetMemoryStatistics( MemoryStatistics* stats );
+
+    bool                            Reuse;
+    Arena                           RunArena;       // Reset when Preprocess() returns, chunks retained in reuse mode
+    std::vector<std::vector<char> > FileBuffers;    // Released file buffers, capacity kept
+
+    // Keeps capacity of per run containers, file buffers and line translator between
+    // Preprocess() calls, RunArena keeps its chunks
+    void SetReuse( bool reuse );
+
+    size_t MemoryBudget;
+
+    // Bytes of lexem lists, define tables and file buffers a Preprocess() call may hold, 0 disables.
+    // Finished text output is streamed to temporary file when half of it is used, buffers of including
+    // files are spilled to temporary files. Run stops with error if budget is exceeded anyway, output
+    // is written to destination only if run succeeds.
+    void SetMemoryBudget( size_t bytes );
+
     /************************************************************************/
     /*                                                                      */
     /************************************************************************/
@@ -315,6 +1457,23 @@ struct Preprocessor
     std::vector<std::string> FileDependencies;
     std::vector<std::string> FilesPreprocessed;
     std::vector<std::string> Pragmas;
+    std::vector<LexemList*>  FileLexems;
+    std::vector<LLITR*>      FileCursors;   // Lexems before cursor of each file are finished
+
+    std::unordered_set<std::string>               FileDependenciesIndex;
+    std::unordered_map<std::string, unsigned int> FilesPreprocessedIndex;
+    std::vector<unsigned int>                     TraceFileNames;   // Trace name of each GetFilesPreprocessed() entry
+    std::vector<Pragma::Record>                   PragmaRecords;
+    std::vector<Pragma::Record>                   PragmaBatch;
+    Job*                                          CurJob;
+    std::shared_ptr<Job>                          AsyncJob;     // Last PreprocessAsync() job, run by AsyncThread
+    std::thread                                   AsyncThread;
+    bool                                          Cancelled;
+    OutStream*                                    StreamDestination;
+    bool                                          StreamSpace;
+    unsigned int                                  StreamColumn;
+    bool                                          BudgetExceeded;
+    bool                                          SkipExpansions;   // Expanding #define body or #if expression, not recorded in source map
 };
 
 #endif // PREPROCESSOR_H
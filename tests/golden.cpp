@@ -0,0 +1,841 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "../preprocessor.h"
+
+// Behaviour checks, run from golden directory. Each case builds text report which
+// must match <case>/expected.txt, --update rewrites expected files instead.
+
+static std::string TempDir = ".";
+static bool        Update = false;
+
+static bool ReadFile( const std::string& path, std::string& content )
+{
+    FILE* fs = fopen( path.c_str(), "rb" );
+    if( !fs )
+        return false;
+
+    char   buffer[4096];
+    size_t n;
+    content.clear();
+    while( ( n = fread( buffer, 1, sizeof( buffer ), fs ) ) > 0 )
+        content.append( buffer, n );
+    fclose( fs );
+    return true;
+}
+
+static bool WriteFile( const std::string& path, const std::string& content )
+{
+    FILE* fs = fopen( path.c_str(), "wb" );
+    if( !fs )
+        return false;
+
+    bool ok = fwrite( content.data(), 1, content.size(), fs ) == content.size();
+    return fclose( fs ) == 0 && ok;
+}
+
+static bool Check( bool condition, const char* what )
+{
+    if( !condition )
+        fprintf( stderr, "Check failed: %s\n", what );
+    return condition;
+}
+
+static bool CompareGolden( const std::string& path, const std::string& report )
+{
+    if( Update )
+        return Check( WriteFile( path, report ), "expected file written" );
+
+    std::string expected;
+    if( !ReadFile( path, expected ) )
+    {
+        fprintf( stderr, "Unable to read <%s>\n", path.c_str() );
+        return false;
+    }
+    if( expected == report )
+        return true;
+
+    fprintf( stderr, "Output differs from <%s>\n--- expected\n%s--- actual\n%s---\n", path.c_str(), expected.c_str(), report.c_str() );
+    return false;
+}
+
+static std::string Report( Preprocessor& preprocessor, const std::string& file, Preprocessor::FileLoader* loader = NULL )
+{
+    Preprocessor::StringOutStream out, err;
+    int                           errors = preprocessor.Preprocess( file, out, &err, loader );
+    return out.String + "errors " + Preprocessor::IntToString( errors ) + "\n" + err.String;
+}
+
+static bool SameLines( const Preprocessor::LineNumberTranslator& first, const Preprocessor::LineNumberTranslator& second )
+{
+    if( first.lines.size() != second.lines.size() )
+        return false;
+    for( size_t i = 0; i < first.lines.size(); i++ )
+    {
+        if( first.lines[i].File != second.lines[i].File || first.lines[i].StartLine != second.lines[i].StartLine ||
+            first.lines[i].Offset != second.lines[i].Offset )
+            return false;
+    }
+    return true;
+}
+
+// #if/#ifdef/#ifndef/#elif/#else nesting, taken branches and misplaced directives
+static bool Conditionals()
+{
+    Preprocessor preprocessor;
+    return CompareGolden( "conditionals/expected.txt", Report( preprocessor, "conditionals/root.as" ) );
+}
+
+// Mappings are base64 VLQ, expansion chains are listed in names
+static bool SourceMapOutput()
+{
+    Preprocessor               preprocessor;
+    Preprocessor::SourceMap    source_map;
+    source_map.TrackExpansions = true;
+    preprocessor.SetSourceMap( &source_map );
+
+    std::string                report = Report( preprocessor, "sourcemap/root.as" );
+    Preprocessor::StringOutStream json;
+    source_map.PrintJSON( json, "root.out" );
+
+    Preprocessor::SourceMap::Position pos;
+    bool                              ok = Check( source_map.Find( 2, 0, pos ) && pos.Line == 2 && pos.Column == 0, "Find() of line start" );
+    return CompareGolden( "sourcemap/expected.txt", report + json.String + "\n" ) && ok;
+}
+
+// Tokens list matches text output when spaces are put between adjacent identifiers and numbers
+static bool TokenStreamOutput()
+{
+    Preprocessor                  preprocessor;
+    Preprocessor::StringOutStream text, err;
+    bool                          ok = Check( preprocessor.Preprocess( "tokens/root.as", text, &err ) == 0, "text output without errors" );
+
+    Preprocessor::StringOutStream tokens;
+    preprocessor.SetOutputFormat( Preprocessor::OUTPUT_TOKENS );
+    ok = Check( preprocessor.Preprocess( "tokens/root.as", tokens, &err ) == 0, "token output without errors" ) && ok;
+
+    // Open() needs 4-byte aligned data
+    std::vector<unsigned int>  aligned( tokens.String.size() / sizeof( unsigned int ) + 1 );
+    memcpy( &aligned[0], tokens.String.data(), tokens.String.size() );
+    Preprocessor::TokenStream  stream;
+    if( !Check( stream.Open( &aligned[0], tokens.String.size() ), "Open() of token stream" ) )
+        return false;
+
+    std::string report, rebuilt;
+    bool        need_a_space = false;
+    for( unsigned int f = 0; f < stream.Head->FileCount; f++ )
+        report += "file " + stream.GetString( stream.FileNames[f] ) + "\n";
+    for( unsigned int i = 0; i < stream.Head->TokenCount; i++ )
+    {
+        const Preprocessor::TokenStream::Token& token = stream.Tokens[i];
+        std::string                             value = stream.GetString( token.Value );
+        bool                                    word = ( token.Type == Preprocessor::Lexem::IDENTIFIER || token.Type == Preprocessor::Lexem::NUMBER );
+        rebuilt += ( word && need_a_space ? " " : "" ) + value;
+        need_a_space = word;
+
+        char position[64];
+        snprintf( position, sizeof( position ), "%u %d:%u:%u ", token.Type, (int) token.File, token.Line, token.Column );
+        report += position + ( value == "\n" ? std::string( "\\n" ) : value ) + "\n";
+    }
+    ok = Check( rebuilt == text.String, "tokens rebuild text output" ) && ok;
+    return CompareGolden( "tokens/expected.txt", report ) && ok;
+}
+
+// Files stored in archive preprocess as loose ones
+static bool Archive()
+{
+    std::map<std::string, std::string> files;
+    const char*                        names[] = { "conditionals/root.as", "conditionals/inc.as" };
+    for( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); i++ )
+    {
+        if( !Check( ReadFile( names[i], files[names[i]] ), "conditionals input read" ) )
+            return false;
+    }
+
+    std::string                 path = TempDir + "/golden.asa";
+    Preprocessor::ArchiveLoader archive;
+    if( !Check( Preprocessor::ArchiveLoader::Build( path, files ) && archive.Open( path ), "archive built and opened" ) )
+        return false;
+
+    bool                        ok = true;
+    for( std::map<std::string, std::string>::iterator it = files.begin(); it != files.end(); ++it )
+    {
+        const char* data;
+        size_t      size;
+        ok = Check( archive.Find( it->first, data, size ) && std::string( data, size ) == it->second, "Find() of stored file" ) && ok;
+    }
+    const char* data;
+    size_t      size;
+    ok = Check( !archive.Find( "conditionals/absent.as", data, size ), "Find() of missing file" ) && ok;
+
+    Preprocessor preprocessor;
+    std::string  report = Report( preprocessor, "conditionals/root.as", &archive );
+    archive.Close();
+    remove( path.c_str() );
+    return CompareGolden( "conditionals/expected.txt", report ) && ok;
+}
+
+// Segment shared by roots is stored once, outputs survive save and load
+static bool OutputStoreRoundTrip()
+{
+    Preprocessor               preprocessor;
+    Preprocessor::OutputStore  store;
+    std::vector<std::string>   outputs;
+    const char*                roots[] = { "outputstore/a.as", "outputstore/b.as" };
+    bool                       ok = true;
+    for( size_t i = 0; i < sizeof( roots ) / sizeof( roots[0] ); i++ )
+    {
+        Preprocessor::StringOutStream out, err;
+        ok = Check( preprocessor.Preprocess( roots[i], out, &err ) == 0, "root preprocessed" ) && ok;
+        ok = Check( store.Add( out.String, preprocessor.GetLineNumberTranslator() ) == i, "root index" ) && ok;
+        outputs.push_back( out.String );
+    }
+    ok = Check( store.GetUniqueSize() < store.GetTotalSize(), "shared segment stored once" ) && ok;
+
+    std::string                path = TempDir + "/golden.aso";
+    Preprocessor::OutputStore  loaded;
+    ok = Check( store.Save( path ) && loaded.Load( path ), "store saved and loaded" ) && ok;
+    remove( path.c_str() );
+    for( size_t i = 0; i < outputs.size(); i++ )
+    {
+        Preprocessor::StringOutStream out, out_loaded;
+        store.Write( i, out );
+        loaded.Write( i, out_loaded );
+        ok = Check( out.String == outputs[i] && out_loaded.String == outputs[i], "root written back" ) && ok;
+        ok = Check( store.GetSize( i ) == outputs[i].size(), "GetSize() of root" ) && ok;
+    }
+    return ok;
+}
+
+// Keeps lexems of every file stored, content is not checked
+struct MapLexemCache: public Preprocessor::LexemCache
+{
+    std::map<std::string, Preprocessor::LexemList> Files;
+    size_t                                         Hits;
+
+    MapLexemCache() : Hits( 0 ) {}
+
+    virtual bool Load( const std::string& path, const char* /*data*/, size_t /*size*/, Preprocessor::LexemList& lexems )
+    {
+        std::map<std::string, Preprocessor::LexemList>::iterator it = Files.find( path );
+        if( it == Files.end() )
+            return false;
+        lexems.insert( lexems.end(), it->second.begin(), it->second.end() );
+        Hits++;
+        return true;
+    }
+
+    virtual void Store( const std::string& path, const char* /*data*/, size_t /*size*/, const Preprocessor::LexemList& lexems )
+    {
+        Files[path] = lexems;
+    }
+};
+
+// Files lexed as whole and taken from cache preprocess as lazily lexed ones
+static bool LexemCacheRuns()
+{
+    Preprocessor  preprocessor;
+    MapLexemCache cache;
+    preprocessor.SetReuse( true );
+    preprocessor.SetLexemCache( &cache );
+
+    std::string   first = Report( preprocessor, "conditionals/root.as" );
+    bool          ok = Check( cache.Hits == 0 && cache.Files.size() == 2, "files stored by first run" );
+    std::string   second = Report( preprocessor, "conditionals/root.as" );
+    ok = Check( cache.Hits == 2, "files loaded by second run" ) && ok;
+    ok = Check( first == second, "cached run output" ) && ok;
+    return CompareGolden( "conditionals/expected.txt", second ) && ok;
+}
+
+// Lexems stored through one attachment are loaded through another one, mapped elsewhere
+static bool SharedCacheLexems()
+{
+    std::string                   name = "asp-golden-" + Preprocessor::IntToString( (int) time( NULL ) % 100000 );
+    Preprocessor::SharedFileCache writer, reader;
+    if( !writer.Open( name, 1024 * 1024, 64 ) || !reader.Open( name ) )
+    {
+        Preprocessor::SharedFileCache::Remove( name );
+        fprintf( stdout, "Shared memory is not available, case skipped\n" );
+        return true;
+    }
+
+    Preprocessor             first, second;
+    Preprocessor::Statistics stats;
+    first.SetLexemCache( &writer );
+    second.SetLexemCache( &reader );
+    second.SetStatistics( &stats );
+    std::string report = Report( first, "conditionals/root.as", &writer );
+    bool        ok = Check( report == Report( second, "conditionals/root.as", &reader ), "output of cached lexems" );
+    ok = Check( stats.LexemsLexed == 0, "no file lexed again" ) && ok;
+
+    writer.Close();
+    reader.Close();
+    Preprocessor::SharedFileCache::Remove( name );
+    return CompareGolden( "conditionals/expected.txt", report ) && ok;
+}
+
+// Results of single call equal separate Preprocess() runs with same defines, configurations
+// differing only by unused define are walked once
+static bool Configurations()
+{
+    const char* sets[][2] = { { "SERVER", "DEBUG" }, { "SERVER", "" }, { "CLIENT", "DEBUG" }, { "CLIENT", "" }, { "UNUSED 1", "" },
+                              { "CLIENT", "UNUSED 1" }, { "SERVER", "TIMEOUT 9" } };
+    size_t      count = sizeof( sets ) / sizeof( sets[0] );
+
+    std::vector<Preprocessor::Configuration> configurations( count );
+    for( size_t i = 0; i < count; i++ )
+    {
+        for( int d = 0; d < 2; d++ )
+        {
+            if( *sets[i][d] )
+                configurations[i].Defines.push_back( sets[i][d] );
+        }
+    }
+
+    Preprocessor preprocessor;
+    preprocessor.PreprocessConfigurations( "configurations/root.as", configurations );
+
+    std::string  report;
+    bool         ok = true;
+    for( size_t i = 0; i < count; i++ )
+    {
+        Preprocessor::Configuration&  config = configurations[i];
+        Preprocessor                  single;
+        for( size_t d = 0; d < config.Defines.size(); d++ )
+            single.Define( config.Defines[d] );
+        std::string                   expected = Report( single, "configurations/root.as" );
+
+        ok = Check( config.Output.String + "errors " + Preprocessor::IntToString( config.ErrorsCount ) + "\n" + config.Errors.String == expected,
+                    "output and errors of configuration" ) && ok;
+        ok = Check( config.Dependencies == single.GetFileDependencies() && config.FilesPreprocessed == single.GetFilesPreprocessed(),
+                    "files of configuration" ) && ok;
+        ok = Check( SameLines( config.Lines, *single.GetLineNumberTranslator() ), "line numbers of configuration" ) && ok;
+
+        report += "== " + std::string( sets[i][0] ) + " " + sets[i][1] + "\n" + expected;
+    }
+    ok = Check( configurations[5].SharedWith == configurations[3].SharedWith, "walk shared by unused define" ) && ok;
+    ok = Check( configurations[6].SharedWith != configurations[1].SharedWith, "walk forked by differing expansion" ) && ok;
+    return CompareGolden( "configurations/expected.txt", report ) && ok;
+}
+
+// Lexem lists and define tables of run come from its arena, lex workers carve blocks of it
+static bool RunArenaRuns()
+{
+    Preprocessor                   serial, parallel;
+    Preprocessor::MemoryStatistics stats;
+    parallel.SetLexThreads( 4, 1 );
+    parallel.SetReuse( true );
+    parallel.SetMemoryStatistics( &stats );
+
+    std::string report = Report( serial, "conditionals/root.as" );
+    bool        ok = Check( serial.RunArena.Capacity == 0, "arena released after run" );
+    ok = Check( report == Report( parallel, "conditionals/root.as" ), "output of parallel lexing" ) && ok;
+    ok = Check( parallel.RunArena.Capacity > 0 && stats.Peak[Preprocessor::MemoryContext::MEMORY_LEXEMS] > 0, "lexems taken from retained arena" ) && ok;
+    ok = Check( stats.Current[Preprocessor::MemoryContext::MEMORY_LEXEMS] == 0 && stats.Current[Preprocessor::MemoryContext::MEMORY_DEFINES] == 0,
+                "allocations of workers returned" ) && ok;
+    return CompareGolden( "conditionals/expected.txt", report ) && ok;
+}
+
+// Heap allocations are counted where they happen, retained arena chunks and file buffers are not taken again
+static bool MemoryCounts()
+{
+    typedef Preprocessor::MemoryContext MC;
+    Preprocessor                   preprocessor;
+    Preprocessor::MemoryStatistics stats;
+    preprocessor.SetReuse( true );
+    preprocessor.SetMemoryStatistics( &stats );
+
+    std::string report = Report( preprocessor, "conditionals/root.as" );
+    size_t      first = stats.HeapAllocations;
+    bool        ok = Check( first > 0 && stats.Peak[MC::MEMORY_FILES] > 0 && stats.Peak[MC::MEMORY_LINES] > 0, "heap, file and line counts" );
+    ok = Check( stats.Peak[MC::MEMORY_LINES] == preprocessor.GetLineNumberTranslator()->lines.capacity() * sizeof( Preprocessor::LineNumberTranslator::Entry ),
+                "line entries tracked while growing" ) && ok;
+
+    stats.ForbidAllocations = true;
+    std::string again = Report( preprocessor, "conditionals/root.as" );
+    ok = Check( stats.HeapAllocations < first && stats.ForbiddenAllocations == stats.HeapAllocations, "steady state heap allocations forbidden" ) && ok;
+    ok = Check( ( again.find( "heap allocations while allocations are forbidden" ) != std::string::npos ) == ( stats.HeapAllocations > 0 ),
+                "forbidden allocations reported" ) && ok;
+    return CompareGolden( "conditionals/expected.txt", report ) && ok;
+}
+
+// Holds loading until released
+struct GateLoader: public Preprocessor::FileLoader
+{
+    std::mutex              Lock;
+    std::condition_variable Changed;
+    bool                    Entered;
+    bool                    Open;
+
+    GateLoader() : Entered( false ), Open( false ) {}
+
+    virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+    {
+        {
+            std::unique_lock<std::mutex> lock( Lock );
+            Entered = true;
+            Changed.notify_all();
+            Changed.wait( lock, [this]() { return Open; } );
+        }
+        return FileLoader::LoadFile( dir, file_name, data );
+    }
+
+    void WaitEntered()
+    {
+        std::unique_lock<std::mutex> lock( Lock );
+        Changed.wait( lock, [this]() { return Entered; } );
+    }
+
+    void Release()
+    {
+        std::lock_guard<std::mutex> lock( Lock );
+        Open = true;
+        Changed.notify_all();
+    }
+};
+
+// Cancellation is seen after file was lexed as whole, next job cancels previous one without waiting for it
+static bool AsyncJobs()
+{
+    Preprocessor                  preprocessor;
+    Preprocessor::StringOutStream serial;
+    preprocessor.Preprocess( "sourcemap/root.as", serial );
+    preprocessor.SetLexThreads( 2, 1 );
+
+    GateLoader                          lexed;
+    Preprocessor::Statistics           stats;
+    preprocessor.SetStatistics( &stats );
+    std::shared_ptr<Preprocessor::Job> job = preprocessor.PreprocessAsync( "sourcemap/root.as", &lexed );
+    lexed.WaitEntered();
+    job->Cancel();
+    lexed.Release();
+    job->Future.get();
+    preprocessor.SetStatistics( NULL );
+    bool ok = Check( job->Cancelled && job->Result.String.empty(), "job cancelled" );
+    ok = Check( stats.LexemsLexed > 0 && stats.MacroLookups == 0 && stats.IfEvaluations == 0, "no directive or expansion after cancel" ) && ok;
+
+    GateLoader                          blocked;
+    std::shared_ptr<Preprocessor::Job> first = preprocessor.PreprocessAsync( "sourcemap/root.as", &blocked );
+    blocked.WaitEntered();
+    std::shared_ptr<Preprocessor::Job> second = preprocessor.PreprocessAsync( "sourcemap/root.as" );
+    ok = Check( !first->Done() && !second->Done(), "second job started while first one is blocked" ) && ok;
+    blocked.Release();
+    second->Future.get();
+    ok = Check( first->Done() && first->Cancelled && first->Result.String.empty(), "first job cancelled" ) && ok;
+    ok = Check( !second->Cancelled && second->Result.String == serial.String, "second job output" ) && ok;
+    return ok;
+}
+
+// Lexer state at start of each line: c code, m block comment, s string, h character literal
+static std::string LineStates( const std::vector<char>& data )
+{
+    std::string states( 1, 'c' );
+    char        state = 'c';
+    for( size_t i = 0; i < data.size(); i++ )
+    {
+        char c = data[i], next = ( i + 1 < data.size() ? data[i + 1] : 0 );
+        if( c == '\n' )
+            states += ( state == 'h' ? 'c' : state );
+        if( state == 'c' )
+        {
+            if( c == '"' )
+                state = 's';
+            else if( c == '\'' )
+                state = 'h';
+            else if( c == '/' && next == '/' )
+            {
+                while( i + 1 < data.size() && data[i + 1] != '\n' )
+                    i++;
+            }
+            else if( c == '/' && next == '*' )
+            {
+                state = 'm';
+                i++;
+            }
+        }
+        else if( state == 'm' )
+        {
+            if( c == '*' && next == '/' )
+            {
+                state = 'c';
+                i++;
+            }
+        }
+        else if( c == '\\' && next )
+            i++;
+        else if( c == ( state == 's' ? '"' : '\'' ) || ( state == 'h' && c == '\n' ) )
+            state = 'c';
+    }
+    return states;
+}
+
+// LexParallel() matches Lex() in value, type, line and column wherever chunk bounds fall,
+// report lists line and state at start of each chunk after first one
+static bool LexParallelChunks()
+{
+    std::vector<char>        data;
+    Preprocessor::FileLoader loader;
+    if( !Check( loader.LoadFile( "./", "lexparallel/root.as", data ) && !data.empty(), "fixture loaded" ) )
+        return false;
+
+    Preprocessor::LexemList serial;
+    Preprocessor::Lex( &data[0], &data[0] + data.size(), serial, 0 );
+    std::string             states = LineStates( data );
+    std::string             report = "lexems " + Preprocessor::IntToString( (int) serial.size() ) + "\n";
+    bool                    ok = true;
+    for( unsigned int threads = 2; threads <= 24; threads++ )
+    {
+        Preprocessor::LexemList parallel;
+        Preprocessor::LexParallel( &data[0], &data[0] + data.size(), parallel, 0, threads );
+
+        size_t                            index = 0;
+        Preprocessor::LexemList::iterator a = serial.begin(), b = parallel.begin();
+        for( ; a != serial.end() && b != parallel.end(); ++a, ++b, ++index )
+        {
+            if( a->Value != b->Value || a->Type != b->Type || a->Line != b->Line || a->Column != b->Column || a->File != b->File )
+                break;
+        }
+        if( a != serial.end() || b != parallel.end() )
+        {
+            fprintf( stderr, "threads %u: lexem %u differs\n", threads, (unsigned int) index );
+            ok = false;
+        }
+
+        // Chunk bounds as LexParallel() picks them
+        std::string  starts;
+        const char*  begin = &data[0];
+        const char*  end = begin + data.size();
+        const char*  bound = begin;
+        size_t       chunk_size = data.size() / threads + 1;
+        while( (size_t) ( end - bound ) > chunk_size )
+        {
+            const char* newline = (const char*) memchr( bound + chunk_size, '\n', end - bound - chunk_size );
+            if( !newline || newline + 1 == end )
+                break;
+            bound = newline + 1;
+            int line = (int) std::count( begin, bound, '\n' );
+            starts += " " + Preprocessor::IntToString( line ) + states[line];
+        }
+        report += "threads " + Preprocessor::IntToString( (int) threads ) + starts + "\n";
+    }
+    ok = Check( states.find( 'm', 1 ) != std::string::npos && states.find( 's', 1 ) != std::string::npos, "fixture has lines inside comment and string" ) && ok;
+    return CompareGolden( "lexparallel/expected.txt", report ) && ok;
+}
+
+// Small budget streams output and spills including file with output of unbudgeted run,
+// too small one fails after some output was streamed and writes none of it
+static bool MemoryBudget()
+{
+    Preprocessor             unbudgeted, budgeted, exceeded;
+    Preprocessor::Statistics full, streamed;
+    unbudgeted.SetStatistics( &full );
+    budgeted.SetStatistics( &streamed );
+    budgeted.SetMemoryBudget( 12 * 1024 );
+    exceeded.SetMemoryBudget( 4 * 1024 );
+
+    std::string report = Report( unbudgeted, "budget/root.as" );
+    bool        ok = Check( Report( budgeted, "budget/root.as" ) == report, "budgeted output" );
+    ok = Check( streamed.BytesSpilled > 0 && streamed.PeakLexems < full.PeakLexems, "buffer spilled and output streamed" ) && ok;
+
+    Preprocessor::StringOutStream out, err;
+    ok = Check( exceeded.Preprocess( "budget/root.as", out, &err ) > 0 && out.String.empty() &&
+                err.String.find( "Memory budget of 4 KB exceeded." ) != std::string::npos, "exceeded budget fails without output" ) && ok;
+    return CompareGolden( "budget/expected.txt", report ) && ok;
+}
+
+// Logs requests of preprocessor and submissions of prefetch loader in order
+struct LoggingAsyncLoader: public Preprocessor::AsyncFileLoader, public Preprocessor::FileLoader
+{
+    Preprocessor::AsyncFileLoader* Async;
+    Preprocessor::FileLoader*      Loader;
+    std::vector<std::string>       Log;
+
+    LoggingAsyncLoader( Preprocessor::AsyncFileLoader* async ) : Async( async ), Loader( NULL ) {}
+
+    virtual unsigned int Submit( const std::string& dir, const std::string& file_name )
+    {
+        Log.push_back( "submit " + dir + file_name );
+        return Async->Submit( dir, file_name );
+    }
+    virtual void Flush()                                                       { Async->Flush(); }
+    virtual bool Wait( Preprocessor::AsyncFileLoader::Completion& completion ) { return Async->Wait( completion ); }
+
+    virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+    {
+        Log.push_back( "load " + dir + file_name );
+        return Loader->LoadFile( dir, file_name, data );
+    }
+
+    size_t Find( const std::string& entry ) const
+    {
+        return std::find( Log.begin(), Log.end(), entry ) - Log.begin();
+    }
+};
+
+// Roots preprocessed through PrefetchLoader over both backends give reports of plain FileLoader,
+// includes are submitted before preprocessor asks for them
+static bool PrefetchLoads()
+{
+    static const char* roots[] = { "conditionals/root.as", "configurations/root.as", "budget/root.as" };
+    Preprocessor       plain;
+    std::string        expected;
+    for( size_t i = 0; i < sizeof( roots ) / sizeof( roots[0] ); i++ )
+        expected += Report( plain, roots[i] );
+
+    Preprocessor::ThreadPoolFileLoader pool( 2 );
+    Preprocessor::UringFileLoader      uring;
+    Preprocessor::AsyncFileLoader*     backends[] = { &pool, uring.Open( 16 ) ? &uring : NULL };
+    const char*                        names[] = { "thread pool", "io_uring" };
+    bool                               ok = true;
+    for( size_t b = 0; b < 2; b++ )
+    {
+        if( !backends[b] )
+        {
+            fprintf( stderr, "%s not available, skipped\n", names[b] );
+            continue;
+        }
+        LoggingAsyncLoader           logging( backends[b] );
+        Preprocessor::PrefetchLoader prefetch( &logging );
+        logging.Loader = &prefetch;
+
+        Preprocessor preprocessor;
+        std::string  report;
+        for( size_t i = 0; i < sizeof( roots ) / sizeof( roots[0] ); i++ )
+        {
+            report += Report( preprocessor, roots[i], &logging );
+            prefetch.Clear();
+        }
+        if( report != expected )
+        {
+            fprintf( stderr, "%s: output differs from FileLoader\n", names[b] );
+            ok = false;
+        }
+        ok = Check( logging.Find( "submit conditionals/inc.as" ) < logging.Find( "load conditionals/inc.as" ) &&
+                    logging.Find( "load conditionals/inc.as" ) < logging.Log.size(), "include read ahead" ) && ok;
+    }
+    return ok;
+}
+
+static void MakeDir( const std::string& path )
+{
+    #if defined(_WIN32)
+    _mkdir( path.c_str() );
+    #else
+    mkdir( path.c_str(), 0777 );
+    #endif
+}
+
+static void RemoveDir( const std::string& path )
+{
+    #if defined(_WIN32)
+    _rmdir( path.c_str() );
+    #else
+    rmdir( path.c_str() );
+    #endif
+}
+
+// Watcher thread sees changes asynchronously
+static bool WaitDirty( Preprocessor::FileWatcher& watcher, const std::string& path )
+{
+    for( int i = 0; i < 5000 && !watcher.IsDirty( path ); i++ )
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    return watcher.IsDirty( path );
+}
+
+// Holds watcher thread in callback while armed, so its event queue overflows
+struct BlockingListener: public Preprocessor::FileWatcher::Listener
+{
+    std::mutex              Lock;
+    std::condition_variable Changed;
+    bool                    Armed;
+    bool                    Entered;
+
+    BlockingListener() : Armed( false ), Entered( false ) {}
+
+    virtual void FilesChanged( const std::vector<std::string>& /*paths*/ )
+    {
+        std::unique_lock<std::mutex> lock( Lock );
+        if( !Armed )
+            return;
+        Entered = true;
+        Changed.notify_all();
+        Changed.wait( lock, [this]() { return !Armed; } );
+    }
+
+    void Arm()
+    {
+        std::lock_guard<std::mutex> lock( Lock );
+        Armed = true;
+        Entered = false;
+    }
+
+    void WaitEntered()
+    {
+        std::unique_lock<std::mutex> lock( Lock );
+        Changed.wait( lock, [this]() { return Entered; } );
+    }
+
+    void Release()
+    {
+        std::lock_guard<std::mutex> lock( Lock );
+        Armed = false;
+        Changed.notify_all();
+    }
+};
+
+// Modified, deleted and recreated files get dirty and dropped from stat cache, removed directory
+// is watched again, lost events make every watched file dirty
+static bool WatchedFiles()
+{
+    std::string                 dir = TempDir + "/watched/";
+    std::string                 a = dir + "a.as", b = dir + "b.as";
+    Preprocessor::StatCache     stats;
+    BlockingListener            listener;
+    Preprocessor::FileWatcher   watcher( &stats, &listener );
+    if( !watcher.Open() )
+    {
+        fprintf( stdout, "inotify is not available, case skipped\n" );
+        return true;
+    }
+
+    MakeDir( dir );
+    WriteFile( a, "int a;\n" );
+    WriteFile( b, "int b;\n" );
+    std::vector<std::string> files;
+    files.push_back( a );
+    files.push_back( b );
+    bool ok = Check( watcher.Watch( files ), "directory watched" );
+
+    Preprocessor::StatCache::Entry entry;
+    stats.Get( a, entry );
+    unsigned int calls = stats.GetStatCalls();
+    ok = Check( stats.Get( a, entry ) && stats.GetStatCalls() == calls, "stat cached" ) && ok;
+
+    unsigned int generation = watcher.GetGeneration();
+    WriteFile( a, "int a = 1;\n" );
+    ok = Check( WaitDirty( watcher, a ) && !watcher.IsDirty( b ) && watcher.GetGeneration() != generation, "modified file dirty" ) && ok;
+    ok = Check( stats.Get( a, entry ) && entry.Size == 11 && stats.GetStatCalls() == calls + 1, "modified file invalidated" ) && ok;
+    std::vector<std::string> dirty;
+    watcher.TakeDirty( dirty );
+    ok = Check( dirty.size() == 1 && dirty[0] == a && !watcher.IsDirty( a ), "dirty set taken" ) && ok;
+
+    remove( a.c_str() );
+    ok = Check( WaitDirty( watcher, a ) && !stats.Get( a, entry ), "deleted file dirty" ) && ok;
+    watcher.TakeDirty( dirty );
+    WriteFile( a, "int a;\n" );
+    ok = Check( WaitDirty( watcher, a ) && stats.Get( a, entry ) && entry.Size == 7, "recreated file dirty" ) && ok;
+    watcher.TakeDirty( dirty );
+
+    // IN_IGNORED of removed directory lets Watch() add it again
+    remove( a.c_str() );
+    remove( b.c_str() );
+    WaitDirty( watcher, b );
+    watcher.TakeDirty( dirty );
+    RemoveDir( dir );
+    ok = Check( WaitDirty( watcher, b ), "files of removed directory dirty" ) && ok;
+    watcher.TakeDirty( dirty );
+    MakeDir( dir );
+    WriteFile( a, "int a;\n" );
+    ok = Check( watcher.Watch( files ), "recreated directory watched" ) && ok;
+    WriteFile( a, "int a = 2;\n" );
+    ok = Check( WaitDirty( watcher, a ), "file in recreated directory dirty" ) && ok;
+    watcher.TakeDirty( dirty );
+
+    // IN_Q_OVERFLOW while watcher thread is held, b is not touched
+    std::string max_events;
+    if( ReadFile( "/proc/sys/fs/inotify/max_queued_events", max_events ) )
+    {
+        listener.Arm();
+        WriteFile( a, "int a = 3;\n" );
+        listener.WaitEntered();
+        int count = atoi( max_events.c_str() ) / 2 + 16;
+        for( int i = 0; i < count; i++ )
+            WriteFile( dir + "f" + Preprocessor::IntToString( i ), "" );
+        for( int i = 0; i < count; i++ )
+            remove( ( dir + "f" + Preprocessor::IntToString( i ) ).c_str() );
+        listener.Release();
+        ok = Check( WaitDirty( watcher, b ), "every file dirty after lost events" ) && ok;
+    }
+
+    watcher.Close();
+    remove( a.c_str() );
+    RemoveDir( dir );
+    return ok;
+}
+
+struct Case
+{
+    const char* Name;
+    bool        (* Run)();
+};
+
+static const Case Cases[] =
+{
+    { "conditionals",   Conditionals },
+    { "sourcemap",      SourceMapOutput },
+    { "tokenstream",    TokenStreamOutput },
+    { "archive",        Archive },
+    { "outputstore",    OutputStoreRoundTrip },
+    { "lexemcache",     LexemCacheRuns },
+    { "sharedcache",    SharedCacheLexems },
+    { "configurations", Configurations },
+    { "arena",          RunArenaRuns },
+    { "memory",         MemoryCounts },
+    { "async",          AsyncJobs },
+    { "lexparallel",    LexParallelChunks },
+    { "budget",         MemoryBudget },
+    { "prefetch",       PrefetchLoads },
+    { "watcher",        WatchedFiles },
+};
+
+int main( int argc, char** argv )
+{
+    const char* filter = NULL;
+    for( int i = 1; i < argc; i++ )
+    {
+        if( !strcmp( argv[i], "--update" ) )
+            Update = true;
+        else if( !strcmp( argv[i], "--temp" ) && i + 1 < argc )
+            TempDir = argv[++i];
+        else
+            filter = argv[i];
+    }
+
+    int failed = 0;
+    for( size_t i = 0; i < sizeof( Cases ) / sizeof( Cases[0] ); i++ )
+    {
+        const Case& c = Cases[i];
+        if( filter && strcmp( c.Name, filter ) )
+            continue;
+
+        bool ok = c.Run();
+        fprintf( stdout, "%-4s %s\n", ok ? "OK" : "FAIL", c.Name );
+        if( !ok )
+            failed++;
+    }
+
+    if( failed )
+    {
+        fprintf( stderr, "%d case(s) failed\n", failed );
+        return( EXIT_FAILURE );
+    }
+    return( EXIT_SUCCESS );
+}
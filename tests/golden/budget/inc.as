@@ -0,0 +1,81 @@
+#define INC_0 0
+float inc_0 = INC_0 * 0.5 + 0; /* included line 0 */
+float inc_1 = INC_0 * 0.5 + 1; /* included line 1 */
+float inc_2 = INC_0 * 0.5 + 2; /* included line 2 */
+float inc_3 = INC_0 * 0.5 + 3; /* included line 3 */
+float inc_4 = INC_0 * 0.5 + 4; /* included line 4 */
+float inc_5 = INC_0 * 0.5 + 5; /* included line 5 */
+float inc_6 = INC_0 * 0.5 + 6; /* included line 6 */
+float inc_7 = INC_0 * 0.5 + 7; /* included line 7 */
+#define INC_8 8
+float inc_8 = INC_8 * 0.5 + 8; /* included line 8 */
+float inc_9 = INC_8 * 0.5 + 9; /* included line 9 */
+float inc_10 = INC_8 * 0.5 + 10; /* included line 10 */
+float inc_11 = INC_8 * 0.5 + 11; /* included line 11 */
+float inc_12 = INC_8 * 0.5 + 12; /* included line 12 */
+float inc_13 = INC_8 * 0.5 + 13; /* included line 13 */
+float inc_14 = INC_8 * 0.5 + 14; /* included line 14 */
+float inc_15 = INC_8 * 0.5 + 15; /* included line 15 */
+#define INC_16 16
+float inc_16 = INC_16 * 0.5 + 16; /* included line 16 */
+float inc_17 = INC_16 * 0.5 + 17; /* included line 17 */
+float inc_18 = INC_16 * 0.5 + 18; /* included line 18 */
+float inc_19 = INC_16 * 0.5 + 19; /* included line 19 */
+float inc_20 = INC_16 * 0.5 + 20; /* included line 20 */
+float inc_21 = INC_16 * 0.5 + 21; /* included line 21 */
+float inc_22 = INC_16 * 0.5 + 22; /* included line 22 */
+float inc_23 = INC_16 * 0.5 + 23; /* included line 23 */
+#define INC_24 24
+float inc_24 = INC_24 * 0.5 + 24; /* included line 24 */
+float inc_25 = INC_24 * 0.5 + 25; /* included line 25 */
+float inc_26 = INC_24 * 0.5 + 26; /* included line 26 */
+float inc_27 = INC_24 * 0.5 + 27; /* included line 27 */
+float inc_28 = INC_24 * 0.5 + 28; /* included line 28 */
+float inc_29 = INC_24 * 0.5 + 29; /* included line 29 */
+float inc_30 = INC_24 * 0.5 + 30; /* included line 30 */
+float inc_31 = INC_24 * 0.5 + 31; /* included line 31 */
+#define INC_32 32
+float inc_32 = INC_32 * 0.5 + 32; /* included line 32 */
+float inc_33 = INC_32 * 0.5 + 33; /* included line 33 */
+float inc_34 = INC_32 * 0.5 + 34; /* included line 34 */
+float inc_35 = INC_32 * 0.5 + 35; /* included line 35 */
+float inc_36 = INC_32 * 0.5 + 36; /* included line 36 */
+float inc_37 = INC_32 * 0.5 + 37; /* included line 37 */
+float inc_38 = INC_32 * 0.5 + 38; /* included line 38 */
+float inc_39 = INC_32 * 0.5 + 39; /* included line 39 */
+#define INC_40 40
+float inc_40 = INC_40 * 0.5 + 40; /* included line 40 */
+float inc_41 = INC_40 * 0.5 + 41; /* included line 41 */
+float inc_42 = INC_40 * 0.5 + 42; /* included line 42 */
+float inc_43 = INC_40 * 0.5 + 43; /* included line 43 */
+float inc_44 = INC_40 * 0.5 + 44; /* included line 44 */
+float inc_45 = INC_40 * 0.5 + 45; /* included line 45 */
+float inc_46 = INC_40 * 0.5 + 46; /* included line 46 */
+float inc_47 = INC_40 * 0.5 + 47; /* included line 47 */
+#define INC_48 48
+float inc_48 = INC_48 * 0.5 + 48; /* included line 48 */
+float inc_49 = INC_48 * 0.5 + 49; /* included line 49 */
+float inc_50 = INC_48 * 0.5 + 50; /* included line 50 */
+float inc_51 = INC_48 * 0.5 + 51; /* included line 51 */
+float inc_52 = INC_48 * 0.5 + 52; /* included line 52 */
+float inc_53 = INC_48 * 0.5 + 53; /* included line 53 */
+float inc_54 = INC_48 * 0.5 + 54; /* included line 54 */
+float inc_55 = INC_48 * 0.5 + 55; /* included line 55 */
+#define INC_56 56
+float inc_56 = INC_56 * 0.5 + 56; /* included line 56 */
+float inc_57 = INC_56 * 0.5 + 57; /* included line 57 */
+float inc_58 = INC_56 * 0.5 + 58; /* included line 58 */
+float inc_59 = INC_56 * 0.5 + 59; /* included line 59 */
+float inc_60 = INC_56 * 0.5 + 60; /* included line 60 */
+float inc_61 = INC_56 * 0.5 + 61; /* included line 61 */
+float inc_62 = INC_56 * 0.5 + 62; /* included line 62 */
+float inc_63 = INC_56 * 0.5 + 63; /* included line 63 */
+#define INC_64 64
+float inc_64 = INC_64 * 0.5 + 64; /* included line 64 */
+float inc_65 = INC_64 * 0.5 + 65; /* included line 65 */
+float inc_66 = INC_64 * 0.5 + 66; /* included line 66 */
+float inc_67 = INC_64 * 0.5 + 67; /* included line 67 */
+float inc_68 = INC_64 * 0.5 + 68; /* included line 68 */
+float inc_69 = INC_64 * 0.5 + 69; /* included line 69 */
+float inc_70 = INC_64 * 0.5 + 70; /* included line 70 */
+float inc_71 = INC_64 * 0.5 + 71; /* included line 71 */
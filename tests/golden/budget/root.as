@@ -0,0 +1,30 @@
+// Streamed and spilled under small memory budget, same output as without budget
+#define SCALE #( x ) ( x ) * 3
+#define ROOT_0 0
+int root_0 = SCALE( ROOT_0 ) + 0; // value 0
+int root_1 = SCALE( ROOT_0 ) + 1; // value 1
+int root_2 = SCALE( ROOT_0 ) + 2; // value 2
+int root_3 = SCALE( ROOT_0 ) + 3; // value 3
+int root_4 = SCALE( ROOT_0 ) + 4; // value 4
+int root_5 = SCALE( ROOT_0 ) + 5; // value 5
+int root_6 = SCALE( ROOT_0 ) + 6; // value 6
+int root_7 = SCALE( ROOT_0 ) + 7; // value 7
+#define ROOT_8 8
+int root_8 = SCALE( ROOT_8 ) + 8; // value 8
+int root_9 = SCALE( ROOT_8 ) + 9; // value 9
+int root_10 = SCALE( ROOT_8 ) + 10; // value 10
+int root_11 = SCALE( ROOT_8 ) + 11; // value 11
+int root_12 = SCALE( ROOT_8 ) + 12; // value 12
+#include "inc.as"
+int root_13 = SCALE( ROOT_8 ) + 13; // value 13
+int root_14 = SCALE( ROOT_8 ) + 14; // value 14
+int root_15 = SCALE( ROOT_8 ) + 15; // value 15
+#define ROOT_16 16
+int root_16 = SCALE( ROOT_16 ) + 16; // value 16
+int root_17 = SCALE( ROOT_16 ) + 17; // value 17
+int root_18 = SCALE( ROOT_16 ) + 18; // value 18
+int root_19 = SCALE( ROOT_16 ) + 19; // value 19
+int root_20 = SCALE( ROOT_16 ) + 20; // value 20
+int root_21 = SCALE( ROOT_16 ) + 21; // value 21
+int root_22 = SCALE( ROOT_16 ) + 22; // value 22
+int root_23 = SCALE( ROOT_16 ) + 23; // value 23
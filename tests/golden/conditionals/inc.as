@@ -0,0 +1,2 @@
+#define INC_VALUE 7
+int inc;
@@ -0,0 +1,42 @@
+#define LEVEL 2
+#define ZERO 0
+#include "inc.as"
+#if LEVEL == 1
+int one;
+#elif LEVEL == 2
+int two;
+#elif LEVEL > 1
+int taken_already;
+#else
+int other;
+#endif
+#ifdef MISSING
+int missing;
+#include "absent.as"
+#elif ZERO
+int zero;
+#else
+int fallback = LEVEL;
+#endif
+#ifndef MISSING
+#if ZERO
+int outer_off;
+#ifdef LEVEL
+int nested_in_inactive;
+#else
+int nested_else_in_inactive;
+#endif
+#else
+int outer_else;
+#endif
+#endif
+#if ZERO
+#else
+int after_else;
+#elif LEVEL
+int elif_after_else;
+#endif
+#else
+int else_without_if;
+#endif
+int end = INC_VALUE;
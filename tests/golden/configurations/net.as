@@ -0,0 +1,5 @@
+#ifdef SERVER
+void Listen( int port = PORT );
+#else
+void Connect( int port = PORT );
+#endif
@@ -0,0 +1,16 @@
+#define PORT 4000
+#include "net.as"
+#ifdef DEBUG
+#define LOG_LEVEL 3
+#else
+#define LOG_LEVEL 1
+#endif
+#if LOG_LEVEL > 2
+void Trace();
+#endif
+int level = LOG_LEVEL;
+#ifdef SERVER
+#include "server.as"
+#endif
+#define SCALE#( x ) ( x ) * TIMEOUT
+int timeout = SCALE( 2 );
@@ -0,0 +1 @@
+int clients = 0;
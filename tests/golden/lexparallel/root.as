@@ -0,0 +1,22 @@
+int a = 1; /* block comment "with quote
+   and 'apostrophe' \" escaped
+   // not a line comment
+*/ int b = 2;
+string s = "first line \" quoted
+second line \\
+third line /* not a comment */ 'x'
+";
+char c = '\''; char d = '\\'; // line comment with " quote and /* opener
+string t = "ends with backslash \\"; int e = 3;
+/* comment
+with "string" inside
+and escaped \*/ int f = 4;
+string u = "string // with slashes
+and /* comment opener */ inside";
+char g = '"'; char h = '/'; /* "
+*/ string v = "'";
+#define X "macro \" string" /* spanning
+   comment */ int
+string w = "\\\"
+\\";
+int z = 5;
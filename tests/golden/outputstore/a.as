@@ -0,0 +1,3 @@
+int a;
+#include "common.as"
+int a_end;
@@ -0,0 +1,3 @@
+int b;
+#include "common.as"
+int b_end;
@@ -0,0 +1,2 @@
+int shared_a;
+int shared_b;
@@ -0,0 +1,10 @@
+#define ADD #(a, b) ((a) + (b))
+#define TWICE #(x) ADD(x, x)
+int v = TWICE(3);
+int w = ADD(1,
+    2);
+string s = "text";
+#define LEVEL 2
+#if LEVEL > 1
+int level = LEVEL;
+#endif
@@ -0,0 +1,4 @@
+#define N 10
+int a = N; // comment
+string s = "x";
+float f = 1.5f;
@@ -0,0 +1,389 @@
+// Preprocesses many root files in parallel, outputs are written to directory with make depfiles
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#if defined(_WIN32)
+    #include <direct.h>
+#endif
+
+#include "../preprocessor.h"
+
+struct Options
+{
+    std::vector<std::string>                       Roots;
+    std::vector<std::pair<char, std::string> >     Macros;         // 'D' or 'U' with argument, in command line order
+    std::vector<std::string>                       IncludeDirs;    // With trailing slash
+    std::string                                    OutputDir;      // Empty prints to stdout
+    std::string                                    StoreFile;
+    std::string                                    TraceFile;
+    unsigned int                                   Jobs;
+    bool                                           Stats;
+    bool                                           SkipPragmas;
+    bool                                           Prefetch;       // Includes are read ahead by Preprocessor::PrefetchLoader
+
+    Options() : Jobs( 0 ), Stats( false ), SkipPragmas( false ), Prefetch( true ) {}
+};
+
+struct Result
+{
+    int         ErrorsCount;
+    std::string Errors;
+    size_t      Output;                     // Root in output store if printed to stdout or stored
+};
+
+/************************************************************************/
+/* Include search                                                       */
+/************************************************************************/
+
+// Includes not found next to including file are looked up next to file it was really loaded
+// from and then in include dirs. Preprocessor asks translator right before loading include.
+struct SearchLoader: public Preprocessor::FileLoader, public Preprocessor::IncludeFileTranslator
+{
+    Preprocessor*                      Owner;
+    const std::vector<std::string>*    IncludeDirs;
+    Preprocessor::FileLoader*          Source;         // Reads tried paths, files are read directly if NULL
+    std::string                        Include;        // Name of #include being loaded
+    std::string                        IncludeFrom;    // Directory of file including it
+    std::map<std::string, std::string> Found;          // Path known to preprocessor -> path loaded
+
+    SearchLoader( Preprocessor* owner, const std::vector<std::string>* include_dirs ) : Owner( owner ), IncludeDirs( include_dirs ), Source( NULL ) {}
+
+    virtual void Call( std::string& file )
+    {
+        Include = file;
+        std::map<std::string, std::string>::iterator it = Found.find( Owner->RootPath + Owner->CurrentFile );
+        IncludeFrom = ( it != Found.end() ? it->second.substr( 0, it->second.find_last_of( '/' ) + 1 ) : std::string() );
+    }
+
+    virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+    {
+        std::string include = Include;
+        Include.clear();
+
+        std::string path = dir + file_name;
+        std::vector<std::string> tries( 1, path );
+        if( !include.empty() )
+        {
+            if( !IncludeFrom.empty() )
+                tries.push_back( IncludeFrom + include );
+            for( size_t i = 0; i < IncludeDirs->size(); i++ )
+                tries.push_back( ( *IncludeDirs )[i] + include );
+        }
+
+        for( size_t i = 0; i < tries.size(); i++ )
+        {
+            if( Source ? Source->LoadFile( "", tries[i], data ) : FileLoader::LoadFile( "", tries[i], data ) )
+            {
+                Found[path] = tries[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string Resolve( const std::string& path ) const
+    {
+        std::map<std::string, std::string>::const_iterator it = Found.find( path );
+        return it != Found.end() ? it->second : path;
+    }
+};
+
+/************************************************************************/
+/* Output                                                               */
+/************************************************************************/
+
+// Root path below output dir, leading "/" and "./" dropped and ".." replaced
+static std::string OutputPath( const Options& options, const std::string& root )
+{
+    std::string relative;
+    size_t      pos = 0;
+    while( pos < root.size() )
+    {
+        size_t      slash = root.find( '/', pos );
+        std::string part = root.substr( pos, slash == std::string::npos ? std::string::npos : slash - pos );
+        pos = ( slash == std::string::npos ? root.size() : slash + 1 );
+        if( part.empty() || part == "." )
+            continue;
+        relative += ( relative.empty() ? "" : "/" ) + ( part == ".." ? std::string( "__" ) : part );
+    }
+    return options.OutputDir + "/" + relative;
+}
+
+static void MakeDirs( const std::string& path )
+{
+    for( size_t slash = path.find( '/', 1 ); slash != std::string::npos; slash = path.find( '/', slash + 1 ) )
+    {
+        std::string dir = path.substr( 0, slash );
+        #if defined(_WIN32)
+        _mkdir( dir.c_str() );
+        #else
+        mkdir( dir.c_str(), 0777 );
+        #endif
+    }
+}
+
+static std::string EscapeMake( const std::string& path )
+{
+    std::string out;
+    for( size_t i = 0; i < path.size(); i++ )
+    {
+        if( path[i] == ' ' || path[i] == '#' )
+            out += '\\';
+        else if( path[i] == '$' )
+            out += '$';
+        out += path[i];
+    }
+    return out;
+}
+
+static bool WriteFile( const std::string& path, const std::string& text )
+{
+    FILE* fs = fopen( path.c_str(), "wb" );
+    if( !fs )
+        return false;
+    bool ok = ( fwrite( text.data(), 1, text.size(), fs ) == text.size() );
+    return ( fclose( fs ) == 0 && ok );
+}
+
+// Target depends on all preprocessed files, each of them gets empty rule so deleted ones do not break make
+static std::string Depfile( const std::string& target, const std::vector<std::string>& files )
+{
+    std::string text = EscapeMake( target ) + ":";
+    for( size_t i = 0; i < files.size(); i++ )
+        text += " \\\n  " + EscapeMake( files[i] );
+    text += "\n";
+    for( size_t i = 1; i < files.size(); i++ )
+        text += "\n" + EscapeMake( files[i] ) + ":\n";
+    return text;
+}
+
+/************************************************************************/
+/* Jobs                                                                 */
+/************************************************************************/
+
+// Outputs printed to stdout are kept in store, roots mostly share included text
+static void Run( const Options& options, std::atomic<size_t>& next, std::vector<Result>& results, Preprocessor::OutputStore* store,
+                 Preprocessor::Statistics* total, std::mutex* locker, Preprocessor::Trace* trace )
+{
+    Preprocessor             preprocessor;
+    SearchLoader             loader( &preprocessor, &options.IncludeDirs );
+    Preprocessor::Statistics stats;
+
+    // Each job reads ahead with loader of its own, completions are taken on job thread
+    std::unique_ptr<Preprocessor::AsyncFileLoader> async( options.Prefetch ? Preprocessor::AsyncFileLoader::Create( 16 ) : NULL );
+    std::unique_ptr<Preprocessor::PrefetchLoader>  prefetch( async ? new Preprocessor::PrefetchLoader( async.get() ) : NULL );
+    loader.Source = prefetch.get();
+
+    preprocessor.SetReuse( true );
+    preprocessor.IncludeTranslator = &loader;
+    if( total )
+        preprocessor.SetStatistics( &stats );
+    if( trace )
+        preprocessor.SetTrace( trace );
+    for( size_t i = 0; i < options.Macros.size(); i++ )
+    {
+        const std::string& arg = options.Macros[i].second;
+        size_t             eq = arg.find( '=' );
+        if( options.Macros[i].first == 'U' )
+            preprocessor.Undef( arg );
+        else if( eq == std::string::npos )
+            preprocessor.Define( arg );
+        else
+            preprocessor.Define( arg.substr( 0, eq ), arg.substr( eq + 1 ) );
+    }
+
+    for( size_t index = next++; index < options.Roots.size(); index = next++ )
+    {
+        const std::string&            root = options.Roots[index];
+        Result&                       result = results[index];
+        Preprocessor::StringOutStream out, errors;
+        loader.Found.clear();
+        result.ErrorsCount = preprocessor.Preprocess( root, out, &errors, &loader, options.SkipPragmas );
+        result.Errors = errors.String;
+        // Files read ahead for inactive includes are not kept for next root
+        if( prefetch )
+            prefetch->Clear();
+        bool keep = ( !result.ErrorsCount && ( options.OutputDir.empty() || !options.StoreFile.empty() ) );
+        if( total || keep )
+        {
+            std::lock_guard<std::mutex> lock( *locker );
+            if( total )
+                total->Add( stats );
+            if( keep )
+                result.Output = store->Add( out.String, preprocessor.GetLineNumberTranslator() );
+        }
+        if( options.OutputDir.empty() || result.ErrorsCount )
+            continue;
+
+        std::string              target = OutputPath( options, root );
+        std::vector<std::string> files = preprocessor.GetFilesPreprocessed();
+        for( size_t i = 0; i < files.size(); i++ )
+            files[i] = loader.Resolve( files[i] );
+        MakeDirs( target );
+        if( !WriteFile( target, out.String ) || !WriteFile( target + ".d", Depfile( target, files ) ) )
+        {
+            result.ErrorsCount++;
+            result.Errors += "Unable to write output file <" + target + ">\n";
+        }
+    }
+}
+
+static bool ReadManifest( const std::string& path, std::vector<std::string>& roots )
+{
+    std::ifstream fs( path.c_str() );
+    if( !fs )
+        return false;
+    std::string line;
+    while( std::getline( fs, line ) )
+    {
+        size_t begin = line.find_first_not_of( " \t\r" );
+        if( begin == std::string::npos || line[begin] == '#' )
+            continue;
+        size_t end = line.find_last_not_of( " \t\r" );
+        roots.push_back( line.substr( begin, end - begin + 1 ) );
+    }
+    return true;
+}
+
+static void Usage()
+{
+    fprintf( stderr,
+             "Usage: preprocess [options] script_file... [@manifest_file]...\n\n"
+             "  -D name[=value]     define macro\n"
+             "  -U name             undefine macro\n"
+             "  -I dir              search dir for includes not found next to including file\n"
+             "  -j N                parallel jobs, 0 for all cores\n"
+             "  -o dir              write outputs and make depfiles ( output.d ) to dir, stdout otherwise\n"
+             "  --store file        save outputs to Preprocessor::OutputStore file, identical parts are saved once\n"
+             "  --manifest file     read root files from file, one per line\n"
+             "  --skip-pragmas      do not process pragmas\n"
+             "  --no-prefetch       read files one at a time instead of reading includes ahead\n"
+             "  --stats             print statistics summed over all roots to stderr\n"
+             "  --trace file        write Chrome trace timeline of all jobs\n\n" );
+    exit( EXIT_FAILURE );
+}
+
+int main( int argc, char** argv )
+{
+    Options options;
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string opt = argv[i];
+        if( opt == "--stats" )
+            options.Stats = true;
+        else if( opt == "--skip-pragmas" )
+            options.SkipPragmas = true;
+        else if( opt == "--no-prefetch" )
+            options.Prefetch = false;
+        else if( opt[0] == '@' || opt == "--manifest" )
+        {
+            std::string manifest = ( opt[0] == '@' ? opt.substr( 1 ) : ( ++i < argc ? argv[i] : "" ) );
+            if( !ReadManifest( manifest, options.Roots ) )
+            {
+                fprintf( stderr, "Unable to read manifest <%s>\n", manifest.c_str() );
+                return( EXIT_FAILURE );
+            }
+        }
+        else if( opt == "--trace" || opt == "--store" )
+        {
+            if( ++i >= argc )
+                Usage();
+            ( opt == "--trace" ? options.TraceFile : options.StoreFile ) = argv[i];
+        }
+        else if( opt.size() >= 2 && opt[0] == '-' && strchr( "DUIjo", opt[1] ) )
+        {
+            // Argument may be attached
+            std::string val = opt.substr( 2 );
+            if( val.empty() )
+            {
+                if( ++i >= argc )
+                    Usage();
+                val = argv[i];
+            }
+            if( opt[1] == 'D' || opt[1] == 'U' )
+                options.Macros.push_back( std::make_pair( opt[1], val ) );
+            else if( opt[1] == 'I' )
+                options.IncludeDirs.push_back( val + ( val[val.size() - 1] == '/' ? "" : "/" ) );
+            else if( opt[1] == 'j' )
+                options.Jobs = (unsigned int) strtoul( val.c_str(), NULL, 10 );
+            else
+                options.OutputDir = val;
+        }
+        else if( opt[0] == '-' )
+            Usage();
+        else
+            options.Roots.push_back( opt );
+    }
+    if( options.Roots.empty() )
+        Usage();
+
+    unsigned int jobs = options.Jobs ? options.Jobs : std::max( 1U, std::thread::hardware_concurrency() );
+    jobs = std::min( jobs, (unsigned int) options.Roots.size() );
+
+    Preprocessor::OutputStore             store;
+    Preprocessor::Statistics              total;
+    std::mutex                            locker;
+    Preprocessor::Trace                   trace;
+    std::vector<Result>                   results( options.Roots.size() );
+    std::atomic<size_t>                   next( 0 );
+    std::vector<std::thread>              threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for( unsigned int t = 1; t < jobs; t++ )
+        threads.push_back( std::thread( Run, std::cref( options ), std::ref( next ), std::ref( results ), &store,
+                                        options.Stats ? &total : NULL, &locker, options.TraceFile.empty() ? NULL : &trace ) );
+    Run( options, next, results, &store, options.Stats ? &total : NULL, &locker, options.TraceFile.empty() ? NULL : &trace );
+    for( size_t t = 0; t < threads.size(); t++ )
+        threads[t].join();
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    int failed = 0;
+    for( size_t i = 0; i < results.size(); i++ )
+    {
+        if( !results[i].Errors.empty() )
+            fprintf( stderr, "%s", results[i].Errors.c_str() );
+        if( results[i].ErrorsCount )
+        {
+            fprintf( stderr, "Unable to preprocess file <%s>\n", options.Roots[i].c_str() );
+            failed++;
+        }
+        else if( options.OutputDir.empty() )
+        {
+            Preprocessor::StringOutStream out;
+            store.Write( results[i].Output, out );
+            fprintf( stdout, "%s\n", out.String.c_str() );
+        }
+    }
+    if( !options.StoreFile.empty() && !store.Save( options.StoreFile ) )
+    {
+        fprintf( stderr, "Unable to write output store <%s>\n", options.StoreFile.c_str() );
+        failed++;
+    }
+
+    if( options.Stats )
+    {
+        Preprocessor::StringOutStream out;
+        total.Print( out );
+        fprintf( stderr, "roots %u\njobs %u\nwall_time %.6f\n%s", (unsigned int) results.size(), jobs, elapsed, out.String.c_str() );
+    }
+    if( !options.TraceFile.empty() )
+    {
+        Preprocessor::StringOutStream out;
+        trace.PrintJSON( out );
+        if( !WriteFile( options.TraceFile, out.String ) )
+        {
+            fprintf( stderr, "Unable to write trace <%s>\n", options.TraceFile.c_str() );
+            failed++;
+        }
+    }
+
+    return( failed ? EXIT_FAILURE : EXIT_SUCCESS );
+}
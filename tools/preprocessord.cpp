@@ -0,0 +1,662 @@
+// Preprocessing daemon, requests are served on Unix domain socket by worker threads sharing
+// file, lexem and output caches. Cached files and outputs are dropped on change by inotify watcher,
+// without it files are checked by stat() on each use and outputs are not cached. SIGINT and SIGTERM
+// stop accepting, replies being prepared are still sent.
+//
+// Messages in both directions, little-endian:
+//   unsigned int Count
+//   Count times: unsigned int NameSize, char Name[NameSize], unsigned int ValueSize, char Value[ValueSize]
+// Request fields:  root, define ("NAME" or "NAME value"), undef, flag ("skip_pragmas", "no_cache")
+// Response fields: errors_count, output, errors, line ("start_line offset file" of line map entry),
+//                  dependency, file, pragma, cached ("1" if output came from cache)
+// Connection may carry several requests, relative paths are resolved by daemon.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../preprocessor.h"
+
+typedef std::vector<std::pair<std::string, std::string> > Message;
+
+static const char* SocketPath = "/tmp/preprocessord.sock";
+static int         StopPipe[2] = { -1, -1 };    // Written by signal handler, read end is polled with socket
+
+/************************************************************************/
+/* Protocol                                                             */
+/************************************************************************/
+
+static bool ReadAll( int fd, void* buffer, size_t size )
+{
+    char* ptr = (char*) buffer;
+    while( size )
+    {
+        ssize_t n = read( fd, ptr, size );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return false;
+        ptr += n;
+        size -= (size_t) n;
+    }
+    return true;
+}
+
+static bool WriteAll( int fd, const void* buffer, size_t size )
+{
+    const char* ptr = (const char*) buffer;
+    while( size )
+    {
+        ssize_t n = write( fd, ptr, size );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return false;
+        ptr += n;
+        size -= (size_t) n;
+    }
+    return true;
+}
+
+static bool ReadUInt( int fd, unsigned int& value )
+{
+    unsigned char bytes[4];
+    if( !ReadAll( fd, bytes, 4 ) )
+        return false;
+    value = bytes[0] | ( bytes[1] << 8 ) | ( bytes[2] << 16 ) | ( (unsigned int) bytes[3] << 24 );
+    return true;
+}
+
+static bool ReadString( int fd, std::string& str )
+{
+    unsigned int size;
+    if( !ReadUInt( fd, size ) || size > 256 * 1024 * 1024 )
+        return false;
+    str.resize( size );
+    return !size || ReadAll( fd, &str[0], size );
+}
+
+static bool ReadMessage( int fd, Message& msg )
+{
+    unsigned int count;
+    if( !ReadUInt( fd, count ) || count > 1024 * 1024 )
+        return false;
+    msg.resize( count );
+    for( unsigned int i = 0; i < count; i++ )
+        if( !ReadString( fd, msg[i].first ) || !ReadString( fd, msg[i].second ) )
+            return false;
+    return true;
+}
+
+static void AppendUInt( std::string& out, unsigned int value )
+{
+    char bytes[4] = { (char) value, (char) ( value >> 8 ), (char) ( value >> 16 ), (char) ( value >> 24 ) };
+    out.append( bytes, 4 );
+}
+
+static bool WriteMessage( int fd, const Message& msg )
+{
+    std::string out;
+    AppendUInt( out, (unsigned int) msg.size() );
+    for( size_t i = 0; i < msg.size(); i++ )
+    {
+        AppendUInt( out, (unsigned int) msg[i].first.size() );
+        out += msg[i].first;
+        AppendUInt( out, (unsigned int) msg[i].second.size() );
+        out += msg[i].second;
+    }
+    return WriteAll( fd, out.data(), out.size() );
+}
+
+/************************************************************************/
+/* Caches                                                               */
+/************************************************************************/
+
+struct Cache: public Preprocessor::FileWatcher::Listener, public Preprocessor::LexemCache
+{
+    struct File
+    {
+        long long                                        Modified;
+        unsigned long long                               Size;
+        std::vector<char>                                Data;
+        std::shared_ptr<const Preprocessor::LexemList>   Lexems;     // Of Data, dropped with it
+    };
+
+    Preprocessor::StatCache                                          Stats;
+    Preprocessor::FileWatcher                                        Watcher;
+    bool                                                             Watching;
+
+    std::mutex                                                       Locker;
+    unsigned int                                                     Generation;     // Changes seen by FilesChanged()
+    std::unordered_map<std::string, File>                            Files;         // Path -> content and lexems
+    std::unordered_map<std::string, Message>                         Outputs;
+    std::unordered_map<std::string, std::unordered_set<std::string> > Dependents;    // File -> keys of outputs
+
+    Cache() : Watcher( &Stats, this ), Generation( 0 )
+    {
+        Watching = Watcher.Open();
+    }
+
+    virtual void FilesChanged( const std::vector<std::string>& paths )
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        for( size_t i = 0; i < paths.size(); i++ )
+        {
+            Files.erase( paths[i] );
+            std::unordered_map<std::string, std::unordered_set<std::string> >::iterator it = Dependents.find( paths[i] );
+            if( it == Dependents.end() )
+                continue;
+            for( std::unordered_set<std::string>::iterator key = it->second.begin(); key != it->second.end(); ++key )
+                Outputs.erase( *key );
+            Dependents.erase( it );
+        }
+        Generation++;
+    }
+
+    unsigned int GetGeneration()
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        return Generation;
+    }
+
+    // Anything read before change is reported may be stale, it is not stored if generation moved
+    bool Load( const std::string& path, std::vector<char>& data )
+    {
+        if( Watching )
+            Watcher.Watch( std::vector<std::string>( 1, path ) );
+        else
+            Stats.Invalidate( path );
+
+        unsigned int                     generation = GetGeneration();
+        Preprocessor::StatCache::Entry   st;
+        if( !Stats.Get( path, st ) )
+            return false;
+        {
+            std::lock_guard<std::mutex> lock( Locker );
+            std::unordered_map<std::string, File>::iterator it = Files.find( path );
+            if( it != Files.end() && it->second.Modified == st.Modified && it->second.Size == st.Size )
+            {
+                data = it->second.Data;
+                return true;
+            }
+        }
+
+        Preprocessor::FileLoader loader;
+        if( !loader.LoadFile( "", path, data ) )
+            return false;
+
+        std::lock_guard<std::mutex> lock( Locker );
+        if( Generation == generation )
+        {
+            File& file = Files[path];
+            file.Modified = st.Modified;
+            file.Size = st.Size;
+            file.Data = data;
+            file.Lexems.reset();
+        }
+        return true;
+    }
+
+    // Lexems are used only while cached content is what preprocessor got from Load()
+    virtual bool Load( const std::string& path, const char* data, size_t size, Preprocessor::LexemList& lexems )
+    {
+        std::shared_ptr<const Preprocessor::LexemList> cached;
+        {
+            std::lock_guard<std::mutex> lock( Locker );
+            std::unordered_map<std::string, File>::iterator it = Files.find( path );
+            if( it == Files.end() || !SameData( it->second, data, size ) )
+                return false;
+            cached = it->second.Lexems;
+        }
+        if( !cached )
+            return false;
+        lexems.insert( lexems.end(), cached->begin(), cached->end() );
+        return true;
+    }
+
+    virtual void Store( const std::string& path, const char* data, size_t size, const Preprocessor::LexemList& lexems )
+    {
+        std::shared_ptr<const Preprocessor::LexemList> copy = std::make_shared<const Preprocessor::LexemList>( lexems );
+        std::lock_guard<std::mutex> lock( Locker );
+        std::unordered_map<std::string, File>::iterator it = Files.find( path );
+        if( it != Files.end() && SameData( it->second, data, size ) )
+            it->second.Lexems = copy;
+    }
+
+    static bool SameData( const File& file, const char* data, size_t size )
+    {
+        return file.Data.size() == size && ( !size || !memcmp( &file.Data[0], data, size ) );
+    }
+
+    bool FindOutput( const std::string& key, Message& response )
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        std::unordered_map<std::string, Message>::iterator it = Outputs.find( key );
+        if( it == Outputs.end() )
+            return false;
+        response = it->second;
+        return true;
+    }
+
+    void StoreOutput( const std::string& key, const Message& response, const std::vector<std::string>& files, unsigned int generation )
+    {
+        std::lock_guard<std::mutex> lock( Locker );
+        if( Generation != generation )
+            return;
+        Outputs[key] = response;
+        for( size_t i = 0; i < files.size(); i++ )
+            Dependents[files[i]].insert( key );
+    }
+};
+
+struct CacheLoader: public Preprocessor::FileLoader
+{
+    Cache* Files;
+
+    CacheLoader( Cache* files ) : Files( files ) {}
+
+    virtual bool LoadFile( const std::string& dir, const std::string& file_name, std::vector<char>& data )
+    {
+        return Files->Load( dir + file_name, data );
+    }
+};
+
+/************************************************************************/
+/* Server                                                               */
+/************************************************************************/
+
+// Idle connections are polled by accept loop, connection with request waiting is queued and worker
+// serves that one request, then gives connection back, so no worker stays bound to a connection
+struct Server
+{
+    Cache                   Caches;
+    CacheLoader             Loader;
+    std::mutex              Locker;
+    std::condition_variable Wake;
+    std::deque<int>         Ready;          // Connections with request waiting
+    std::unordered_set<int> Serving;        // Connections taken by workers
+    std::vector<int>        Returned;       // Served connections, polled again by accept loop
+    int                     ReturnFd;       // Write end of pipe polled by accept loop
+    bool                    Stopping;
+
+    Server( int return_fd ) : Loader( &Caches ), ReturnFd( return_fd ), Stopping( false ) {}
+
+    void Run()
+    {
+        // Each worker keeps own preprocessor with warm buffers
+        Preprocessor preprocessor;
+        preprocessor.SetReuse( true );
+        preprocessor.SetLexemCache( &Caches );
+        while( true )
+        {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock( Locker );
+                while( Ready.empty() && !Stopping )
+                    Wake.wait( lock );
+                if( Stopping )
+                    return;
+                fd = Ready.front();
+                Ready.pop_front();
+                Serving.insert( fd );
+            }
+
+            Message request, response;
+            bool    keep = ReadMessage( fd, request );
+            if( keep )
+            {
+                Handle( preprocessor, request, response );
+                keep = WriteMessage( fd, response );
+            }
+            {
+                std::lock_guard<std::mutex> lock( Locker );
+                Serving.erase( fd );
+                if( keep )
+                    Returned.push_back( fd );
+            }
+            if( !keep )
+                close( fd );
+            else
+            {
+                // Full pipe means accept loop is woken already
+                char    byte = 0;
+                ssize_t written = write( ReturnFd, &byte, 1 );
+                (void) written;
+            }
+        }
+    }
+
+    // Connections with request waiting are dropped, served ones end after reply to request being handled
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock( Locker );
+            Stopping = true;
+            for( size_t i = 0; i < Ready.size(); i++ )
+                close( Ready[i] );
+            Ready.clear();
+            for( std::unordered_set<int>::iterator it = Serving.begin(); it != Serving.end(); ++it )
+                shutdown( *it, SHUT_RD );
+        }
+        Wake.notify_all();
+    }
+
+    void Handle( Preprocessor& preprocessor, const Message& request, Message& response )
+    {
+        std::string root, key;
+        bool        skip_pragmas = false, cacheable = Caches.Watching;
+        for( size_t i = 0; i < request.size(); i++ )
+        {
+            const std::string& name = request[i].first;
+            const std::string& value = request[i].second;
+            if( name == "root" )
+                root = value;
+            else if( name == "flag" && value == "skip_pragmas" )
+                skip_pragmas = true;
+            else if( name == "flag" && value == "no_cache" )
+                cacheable = false;
+            // Fields may contain any bytes, sizes keep key unambiguous
+            AppendUInt( key, (unsigned int) name.size() );
+            key += name;
+            AppendUInt( key, (unsigned int) value.size() );
+            key += value;
+        }
+
+        response.clear();
+        if( cacheable && Caches.FindOutput( key, response ) )
+        {
+            response.push_back( std::make_pair( "cached", "1" ) );
+            return;
+        }
+
+        unsigned int generation = Caches.GetGeneration();
+        preprocessor.UndefAll();
+        for( size_t i = 0; i < request.size(); i++ )
+        {
+            if( request[i].first == "define" )
+                preprocessor.Define( request[i].second );
+            else if( request[i].first == "undef" )
+                preprocessor.Undef( request[i].second );
+        }
+
+        Preprocessor::StringOutStream out, errors;
+        int                           errors_count = ( root.empty() ? 1 : 0 );
+        if( root.empty() )
+            errors.String = "Request has no root.\n";
+        else
+            errors_count = preprocessor.Preprocess( root, out, &errors, &Loader, skip_pragmas );
+
+        response.push_back( std::make_pair( "errors_count", Preprocessor::IntToString( errors_count ) ) );
+        response.push_back( std::make_pair( "output", out.String ) );
+        response.push_back( std::make_pair( "errors", errors.String ) );
+        if( root.empty() )
+            return;
+
+        std::vector<Preprocessor::LineNumberTranslator::Entry>& lines = preprocessor.GetLineNumberTranslator()->lines;
+        for( size_t i = 0; i < lines.size(); i++ )
+            response.push_back( std::make_pair( "line", Preprocessor::IntToString( lines[i].StartLine ) + " " +
+                                                Preprocessor::IntToString( lines[i].Offset ) + " " + lines[i].File ) );
+        std::vector<std::string>& dependencies = preprocessor.GetFileDependencies();
+        for( size_t i = 0; i < dependencies.size(); i++ )
+            response.push_back( std::make_pair( "dependency", dependencies[i] ) );
+        std::vector<std::string>& files = preprocessor.GetFilesPreprocessed();
+        for( size_t i = 0; i < files.size(); i++ )
+            response.push_back( std::make_pair( "file", files[i] ) );
+        std::vector<std::string>& pragmas = preprocessor.GetParsedPragmas();
+        for( size_t i = 0; i < pragmas.size(); i++ )
+            response.push_back( std::make_pair( "pragma", pragmas[i] ) );
+
+        if( cacheable && !errors_count )
+            Caches.StoreOutput( key, response, files, generation );
+    }
+};
+
+static void Stop( int /*sig*/ )
+{
+    // Full pipe means stop is pending already
+    int     saved = errno;
+    char    byte = 0;
+    ssize_t written = write( StopPipe[1], &byte, 1 );
+    (void) written;
+    errno = saved;
+}
+
+static int Connect( const char* path, bool listen_on )
+{
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if( strlen( path ) >= sizeof( addr.sun_path ) )
+        return -1;
+    strcpy( addr.sun_path, path );
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 )
+        return -1;
+    if( listen_on )
+    {
+        unlink( path );
+        if( bind( fd, (struct sockaddr*) &addr, sizeof( addr ) ) == 0 && listen( fd, 64 ) == 0 )
+            return fd;
+    }
+    else if( connect( fd, (struct sockaddr*) &addr, sizeof( addr ) ) == 0 )
+        return fd;
+    close( fd );
+    return -1;
+}
+
+static int Serve( unsigned int threads )
+{
+    int fd = Connect( SocketPath, true );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "Unable to listen on socket <%s>\n", SocketPath );
+        return( EXIT_FAILURE );
+    }
+    int returned[2];
+    if( pipe( StopPipe ) != 0 || pipe( returned ) != 0 )
+    {
+        fprintf( stderr, "Unable to create wake pipes\n" );
+        close( fd );
+        unlink( SocketPath );
+        return( EXIT_FAILURE );
+    }
+    signal( SIGPIPE, SIG_IGN );
+    signal( SIGINT, Stop );
+    signal( SIGTERM, Stop );
+
+    Server server( returned[1] );
+    if( !server.Caches.Watching )
+        fprintf( stderr, "File watching is not available, outputs are not cached\n" );
+    std::vector<std::thread> workers;
+    for( unsigned int i = 0; i < threads; i++ )
+        workers.push_back( std::thread( &Server::Run, &server ) );
+
+    // Listening socket, stop and return pipes, then idle connections
+    std::vector<int>           idle;
+    std::vector<struct pollfd> fds;
+    int                        result = EXIT_SUCCESS;
+    while( true )
+    {
+        {
+            std::lock_guard<std::mutex> lock( server.Locker );
+            idle.insert( idle.end(), server.Returned.begin(), server.Returned.end() );
+            server.Returned.clear();
+        }
+        fds.resize( 3 + idle.size() );
+        fds[0].fd = fd;
+        fds[1].fd = StopPipe[0];
+        fds[2].fd = returned[0];
+        for( size_t i = 0; i < idle.size(); i++ )
+            fds[3 + i].fd = idle[i];
+        for( size_t i = 0; i < fds.size(); i++ )
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if( poll( &fds[0], (nfds_t) fds.size(), -1 ) < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            fprintf( stderr, "Unable to wait for connection\n" );
+            result = EXIT_FAILURE;
+            break;
+        }
+        if( fds[1].revents )
+            break;
+        if( fds[2].revents )
+        {
+            char    bytes[64];
+            ssize_t drained = read( returned[0], bytes, sizeof( bytes ) );
+            (void) drained;
+        }
+
+        // Readable or hung up connection goes to worker, which closes it at end of stream
+        size_t kept = 0, queued = 0;
+        for( size_t i = 0; i < idle.size(); i++ )
+        {
+            if( !fds[3 + i].revents )
+                idle[kept++] = idle[i];
+            else
+            {
+                std::lock_guard<std::mutex> lock( server.Locker );
+                server.Ready.push_back( idle[i] );
+                queued++;
+            }
+        }
+        idle.resize( kept );
+        for( size_t i = 0; i < queued; i++ )
+            server.Wake.notify_one();
+
+        if( !fds[0].revents )
+            continue;
+        int connection = accept( fd, NULL, NULL );
+        if( connection < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            fprintf( stderr, "Unable to accept connection\n" );
+            result = EXIT_FAILURE;
+            break;
+        }
+        idle.push_back( connection );
+    }
+
+    close( fd );
+    unlink( SocketPath );
+    server.Stop();
+    for( size_t i = 0; i < workers.size(); i++ )
+        workers[i].join();
+    idle.insert( idle.end(), server.Returned.begin(), server.Returned.end() );
+    for( size_t i = 0; i < idle.size(); i++ )
+        close( idle[i] );
+    close( returned[0] );
+    close( returned[1] );
+    return result;
+}
+
+/************************************************************************/
+/* Client                                                               */
+/************************************************************************/
+
+static int Request( const Message& request )
+{
+    int fd = Connect( SocketPath, false );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "Unable to connect to socket <%s>\n", SocketPath );
+        return( EXIT_FAILURE );
+    }
+
+    Message response;
+    bool    ok = WriteMessage( fd, request ) && ReadMessage( fd, response );
+    close( fd );
+    if( !ok )
+    {
+        fprintf( stderr, "Request failed\n" );
+        return( EXIT_FAILURE );
+    }
+
+    int errors_count = 1;
+    for( size_t i = 0; i < response.size(); i++ )
+    {
+        if( response[i].first == "errors_count" )
+            errors_count = atoi( response[i].second.c_str() );
+        else if( response[i].first == "output" )
+            fprintf( stdout, "%s\n", response[i].second.c_str() );
+        else if( response[i].first == "errors" && !response[i].second.empty() )
+            fprintf( stderr, "%s", response[i].second.c_str() );
+    }
+    return( errors_count ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+static void Usage()
+{
+    fprintf( stderr,
+             "Usage: preprocessord [--socket path] [-j threads]\n"
+             "       preprocessord [--socket path] --request script_file [-D name[=value]]... [-U name]...\n"
+             "                     [--skip-pragmas] [--no-cache]\n\n" );
+    exit( EXIT_FAILURE );
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int threads = std::max( 1U, std::thread::hardware_concurrency() );
+    Message      request;
+    bool         client = false;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string opt = argv[i];
+        if( opt == "--skip-pragmas" )
+        {
+            request.push_back( std::make_pair( "flag", "skip_pragmas" ) );
+            continue;
+        }
+        if( opt == "--no-cache" )
+        {
+            request.push_back( std::make_pair( "flag", "no_cache" ) );
+            continue;
+        }
+        if( i + 1 >= argc )
+            Usage();
+
+        std::string val = argv[++i];
+        if( opt == "--socket" )
+            SocketPath = argv[i];
+        else if( opt == "-j" )
+            threads = std::max( 1, atoi( val.c_str() ) );
+        else if( opt == "--request" )
+        {
+            // Daemon may run in other directory
+            char path[PATH_MAX];
+            request.push_back( std::make_pair( "root", realpath( val.c_str(), path ) ? std::string( path ) : val ) );
+            client = true;
+        }
+        else if( opt == "-D" )
+        {
+            size_t eq = val.find( '=' );
+            request.push_back( std::make_pair( "define", eq == std::string::npos ? val : val.substr( 0, eq ) + " " + val.substr( eq + 1 ) ) );
+        }
+        else if( opt == "-U" )
+            request.push_back( std::make_pair( "undef", val ) );
+        else
+            Usage();
+    }
+
+    if( client )
+        return Request( request );
+    if( !request.empty() )
+        Usage();
+    return Serve( threads );
+}